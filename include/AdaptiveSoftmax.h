@@ -0,0 +1,71 @@
+#ifndef ADAPTIVE_SOFTMAX_H
+#define ADAPTIVE_SOFTMAX_H
+
+#include "ParameterStore.h"
+#include <Eigen/Dense>
+#include <string>
+#include <vector>
+
+// Adaptive softmax output layer (Grave et al.) for a vocabulary whose IDs are
+// sorted by decreasing frequency. The head scores the shortlist (IDs below
+// cutoffs[0]) plus one entry per tail cluster; tail cluster k covers IDs
+// [cutoffs[k], cutoffs[k + 1]) (the last one ends at vocab_size) and scores
+// them on a projection of the hidden state to embedding_dim / 4^(k + 1)
+// columns. A shortlist word's probability is its head probability, any other
+// word's is its cluster's head probability times its probability within the
+// cluster. Training only scores the clusters of the targets.
+class AdaptiveSoftmax {
+private:
+    struct Cluster {
+        int begin;            // First token ID
+        int end;              // One past the last
+        int dim;              // Projected width
+        size_t projection_id; // embedding_dim x dim
+        size_t weights_id;    // (end - begin) x dim, one row per token
+        size_t bias_id;
+    };
+
+    ParameterStore* store;
+    int vocab_size;
+    int embedding_dim;
+    int shortlist;                // Words scored by the head
+    size_t head_weights_id;       // (shortlist + clusters) x embedding_dim, one row per head entry
+    size_t head_bias_id;
+    std::vector<Cluster> clusters;
+
+    // Head entry of a token: itself in the shortlist, else its cluster's
+    int head_entry(int token) const;
+
+public:
+    // Registers the head and every cluster in store. cutoffs must increase
+    // strictly within (0, vocab_size).
+    AdaptiveSoftmax(int vocab_size, int embedding_dim, const std::vector<int>& cutoffs, ParameterStore& store,
+                    const std::string& prefix);
+
+    // Draw initial values once the store is allocated
+    void initialize();
+
+    std::vector<int> get_cutoffs() const;
+    int head_size() const { return shortlist + static_cast<int>(clusters.size()); }
+
+    // The layer's tensors are registered consecutively, starting with this one
+    size_t first_tensor_id() const { return head_weights_id; }
+
+    // Cross-entropy for target IDs (mean over the non-negative ones, times
+    // scale). Accumulates parameter gradients into grad_base (store layout;
+    // null means the store's own) and writes the gradient w.r.t. hidden into
+    // grad_hidden. Each tail cluster only sees the rows whose target is in it.
+    // Safe to call concurrently with different grad_base buffers.
+    double loss(const Eigen::Ref<const Eigen::MatrixXd>& hidden, const std::vector<int>& targets, double scale,
+                double* grad_base, Eigen::Ref<Eigen::MatrixXd> grad_hidden) const;
+
+    // The full distribution over the vocabulary, one row per hidden row
+    void predict(const Eigen::Ref<const Eigen::MatrixXd>& hidden, Eigen::Ref<Eigen::MatrixXd> probabilities) const;
+
+    // Arena doubles of scratch loss() and predict() hold at most for rows
+    // hidden rows (on the calling thread)
+    size_t loss_scratch_size(size_t rows) const;
+    size_t predict_scratch_size(size_t rows) const;
+};
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef ALIGNED_BUFFER_H
+#define ALIGNED_BUFFER_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <utility>
+
+// Zero-initialized, cache-line aligned array of doubles. Used for flat
+// parameter, gradient and optimizer state storage.
+class AlignedBuffer {
+private:
+    double* buffer;
+    size_t count;
+
+public:
+    static constexpr size_t alignment = 64;
+    static constexpr size_t doubles_per_line = alignment / sizeof(double);
+
+    // Round a length up so the next tensor starts on a cache line
+    static size_t padded(size_t n) { return (n + doubles_per_line - 1) / doubles_per_line * doubles_per_line; }
+
+    AlignedBuffer() : buffer(nullptr), count(0) {}
+
+    explicit AlignedBuffer(size_t n) : buffer(nullptr), count(n) {
+        if (n == 0) return;
+        buffer = static_cast<double*>(std::aligned_alloc(alignment, padded(n) * sizeof(double)));
+        if (!buffer) throw std::bad_alloc();
+        std::memset(buffer, 0, padded(n) * sizeof(double));
+    }
+
+    ~AlignedBuffer() { std::free(buffer); }
+
+    AlignedBuffer(const AlignedBuffer&) = delete;
+    AlignedBuffer& operator=(const AlignedBuffer&) = delete;
+
+    AlignedBuffer(AlignedBuffer&& other) noexcept : buffer(other.buffer), count(other.count) {
+        other.buffer = nullptr;
+        other.count = 0;
+    }
+
+    AlignedBuffer& operator=(AlignedBuffer&& other) noexcept {
+        std::swap(buffer, other.buffer);
+        std::swap(count, other.count);
+        return *this;
+    }
+
+    double* data() { return buffer; }
+    const double* data() const { return buffer; }
+    size_t size() const { return count; }
+
+    void zero() {
+        if (buffer) std::memset(buffer, 0, count * sizeof(double));
+    }
+};
+
+#endif
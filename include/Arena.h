@@ -0,0 +1,87 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "AlignedBuffer.h"
+#include <Eigen/Dense>
+#include <atomic>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+// Bump-pointer scratch memory for the activations and temporaries of one
+// training or inference step. Every thread has its own arena (local()), so
+// pool tasks allocate without locking. begin_step() invalidates everything
+// handed out so far; each arena rewinds at its first allocation after that.
+// Blocks added while a step grows the arena are merged into one at the
+// rewind, so once the largest step has been seen no step calls malloc.
+//
+// Memory is only valid until the next begin_step(): results that outlive a
+// step must be copied into owned matrices. Within a step, release() hands
+// back everything allocated since a mark(), so scratch with a shorter
+// lifetime (one block's backward pass, one task's chunk) is reused.
+class Arena {
+private:
+    std::vector<AlignedBuffer> blocks; // Newest last
+    size_t current;                    // Block allocations are taken from
+    size_t offset;                     // Doubles used in blocks[current]
+    size_t used;                       // Doubles handed out since the last rewind
+    size_t peak;                       // Largest used over all steps
+    uint64_t generation;               // Step the arena was last rewound for
+
+    static std::atomic<uint64_t> step_generation;
+    static std::atomic<size_t> largest_peak; // Largest peak of any thread's arena
+
+    void rewind();
+
+public:
+    Arena();
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    // The calling thread's arena
+    static Arena& local();
+
+    // Start a new step on every thread's arena. Call between steps only.
+    static void begin_step();
+
+    // n doubles on a cache line (uninitialized)
+    double* allocate(size_t n);
+
+    // Allocation position, to return to with release()
+    struct Mark {
+        size_t block;
+        size_t offset;
+        size_t used;
+        uint64_t generation;
+    };
+    Mark mark();
+
+    // Free everything allocated since mark in this step. Marks must be released
+    // in reverse order; pool tasks run to completion on the thread that took
+    // them, so nested marks on one thread always are.
+    void release(const Mark& mark);
+
+    Eigen::Map<Eigen::MatrixXd> matrix(Eigen::Index rows, Eigen::Index cols) {
+        return Eigen::Map<Eigen::MatrixXd>(allocate(static_cast<size_t>(rows * cols)), rows, cols);
+    }
+
+    // Point view at a new rows x cols allocation (Map views cannot be reassigned)
+    template <typename MapType>
+    void bind(MapType& view, Eigen::Index rows, Eigen::Index cols) {
+        new (&view) MapType(allocate(static_cast<size_t>(rows * cols)), rows, cols);
+    }
+
+    // Point view at the memory target views
+    template <typename MapType>
+    static void rebind(MapType& view, const MapType& target) {
+        new (&view) MapType(target);
+    }
+
+    size_t capacity() const;
+    size_t get_peak() const { return peak; }
+
+    // Largest peak over every thread's arena so far
+    static size_t get_largest_peak() { return largest_peak.load(std::memory_order_relaxed); }
+};
+
+#endif
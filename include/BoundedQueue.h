@@ -0,0 +1,126 @@
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <thread>
+#include <utility>
+
+// Fixed-capacity lock-free multi-producer/multi-consumer queue (Vyukov's
+// sequence-numbered ring). Used to hand work between pipeline stages, so the
+// blocking push/pop variants back off with spin -> yield -> sleep rather than
+// burning a core while a neighbouring stage is stalled.
+template <typename T>
+class BoundedQueue {
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) std::atomic<size_t> enqueue_pos;
+    alignas(64) std::atomic<size_t> dequeue_pos;
+    alignas(64) std::atomic<bool> is_closed;
+
+    static size_t round_up_pow2(size_t n) {
+        size_t capacity = 2;
+        while (capacity < n) capacity <<= 1;
+        return capacity;
+    }
+
+    static void backoff(int& attempt) {
+        if (attempt < 64) {
+            // Busy spin: the other side is usually only a few instructions away
+        } else if (attempt < 256) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+        ++attempt;
+    }
+
+public:
+    explicit BoundedQueue(size_t capacity)
+        : cells(new Cell[round_up_pow2(capacity)]), mask(round_up_pow2(capacity) - 1),
+          enqueue_pos(0), dequeue_pos(0), is_closed(false) {
+        for (size_t i = 0; i <= mask; ++i) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    size_t capacity() const { return mask + 1; }
+
+    // Moves from item only on success
+    bool try_push(T& item) {
+        Cell* cell;
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &cells[pos & mask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                return false; // Full
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = std::move(item);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T& item) {
+        Cell* cell;
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &cells[pos & mask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                return false; // Empty
+            } else {
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        item = std::move(cell->data);
+        cell->sequence.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Blocks while full. Returns false if the queue was closed first.
+    bool push(T item) {
+        int attempt = 0;
+        while (!try_push(item)) {
+            if (closed()) return false;
+            backoff(attempt);
+        }
+        return true;
+    }
+
+    // Blocks while empty. Returns false once the queue is closed and drained.
+    bool pop(T& item) {
+        int attempt = 0;
+        while (!try_pop(item)) {
+            if (closed()) return try_pop(item);
+            backoff(attempt);
+        }
+        return true;
+    }
+
+    // Signals end of stream to consumers and makes pending pushes fail
+    void close() { is_closed.store(true, std::memory_order_release); }
+    bool closed() const { return is_closed.load(std::memory_order_acquire); }
+};
+
+#endif
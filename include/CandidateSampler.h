@@ -0,0 +1,47 @@
+#ifndef CANDIDATE_SAMPLER_H
+#define CANDIDATE_SAMPLER_H
+
+#include <random>
+#include <vector>
+
+enum class SamplerType {
+    LOG_UNIFORM, // Zipfian: p(id) proportional to log((id + 2) / (id + 1)); IDs sorted by decreasing frequency
+    UNIGRAM      // Proportional to each token's count in the training data (plus one)
+};
+
+// Draws negative candidates for sampled softmax from a fixed distribution
+// over token IDs with Walker's alias method: after an O(vocab) build, each
+// draw picks a bucket with one uniform number and one of the bucket's two
+// tokens with another.
+class CandidateSampler {
+private:
+    SamplerType type;
+    std::vector<double> probabilities; // p(id)
+    std::vector<double> thresholds;    // Bucket i keeps i below its threshold, else yields aliases[i]
+    std::vector<int> aliases;
+    std::vector<char> taken;           // sample_unique() scratch, all zero between calls
+    std::mt19937_64 rng;
+
+public:
+    // counts (indexed by ID, may be shorter than vocab_size) are used by UNIGRAM only
+    CandidateSampler(SamplerType type = SamplerType::LOG_UNIFORM, int vocab_size = 0,
+                     const std::vector<long>& counts = {}, unsigned int seed = 42);
+
+    bool empty() const { return probabilities.empty(); }
+    SamplerType get_type() const { return type; }
+    int size() const { return static_cast<int>(probabilities.size()); }
+
+    int sample();
+
+    // Fill samples with count distinct IDs; returns the number of draws it took
+    long sample_unique(int count, std::vector<int>& samples);
+
+    // Probability that id is among the distinct samples of tries draws,
+    // 1 - (1 - p(id))^tries: the Q of the logQ correction
+    double expected_count(int id, long tries) const;
+
+    // Name used in logs and options: "log-uniform" or "unigram"
+    static const char* name(SamplerType type);
+};
+
+#endif
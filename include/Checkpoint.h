@@ -0,0 +1,172 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "AlignedBuffer.h"
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// On-disk layout (native byte order):
+//   CheckpointHeader (64 bytes)
+//   CheckpointEntry[num_entries]
+//   padding to data_offset (64-byte aligned)
+//   segments, each starting on a 64-byte boundary
+// Every entry names a tensor or blob and gives its absolute file offset.
+
+enum class CheckpointDType : uint32_t {
+    FLOAT64 = 1,
+    BYTES = 2,
+    INT8 = 3,                 // QuantizedTable codes, one byte per value
+    INT4 = 4,                 // QuantizedTable codes, two values per byte
+    FLOAT32 = 5               // QuantizedTable scales
+};
+
+enum CheckpointFlags : uint32_t {
+    CHECKPOINT_TIED_EMBEDDINGS = 1, // Output layer reads the embedding matrix; no output_weights entry
+    CHECKPOINT_ROW_MAJOR_TABLES = 2, // Embedding and output weights stored row-major (older files: column-major)
+    CHECKPOINT_SINUSOIDAL_POSITIONS = 4, // Position encoding (at most one); the table size is the
+    CHECKPOINT_LEARNED_POSITIONS = 8,    // "model.max_positions" entry
+    CHECKPOINT_ROTARY_POSITIONS = 16,
+    CHECKPOINT_ADAPTIVE_SOFTMAX = 32     // Adaptive softmax instead of output_weights; "model.softmax_cutoffs" entry
+};
+
+struct CheckpointHeader {
+    char magic[8];            // "MAIRCKPT"
+    uint32_t version;
+    uint32_t num_entries;
+    uint64_t data_offset;     // First segment byte
+    uint64_t file_size;
+    int32_t vocab_size;       // Model configuration
+    int32_t embedding_dim;
+    int32_t num_layers;
+    int32_t num_heads;
+    int32_t feedforward_dim;
+    uint32_t flags;           // CheckpointFlags
+    int32_t num_hashes;       // Hashed vocabulary tables (see VocabularyHash); 0: plain
+    int32_t hash_buckets;
+};
+static_assert(sizeof(CheckpointHeader) == 64, "CheckpointHeader must stay 64 bytes");
+
+struct CheckpointEntry {
+    char name[56];
+    uint32_t dtype;           // CheckpointDType
+    uint32_t reserved;
+    int64_t rows;
+    int64_t cols;
+    uint64_t offset;          // Absolute file offset, 64-byte aligned for segment starts
+    uint64_t nbytes;
+};
+static_assert(sizeof(CheckpointEntry) == 96, "CheckpointEntry must stay 96 bytes");
+
+// A contiguous buffer written as-is
+struct CheckpointSegment {
+    const void* data;
+    size_t nbytes;
+};
+
+// A named tensor or blob located inside one segment
+struct CheckpointTensor {
+    std::string name;
+    CheckpointDType dtype;
+    int64_t rows;
+    int64_t cols;
+    size_t segment;           // Index into the segment list
+    size_t offset;            // Byte offset within the segment
+    size_t nbytes;
+};
+
+// Everything needed to write one checkpoint. Segments either point at live
+// model memory (synchronous saves) or at the staging buffers below, which own
+// a copy so the file can be written while training continues.
+struct CheckpointSnapshot {
+    CheckpointHeader header;
+    std::vector<CheckpointSegment> segments;
+    std::vector<CheckpointTensor> tensors;
+    std::vector<AlignedBuffer> buffers; // Staging copies, reused between snapshots
+    std::string blob;                   // Staged non-tensor data (vocabulary, counters)
+
+    // Staging buffer i with room for n doubles; reallocated only when n changes
+    double* stage(size_t i, size_t n);
+};
+
+class Checkpoint {
+public:
+    static const uint32_t version = 1;
+
+    // Write header, entry table and all segments with one sequential writev.
+    // header supplies the model configuration; the rest is filled in here.
+    // The file is written next to path, fsynced and renamed over it, so path
+    // always holds either the previous or the new checkpoint.
+    static bool write(const std::string& path, const CheckpointHeader& header,
+                      const std::vector<CheckpointSegment>& segments,
+                      const std::vector<CheckpointTensor>& tensors);
+    static bool write(const std::string& path, const CheckpointSnapshot& snapshot) {
+        return write(path, snapshot.header, snapshot.segments, snapshot.tensors);
+    }
+};
+
+// Writes checkpoints on a background thread. One snapshot is staged at a time:
+// acquire() hands it out only when the previous write has finished, so the
+// training thread never waits on the disk.
+class CheckpointWriter {
+private:
+    CheckpointSnapshot staging;
+    std::string pending_path;
+    bool busy;
+    bool stopping;
+    bool last_result;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::thread worker;
+
+    void run();
+
+public:
+    CheckpointWriter();
+    ~CheckpointWriter(); // Finishes a pending write
+    CheckpointWriter(const CheckpointWriter&) = delete;
+    CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+
+    // The staging snapshot, or null while a write is still in flight
+    CheckpointSnapshot* acquire();
+
+    // Write the acquired snapshot to path in the background
+    void submit(const std::string& path);
+
+    // Block until no write is in flight; returns whether the last one succeeded
+    bool wait();
+};
+
+// Read-only view of a checkpoint file through a private (copy-on-write)
+// mapping. Pages are faulted in lazily and shared between processes until
+// written, so parameter views can point straight into the mapping.
+class MappedCheckpoint {
+private:
+    void* base;
+    size_t length;
+
+    MappedCheckpoint(void* base, size_t length) : base(base), length(length) {}
+
+public:
+    ~MappedCheckpoint();
+    MappedCheckpoint(const MappedCheckpoint&) = delete;
+    MappedCheckpoint& operator=(const MappedCheckpoint&) = delete;
+
+    // Returns null (after logging) if the file is missing or malformed
+    static std::unique_ptr<MappedCheckpoint> open(const std::string& path);
+
+    const CheckpointHeader& header() const { return *static_cast<const CheckpointHeader*>(base); }
+    const CheckpointEntry* entries() const {
+        return reinterpret_cast<const CheckpointEntry*>(static_cast<const char*>(base) + sizeof(CheckpointHeader));
+    }
+    const CheckpointEntry* find(const std::string& name) const;
+    char* data(const CheckpointEntry& entry) const { return static_cast<char*>(base) + entry.offset; }
+    char* data_at(uint64_t offset) const { return static_cast<char*>(base) + offset; }
+};
+
+#endif
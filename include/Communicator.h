@@ -0,0 +1,93 @@
+#ifndef COMMUNICATOR_H
+#define COMMUNICATOR_H
+
+#include "BoundedQueue.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A contiguous range of the gradient buffer, in doubles
+struct GradientBucket {
+    size_t begin;
+    size_t end;
+};
+
+// Gradient all-reduce between processes on one host through a POSIX
+// shared-memory segment. Each rank copies a finished bucket into its own slot
+// and a background thread per rank sums its shard of that bucket over all
+// slots (reduce-scatter), so buckets are reduced while backward continues on
+// later layers. finish() then copies every reduced bucket back (all-gather).
+// All coordination uses monotonically increasing counters in the segment; no
+// locks are shared between processes.
+class ShmCommunicator {
+private:
+    struct alignas(64) Counter {
+        std::atomic<uint64_t> value;
+    };
+
+    std::string name;
+    int rank;
+    int world_size;
+    size_t count;                       // Doubles per gradient buffer
+    std::vector<GradientBucket> buckets;
+    void* base;
+    size_t length;
+
+    // Views into the segment
+    Counter* ready;                     // Set by rank 0 once the segment is initialized
+    Counter* attached;
+    Counter* barrier_count;
+    Counter* arrived;                   // Per bucket: ranks that posted it, summed over steps
+    Counter* reduced;                   // Per bucket: shards reduced, summed over steps
+    int64_t* values;                    // [2][world_size] scratch for all_reduce_sum
+    double* slots;                      // [world_size][count] posted gradients
+    double* results;                    // [2][count] reduced gradients, alternating by step
+
+    uint64_t step;                      // Completed finish() calls
+    uint64_t barrier_generation;
+    uint64_t sum_generation;
+    std::vector<uint64_t> bucket_steps; // Per bucket: reductions done by this rank's thread
+    BoundedQueue<size_t> posted;        // Buckets waiting for this rank's reduction thread
+    std::thread reducer;
+
+    ShmCommunicator(const std::string& name, int rank, int world_size, size_t count,
+                    const std::vector<GradientBucket>& buckets);
+    bool map_segment();
+    void reduce_loop();
+
+public:
+    ~ShmCommunicator();
+    ShmCommunicator(const ShmCommunicator&) = delete;
+    ShmCommunicator& operator=(const ShmCommunicator&) = delete;
+
+    // Create (rank 0) or attach to the segment called name and wait until all
+    // world_size ranks are attached. count is the gradient buffer length and
+    // buckets are the ranges posted by each step, in posting order.
+    // Returns null (after logging) on failure.
+    static std::unique_ptr<ShmCommunicator> create(const std::string& name, int rank, int world_size, size_t count,
+                                                   const std::vector<GradientBucket>& buckets);
+
+    int get_rank() const { return rank; }
+    int get_world_size() const { return world_size; }
+    size_t num_buckets() const { return buckets.size(); }
+
+    // Hand bucket b of grad (a buffer of count doubles) to the all-reduce. Returns
+    // after copying it; the reduction runs in the background.
+    void post(size_t b, const double* grad);
+
+    // Wait until every bucket of this step is reduced and write the mean over
+    // ranks into grad. Every bucket must have been posted.
+    void finish(double* grad);
+
+    // Copy rank 0's data (count doubles at most) to every rank
+    void broadcast(double* data, size_t n);
+
+    void barrier();
+    int64_t all_reduce_sum(int64_t value);
+};
+
+#endif
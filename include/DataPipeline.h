@@ -0,0 +1,97 @@
+#ifndef DATA_PIPELINE_H
+#define DATA_PIPELINE_H
+
+#include "BoundedQueue.h"
+#include "SequencePacker.h"
+#include "TokenBatch.h"
+#include "Tokenizer.h"
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct PipelineOptions {
+    std::string json_file = "data.json";
+    int max_entries = 1000;  // Number of entries taken from the JSON file
+    int worker_threads = 1;  // Threads per parallel stage (clean, tokenize)
+    size_t queue_depth = 16; // Capacity of each inter-stage queue
+    bool shuffle = false;    // Reshuffle entry order every epoch
+    unsigned int seed = 42;
+    int rank = 0;            // Data-parallel shard: each epoch this process reads
+    int world_size = 1;      // every world_size-th entry, starting at rank
+    PackerOptions packing;   // How sentences are packed into batches
+    std::string separator = "<sep>"; // Document separator word for CONCATENATE packing; empty disables
+    bool sort_vocab = false; // Number a new vocabulary by decreasing frequency (e.g. for the adaptive softmax)
+    bool count_tokens = false; // Keep per-token counts of the indexed entries (e.g. for a unigram sampler)
+};
+
+// One corpus entry as it flows through the pipeline stages
+struct Example {
+    size_t index = 0;            // Position in the current pass order
+    std::streamoff offset = 0;   // Byte offset of the JSON line in the source file
+    bool valid = false;          // Line parsed and has a "text" field
+    std::string text;            // Raw line, then cleaned text
+    std::vector<int> tokens;
+};
+
+// Streams the JSON corpus through read -> clean -> tokenize -> pack/batch
+// stages, each on its own threads and connected by bounded queues, so memory
+// is bounded by queue depth and the trainer never waits on file I/O.
+class DataPipeline {
+private:
+    PipelineOptions options;
+    Tokenizer& tokenizer;
+    std::vector<std::streamoff> offsets; // Byte offsets of the selected entries
+    std::vector<long> counts;            // Occurrences per token ID, when counted
+
+    std::unique_ptr<BoundedQueue<Example>> raw_queue;
+    std::unique_ptr<BoundedQueue<Example>> clean_queue;
+    std::unique_ptr<BoundedQueue<Example>> token_queue;
+    std::unique_ptr<BoundedQueue<TokenBatch>> batch_queue;
+    std::vector<std::thread> workers;
+    std::atomic<bool> cancelled;
+
+    void read_stage(const std::vector<size_t>& order);
+    void read_all_stage();
+    void clean_stage();
+    void tokenize_stage();
+    void pack_stage();
+
+    template <typename Stage>
+    void spawn_parallel(BoundedQueue<Example>& out, Stage stage);
+
+    void reset_queues();
+    void stop();
+
+public:
+    DataPipeline(const PipelineOptions& options, Tokenizer& tokenizer, int vocab_size);
+    ~DataPipeline();
+
+    DataPipeline(const DataPipeline&) = delete;
+    DataPipeline& operator=(const DataPipeline&) = delete;
+
+    // Streams the file once to build the vocabulary and index the first
+    // max_entries valid entries. Returns the number of indexed entries.
+    size_t build_index();
+    size_t size() const { return offsets.size(); }
+
+    // Occurrences of each token ID in the indexed entries (separators
+    // included) after build_index(); empty unless sort_vocab or count_tokens
+    const std::vector<long>& token_counts() const { return counts; }
+
+    // Launches the stage threads for one pass over the indexed entries
+    void start_epoch(int epoch);
+
+    // Blocks for the next batch. Returns false once the epoch is exhausted.
+    bool next_batch(TokenBatch& batch);
+
+    static std::string clean_text(const std::string& text);
+
+    // Threads that keep a core busy while an epoch streams: the clean and
+    // tokenize workers (reading and packing mostly wait on I/O and queues)
+    static int compute_threads(const PipelineOptions& options) { return 2 * std::max(1, options.worker_threads); }
+};
+
+#endif
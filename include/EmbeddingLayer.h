@@ -1,21 +1,75 @@
 #ifndef EMBEDDING_LAYER_H
 #define EMBEDDING_LAYER_H
 
+#include "ParameterStore.h"
+#include "Quantization.h"
+#include "SparseGradient.h"
+#include "VocabularyHash.h"
+#include <string>
 #include <vector>
 #include <Eigen/Dense>
 
 class EmbeddingLayer {
 private:
-    Eigen::MatrixXd embedding_matrix; // The embedding matrix
+    ParameterStore* store;            // Owner of the parameter and gradient buffers
+    size_t tensor_id;                 // ID of the embedding matrix in the store
+    Eigen::Map<RowMajorMatrixXd> embedding_matrix; // One contiguous row per token (per hash bucket when hashed)
     int vocab_size;                   // Number of tokens in vocabulary
     int embedding_dim;                // Dimension of each embedding vector
+    VocabularyHash hash;              // Rows a token's embedding is summed from
+    QuantizedTable quantized;         // Reduced-precision copy read by lookups when not empty
 
 public:
-    // Constructor
-    EmbeddingLayer(int vocab_size, int embedding_dim);
+    // Constructor; registers the embedding matrix in store, with
+    // hash.table_rows(vocab_size) rows
+    EmbeddingLayer(int vocab_size, int embedding_dim, ParameterStore& store, const std::string& prefix,
+                   const VocabularyHash& hash = VocabularyHash());
+
+    // ID of the embedding matrix in the store
+    size_t get_tensor_id() const { return tensor_id; }
+    const VocabularyHash& get_hash() const { return hash; }
+    int table_rows() const { return hash.table_rows(vocab_size); }
+
+    // Layout of the matrix for row-wise updates: offset between the first
+    // elements of consecutive rows, and between the elements of one row
+    size_t row_step() const { return static_cast<size_t>(embedding_dim); }
+    size_t element_step() const { return 1; }
+
+    // Bind the embedding view once the store is allocated (or attached)
+    void bind_views();
+
+    // bind_views(), then draw initial values
+    void initialize();
+
+    // Serve lookups from a quantized copy of the matrix (see QuantizedTable),
+    // dequantizing rows as they are gathered; NONE goes back to the matrix.
+    // The matrix itself is kept, for training and checkpoints.
+    void quantize(QuantizationType type, int group_size);
+    QuantizedTable& get_quantized() { return quantized; }
+    const QuantizedTable& get_quantized() const { return quantized; }
 
     // Retrieve embeddings for a sequence of token IDs
     Eigen::MatrixXd get_embeddings(const std::vector<int>& token_ids);
+
+    // Same, but positions with a negative segment ID are padding and get zero rows
+    Eigen::MatrixXd get_embeddings(const std::vector<int>& token_ids, const std::vector<int>& segments);
+
+    // Same, written into output (token_ids.size() x embedding_dim), e.g. an
+    // arena buffer. Rows are prefetched a few tokens ahead and large batches
+    // are gathered in parallel; quantized rows are dequantized on the way. Invalid IDs get zero rows and one warning per call.
+    void get_embeddings(const std::vector<int>& token_ids, const std::vector<int>& segments,
+                        Eigen::Ref<Eigen::MatrixXd> output);
+
+    // Scatter-add gradient rows into the rows of the looked-up tokens (each of
+    // a hashed token's rows gets its whole gradient row), within
+    // grad_base (a buffer with the store's layout; null means the store's own)
+    void backward(const std::vector<int>& token_ids, const std::vector<int>& segments,
+                  const Eigen::Ref<const Eigen::MatrixXd>& grad_output, double* grad_base = nullptr);
+
+    // Same, as (row ID, gradient row) pairs: tokens that repeat are summed into
+    // one row of gradient, which accumulates across calls until cleared
+    void backward(const std::vector<int>& token_ids, const std::vector<int>& segments,
+                  const Eigen::Ref<const Eigen::MatrixXd>& grad_output, SparseRowGradient& gradient);
 };
 
 #endif
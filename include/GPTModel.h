@@ -5,24 +5,348 @@
 #include "EmbeddingLayer.h"
 #include "TransformerBlock.h"
 #include "Loss.h"
+#include "TokenBatch.h"
+#include "Optimizer.h"
+#include "ParameterStore.h"
+#include "Checkpoint.h"
+#include "Communicator.h"
+#include "MemoryPlanner.h"
+#include "Quantization.h"
+#include "PositionalEncoding.h"
+#include "AdaptiveSoftmax.h"
+#include "CandidateSampler.h"
+#include "StageThreads.h"
+#include "BoundedQueue.h"
 #include <Eigen/Dense>
+#include <memory>
+#include <string>
 #include <vector>
 
 class GPTModel {
 private:
     Tokenizer tokenizer;                  // Tokenizer for text preprocessing
+    int vocab_size;                       // Model configuration, as written to checkpoints
+    int embedding_dim;
+    int num_heads;
+    int feedforward_dim;
+    bool tied_embeddings;                 // Output layer uses the embedding matrix as its weights
+    std::unique_ptr<MappedCheckpoint> checkpoint; // Checkpoint the model was loaded from; may back store, so outlives it
+    ParameterStore store;                 // Flat storage for all parameters and gradients
     EmbeddingLayer embedding_layer;      // Embedding layer
     std::vector<TransformerBlock> layers; // Transformer blocks
-    Eigen::MatrixXd output_weights;      // Output layer weights
-    Eigen::VectorXd output_bias;         // Output layer bias
+    size_t output_weights_id;             // The embedding matrix when tied
+    size_t output_bias_id;
+    Eigen::Map<RowMajorMatrixXd> output_weights; // Output layer weights, one row per token
+    Eigen::Map<Eigen::VectorXd> output_bias;    // Output layer bias
     double learning_rate;                // Learning rate for optimization
+    std::unique_ptr<Optimizer> optimizer; // Updates all parameters after each training pass
+    int num_threads;                      // Data-parallel slices for batched training
+    std::vector<AlignedBuffer> worker_gradients; // Gradient buffers of workers 1..n-1 (worker 0 uses the store's)
+    ShmCommunicator* communicator;        // Averages gradients across processes; null when training alone
+    int pipeline_stages;                  // Threads that each run a contiguous range of blocks
+    int micro_batches;                    // Pieces a batch is split into when pipelining
+    std::unique_ptr<StageThreads> stage_threads; // Run pipeline stages 1.. across steps; null without pipelining
+    bool sparse_embeddings;               // Embedding gradients as row pairs, with lazy optimizer updates
+    std::vector<SparseRowGradient> embedding_gradients; // Per data-parallel worker, in sparse mode
+    QuantizedTable quantized_output;      // Inference copy of the output weights; unused when tied
+    PositionalEncoding positional;        // Position tables; rotary ones are shared with every block
+    size_t position_embedding_id;         // Learned positions only
+    Eigen::Map<RowMajorMatrixXd> position_embedding; // Learned position table, one row per position
+    std::unique_ptr<AdaptiveSoftmax> adaptive_softmax; // Replaces the output weights and bias when set
+    CandidateSampler sampler;             // Sampled softmax training: draws the negatives; empty: full softmax
+    int num_negatives;
+    std::vector<int> negatives;           // Negatives shared by every row of the current step
+    long negative_tries;                  // Draws it took to find them
+
+    // Draw the step's negatives, when training with sampled softmax
+    void draw_negatives();
+
+    // Whether output_loss() hands backward() the gradient w.r.t. hidden
+    // instead of the one w.r.t. the logits
+    bool output_loss_gives_hidden_gradient() const { return adaptive_softmax || !sampler.empty(); }
+
+    // Add the sinusoidal or learned position rows to the token embeddings in hidden
+    void add_positions(const std::vector<int>& segments, int seq_len, Eigen::Ref<Eigen::MatrixXd> hidden) const;
+
+    // The quantized output weights predict() reads (the embedding's copy when tied); empty if not quantized
+    const QuantizedTable& output_table() const;
+
+    // Training changes the weights, so the quantized copies are dropped first
+    void drop_quantized();
+
+    // Start of the gradients kept dense: after the embedding matrix in sparse mode
+    size_t dense_gradient_begin() const;
+
+    // Consecutive rows of a TokenBatch
+    struct MicroBatch {
+        size_t begin;                     // First position in the batch
+        int rows;
+        int count;                        // Valid targets
+        std::vector<int> tokens;
+        std::vector<int> targets;
+        std::vector<int> segments;
+    };
+    // Fill slice with rows [row_begin, row_end) of batch, reusing its vectors
+    static void slice_batch(const TokenBatch& batch, int row_begin, int row_end, MicroBatch& slice);
+
+    // Kept across steps so their vectors are not reallocated; index 0 serves
+    // single-threaded training
+    std::vector<std::vector<TransformerBlock::Cache>> worker_caches;
+    std::vector<MicroBatch> worker_slices;
+    std::vector<double> worker_losses;
+
+    // Activations or gradients of one micro-batch, passed between pipeline
+    // stages as a view (embedding_dim columns) into the sending stage's arena
+    struct StageMessage {
+        int micro_batch = 0;
+        double* data = nullptr;
+        Eigen::Index rows = 0;
+    };
+    // What one pipeline stage keeps per micro-batch
+    struct PipelineStage {
+        std::vector<std::vector<TransformerBlock::Cache>> caches;
+        std::vector<Eigen::Map<Eigen::MatrixXd>> output_inputs; // Last stage: input of the output layer
+        std::vector<Eigen::Map<Eigen::MatrixXd>> output_grads;  // Last stage: loss gradient w.r.t. logits
+    };
+    // Set up by set_pipeline() for up to micro_batches micro-batches and kept
+    // across steps. Queue s links stage s and s + 1; each holds every
+    // micro-batch, so a push never waits.
+    std::vector<std::unique_ptr<BoundedQueue<StageMessage>>> stage_activations;
+    std::vector<std::unique_ptr<BoundedQueue<StageMessage>>> stage_gradients;
+    std::vector<PipelineStage> stage_states;
+    std::vector<MicroBatch> pipeline_slices;
+    std::vector<double> pipeline_losses;
+    RowMajorMatrixXd pipeline_tied_gradient; // Tied output weights' gradient, collected by the last stage
+
+    // Registers every tensor in the store without allocating it
+    GPTModel(int vocab_size, int embedding_dim, int num_layers, int num_heads, int feedforward_dim,
+             double learning_rate, bool tie_embeddings, const VocabularyHash& hash, PositionType position_type,
+             int max_positions, const std::vector<int>& softmax_cutoffs, bool allocate);
+
+    // Bind all parameter views after the store is allocated or attached
+    void bind_views();
+
+    // Describe the parameters, optimizer state and vocabulary as checkpoint
+    // segments. With stage set, the data is first copied into the snapshot's
+    // own buffers.
+    void snapshot(CheckpointSnapshot& snapshot, bool stage);
+
+    // The row-major vocabulary tables: embedding matrix, and output weights unless tied
+    std::vector<size_t> table_tensor_ids() const;
+
+    // Quantized copy of a table from table_tensor_ids()
+    QuantizedTable& quantized_table(size_t id);
+
+    // Copy matching optimizer state from the loaded checkpoint, if any
+    void restore_optimizer_state();
+
+    // Final hidden states for batch_size stacked sequences of seq_len tokens.
+    // Fills one cache per layer when caches is given. Like predict(), the
+    // result lives in the calling thread's Arena until the next step.
+    Eigen::Map<Eigen::MatrixXd> hidden_states(const std::vector<int>& tokens, int batch_size, int seq_len,
+                                              const std::vector<int>& segments,
+                                              std::vector<TransformerBlock::Cache>* caches = nullptr);
+    Eigen::Map<Eigen::MatrixXd> predict(const Eigen::Ref<const Eigen::MatrixXd>& hidden);
+
+    // Unnormalized output layer scores of the full softmax, in the arena
+    Eigen::Map<Eigen::MatrixXd> output_logits(const Eigen::Ref<const Eigen::MatrixXd>& hidden);
+
+    // Output layer loss for target IDs (mean over valid targets, times scale).
+    // gradients receives what backward() starts from: the loss gradient w.r.t.
+    // the logits, or, with the adaptive softmax, whose parameter gradients are
+    // accumulated into grad_base here, w.r.t. hidden (so does sampled softmax).
+    // It lives in the arena.
+    double output_loss(const Eigen::Ref<const Eigen::MatrixXd>& hidden, const std::vector<int>& targets, double scale,
+                       double* grad_base, Eigen::Map<Eigen::MatrixXd>& gradients);
+
+    // Sampled softmax loss: each row's target against the step's negatives,
+    // with logits corrected by -log Q (the expected count of each candidate)
+    // and negatives equal to the row's target masked. Accumulates weight and
+    // bias gradients into weight_grad and bias_grad (only the candidates'
+    // rows) and writes the gradient w.r.t. hidden into grad_hidden.
+    double sampled_loss(const Eigen::Ref<const Eigen::MatrixXd>& hidden, const std::vector<int>& targets, double scale,
+                        Eigen::Ref<RowMajorMatrixXd> weight_grad, Eigen::Ref<Eigen::MatrixXd> bias_grad,
+                        Eigen::Ref<Eigen::MatrixXd> grad_hidden);
+
+    // Output layer backward for loss gradients (w.r.t. logits): accumulate the
+    // weight gradient into weight_grad and the bias gradient into bias_grad,
+    // and write the gradient w.r.t. hidden into grad_hidden
+    void output_backward(const Eigen::Ref<const Eigen::MatrixXd>& gradients,
+                         const Eigen::Ref<const Eigen::MatrixXd>& hidden, Eigen::Ref<RowMajorMatrixXd> weight_grad,
+                         Eigen::Ref<Eigen::MatrixXd> bias_grad, Eigen::Ref<Eigen::MatrixXd> grad_hidden);
+
+    // Backpropagate loss gradients (from output_loss()) through the model, accumulating
+    // parameter gradients into grad_base (store layout; null means the store's own).
+    // With comm, each bucket of gradient_buckets() is posted as soon as it is complete.
+    // In sparse mode the embedding gradient goes to embedding_gradients[worker].
+    void backward(const std::vector<int>& tokens, const std::vector<int>& segments, int seq_len,
+                  const Eigen::Ref<const Eigen::MatrixXd>& hidden, const std::vector<TransformerBlock::Cache>& caches,
+                  const Eigen::Ref<const Eigen::MatrixXd>& gradients, double* grad_base = nullptr,
+                  ShmCommunicator* comm = nullptr, int worker = 0);
+
+    // Average the store's gradients across processes (if distributed), take an
+    // optimizer step and clear the gradients. posted: buckets already handed over.
+    void apply_gradients(bool posted);
+
+    // Data-parallel training step: each worker runs forward and backward on a
+    // slice of the batch rows into its own gradient buffer, the buffers are
+    // summed into the store's, and one optimizer step follows
+    double train_data_parallel(const TokenBatch& batch, int workers);
+
+    // Pipeline-parallel pass: stage threads own contiguous ranges of blocks
+    // (the first also the embedding, the last also the output layer) and pass
+    // micro-batch activations forward and gradients backward through queues.
+    // Training follows a one-forward-one-backward schedule and returns the loss;
+    // with predictions given, runs forward only and fills them instead.
+    double run_pipeline(const TokenBatch& batch, int stages, Eigen::MatrixXd* predictions);
+
+    // Sum worker gradient buffers into the store's with a fixed pairwise tree,
+    // chunk by chunk, and clear them for the next step
+    void reduce_gradients(int workers);
+
+    // backward(), then an optimizer step
+    void backward_and_update(const std::vector<int>& tokens, const std::vector<int>& segments, int seq_len,
+                             const Eigen::Ref<const Eigen::MatrixXd>& hidden,
+                             const std::vector<TransformerBlock::Cache>& caches,
+                             const Eigen::Ref<const Eigen::MatrixXd>& gradients);
 
 public:
-    GPTModel(int vocab_size, int embedding_dim, int num_layers, int num_heads, int feedforward_dim, double learning_rate = 0.001);
+    // With tie_embeddings, the output layer uses the embedding matrix (one
+    // vocab_size x embedding_dim tensor instead of two); both the lookup and
+    // the output layer accumulate into its gradient. A hashed VocabularyHash
+    // makes both tables num_hashes x buckets rows, whatever the vocabulary
+    // size: a token's embedding is the sum of its hashed rows, and so is its
+    // output weight vector (factorized output layer). Output biases stay per token.
+    // position_type adds sinusoidal or learned position rows to the embeddings,
+    // or rotates each block's queries and keys (RoPE), for max_positions
+    // positions per sequence (or segment). Non-empty softmax_cutoffs replace
+    // the output layer by an AdaptiveSoftmax with those cluster boundaries
+    // (token IDs must then be sorted by decreasing frequency); it is not
+    // combined with tied or hashed tables. Cutoffs must increase strictly
+    // within (0, vocab_size); otherwise an error is logged and the full output
+    // layer is used.
+    GPTModel(int vocab_size, int embedding_dim, int num_layers, int num_heads, int feedforward_dim,
+             double learning_rate = 0.001, bool tie_embeddings = false, const VocabularyHash& hash = VocabularyHash(),
+             PositionType position_type = PositionType::NONE, int max_positions = 0,
+             const std::vector<int>& softmax_cutoffs = {});
+
+    // Write the configuration, every parameter and the vocabulary to a binary
+    // checkpoint. The parameter buffer is written as one segment, so a model
+    // with the same configuration can map it back without copying.
+    bool save(const std::string& path);
+
+    // Copy the same data into writer's staging buffers and write it in the
+    // background. Returns false without blocking if the previous write has not
+    // finished yet, so this checkpoint is skipped.
+    bool save_async(CheckpointWriter& writer, const std::string& path);
+
+    // Map a checkpoint written by save(). Parameters point straight into the
+    // mapping when its layout matches, and are copied otherwise. Pages are read
+    // lazily on first use. Optimizer state saved with the checkpoint is restored
+    // by set_optimizer() when the optimizer type matches. Returns null if the
+    // file is missing or incompatible.
+    static std::unique_ptr<GPTModel> load(const std::string& path, double learning_rate = 0.001);
 
     Eigen::MatrixXd forward(const std::string& input_text);
     double train(const std::string& input_text, const Eigen::MatrixXd& targets);
+
+    // Token-level API used with packed sequences. segments (optional) restricts
+    // attention to positions of the same segment; negative target IDs are ignored.
+    Eigen::MatrixXd forward(const std::vector<int>& tokens, const std::vector<int>& segments = {});
+    double train(const std::vector<int>& tokens, const std::vector<int>& segments, const std::vector<int>& targets);
+
+    // Batched API: one (batch_size * seq_len) x vocab_size prediction matrix per batch.
+    // Padding positions are masked out of attention and ignored by the loss.
+    Eigen::MatrixXd forward(const TokenBatch& batch);
+    // Same, into caller storage that is only reallocated when its shape changes
+    void forward(const TokenBatch& batch, Eigen::MatrixXd& predictions);
+    double train(const TokenBatch& batch);
     Tokenizer& get_tokenizer() { return tokenizer; }
+    int get_vocab_size() const { return vocab_size; }
+    bool has_tied_embeddings() const { return tied_embeddings; }
+    const VocabularyHash& get_vocabulary_hash() const { return embedding_layer.get_hash(); }
+    const PositionalEncoding& get_positional_encoding() const { return positional; }
+    bool has_adaptive_softmax() const { return adaptive_softmax != nullptr; }
+
+    // All trainable tensors: embeddings, every TransformerBlock, output layer
+    std::vector<Parameter> parameters();
+    ParameterStore& get_store() { return store; }
+    void set_optimizer(std::unique_ptr<Optimizer> new_optimizer);
+
+    // Ranges of the gradient buffer in the order backward() completes them:
+    // output layer, blocks from last to first, embedding (with learned positions)
+    std::vector<GradientBucket> gradient_buckets() const;
+
+    // Train together with other processes through comm (which must have been
+    // created with gradient_buckets()). Rank 0's parameters are copied to every
+    // rank first. Pass null to train alone again.
+    void set_communicator(ShmCommunicator* comm);
+
+    // Join a distributed step without local data, contributing zero gradients
+    void skip_batch();
+
+    // Run the blocks as a pipeline of stages threads for batched forward and
+    // training, splitting each batch into micro_batches pieces of rows. Takes
+    // precedence over set_num_threads(). One stage disables pipelining.
+    void set_pipeline(int stages, int micro_batches);
+
+    // Split each block's heads and FFN into parts run as pool tasks (tensor
+    // parallelism), to cut the latency of a single forward pass. 1 turns it off.
+    void set_tensor_parallel(int parts);
+
+    // Activation checkpointing: every k-th block (blocks 0, k, 2k, ...) keeps
+    // only its input during training and recomputes its activations in
+    // backward, trading one extra block forward for the saved memory. 1
+    // checkpoints every block, 0 none. The second form sets a single block.
+    void set_activation_checkpointing(int every);
+    void set_activation_checkpointing(size_t layer, bool enabled);
+
+    // Sparse embedding gradients: backward emits one (token, gradient row)
+    // pair per distinct token and the optimizer updates only those rows (lazy
+    // Adam: moments of other rows are not decayed), so the embedding update
+    // costs in proportion to the batch, not the vocabulary. Not available with
+    // tied embeddings or multi-process training, whose embedding gradients are dense.
+    void set_sparse_embeddings(bool enabled);
+
+    // Sampled softmax training: the output layer scores each row's target and
+    // negatives shared by the step's rows, drawn from sampler_type (counts,
+    // indexed by token ID, feed the unigram sampler), so its cost grows with
+    // negatives instead of the vocabulary. forward() and evaluation keep the
+    // full softmax. 0 turns it off. Not combined with the adaptive softmax or
+    // hashed tables.
+    void set_sampled_softmax(int negatives, SamplerType sampler_type, const std::vector<long>& counts = {});
+
+    // Slices train(const TokenBatch&) splits batch rows into, each with its own
+    // gradient buffer, run as pool tasks. Results are deterministic for a given
+    // slice count.
+    void set_num_threads(int threads);
+
+    // Lifetimes and slab offsets of every arena allocation (activations,
+    // gradients and kernel scratch) of one training (or inference) step on
+    // batch_size sequences of seq_len tokens, with the peak footprint, which
+    // bounds Arena::get_peak(). Follows the single-slice schedule; data-parallel
+    // slices add their gradient buffers to the persistent memory.
+    MemoryPlan plan_memory(int batch_size, int seq_len, bool training);
+
+    // NUMA placement: pin the thread pool and place parameter and gradient
+    // pages, interleaved over all nodes (node -1) or on one node (e.g. one
+    // rank per node). No effect on a single-node machine.
+    void set_numa(int node);
+
+    // Post-training quantization for inference: the embedding lookup and the
+    // output layer read int8 (group_size <= 0: one scale per row) or grouped
+    // int4 copies of the vocabulary tables, dequantizing rows on the fly.
+    // save() adds the copies to the checkpoint and load() maps them back, so
+    // a served model never reads the double tables. The next training step drops them.
+    void quantize(QuantizationType type, int group_size = 0);
+    bool is_quantized() const { return !embedding_layer.get_quantized().empty(); }
+
+    // Per-node copies of the vocabulary tables for inference, so embedding
+    // lookups and logits read node-local memory. Tables with a quantized copy
+    // are skipped (the copy is what gets read). No effect on one node; the
+    // next training step drops them.
+    void replicate_weights();
+    Optimizer& get_optimizer() { return *optimizer; }
 };
 
 #endif
@@ -0,0 +1,140 @@
+#ifndef GEMM_H
+#define GEMM_H
+
+#include "Arena.h"
+#include <Eigen/Dense>
+#include <algorithm>
+#include <type_traits>
+
+// Matrix products of the training and inference kernels: gemm(dst, lhs, rhs)
+// is dst.noalias() = lhs * rhs and gemm_add() is dst.noalias() += lhs * rhs.
+// Both run Eigen's GEMM kernel with Eigen's blocking sizes, so results are
+// bit-identical, but its packing buffers come from the calling thread's
+// Arena: Eigen itself takes them from the heap once they outgrow
+// EIGEN_STACK_ALLOCATION_LIMIT (128 KB), e.g. for a product over the
+// vocabulary. Operands must allow direct access (matrices, maps, blocks and
+// their transposes). Products Eigen does not block (small or matrix-vector
+// ones) are handed to Eigen unchanged.
+//
+// The arena path calls Eigen internals (level3_blocking and
+// general_matrix_matrix_product) with the signatures of the 3.4 releases.
+// With any other Eigen, or -DGEMM_ARENA_PACKING=0, both functions are plain
+// noalias() products and Eigen takes its packing buffers itself.
+#ifndef GEMM_ARENA_PACKING
+#if EIGEN_VERSION_AT_LEAST(3, 4, 0) && !EIGEN_VERSION_AT_LEAST(3, 4, 90)
+#define GEMM_ARENA_PACKING 1
+#else
+#define GEMM_ARENA_PACKING 0
+#endif
+#endif
+
+namespace gemm_detail {
+
+// Eigen's own test for a coefficient-based or matrix-vector product
+template <typename Dst, typename Rhs>
+bool unblocked(const Dst& dst, const Rhs& rhs) {
+    return (rhs.rows() + dst.rows() + dst.cols() < EIGEN_GEMM_TO_COEFFBASED_THRESHOLD && rhs.rows() > 0) ||
+           dst.rows() == 1 || dst.cols() == 1;
+}
+
+#if GEMM_ARENA_PACKING
+// Eigen's blocking sizes over caller-provided packing buffers
+class ArenaBlocking : public Eigen::internal::level3_blocking<double, double> {
+public:
+    ArenaBlocking(Eigen::Index mc, Eigen::Index nc, Eigen::Index kc, double* block_a, double* block_b) {
+        m_mc = mc;
+        m_nc = nc;
+        m_kc = kc;
+        m_blockA = block_a;
+        m_blockB = block_b;
+    }
+};
+
+// dst += lhs * rhs through the blocked kernel (Eigen's scaleAndAddTo)
+template <typename Dst, typename Lhs, typename Rhs>
+void add_blocked(Dst& dst, const Lhs& a_lhs, const Rhs& a_rhs) {
+    using namespace Eigen;
+    typedef internal::blas_traits<Lhs> LhsTraits;
+    typedef internal::blas_traits<Rhs> RhsTraits;
+    typedef typename internal::remove_all<typename LhsTraits::DirectLinearAccessType>::type ActualLhs;
+    typedef typename internal::remove_all<typename RhsTraits::DirectLinearAccessType>::type ActualRhs;
+    enum {
+        LhsOrder = (ActualLhs::Flags & RowMajorBit) ? RowMajor : ColMajor,
+        RhsOrder = (ActualRhs::Flags & RowMajorBit) ? RowMajor : ColMajor,
+        DstOrder = (Dst::Flags & RowMajorBit) ? RowMajor : ColMajor
+    };
+    const Index rows = dst.rows();
+    const Index cols = dst.cols();
+    const Index depth = a_lhs.cols();
+    if (rows == 0 || cols == 0 || depth == 0) return;
+
+    typename internal::add_const_on_value_type<typename LhsTraits::DirectLinearAccessType>::type lhs =
+        LhsTraits::extract(a_lhs);
+    typename internal::add_const_on_value_type<typename RhsTraits::DirectLinearAccessType>::type rhs =
+        RhsTraits::extract(a_rhs);
+    const double alpha = internal::combine_scalar_factors(1.0, a_lhs, a_rhs);
+
+    // A row-major product runs transposed, as in gemm_blocking_space
+    const bool transposed = (Dst::Flags & RowMajorBit) != 0;
+    Index mc = transposed ? cols : rows;
+    Index nc = transposed ? rows : cols;
+    Index kc = depth;
+    internal::computeProductBlockingSizes<double, double, 1>(kc, mc, nc, Index(1));
+
+    Arena& arena = Arena::local();
+    Arena::Mark mark = arena.mark();
+    ArenaBlocking blocking(mc, nc, kc, arena.allocate(mc * kc), arena.allocate(kc * nc));
+    internal::general_matrix_matrix_product<Index, double, LhsOrder, bool(LhsTraits::NeedToConjugate), double, RhsOrder,
+                                            bool(RhsTraits::NeedToConjugate), DstOrder, Dst::InnerStrideAtCompileTime>
+        ::run(rows, cols, depth, lhs.data(), lhs.outerStride(), rhs.data(), rhs.outerStride(), dst.data(),
+              dst.innerStride(), dst.outerStride(), alpha, blocking);
+    arena.release(mark);
+}
+#endif
+
+} // namespace gemm_detail
+
+// Doubles gemm() takes from the arena for a rows x cols product over depth,
+// for whichever storage order of the result needs more; 0 if Eigen does not
+// block it or the arena path is off. For memory planning.
+inline size_t gemm_scratch_size(Eigen::Index rows, Eigen::Index cols, Eigen::Index depth) {
+    if (!GEMM_ARENA_PACKING || rows == 0 || cols == 0 || depth == 0) return 0;
+    if (depth + rows + cols < EIGEN_GEMM_TO_COEFFBASED_THRESHOLD || rows == 1 || cols == 1) return 0;
+    size_t size = 0;
+    for (bool transposed : {false, true}) {
+        Eigen::Index mc = transposed ? cols : rows;
+        Eigen::Index nc = transposed ? rows : cols;
+        Eigen::Index kc = depth;
+        Eigen::internal::computeProductBlockingSizes<double, double, 1>(kc, mc, nc, Eigen::Index(1));
+        size = std::max(size, AlignedBuffer::padded(mc * kc) + AlignedBuffer::padded(kc * nc));
+    }
+    return size;
+}
+
+// dst = lhs * rhs; dst must not alias the operands
+template <typename Dst, typename Lhs, typename Rhs>
+void gemm(Dst&& dst, const Lhs& lhs, const Rhs& rhs) {
+    dst.resize(lhs.rows(), rhs.cols()); // Only checks the shape of maps and blocks
+#if GEMM_ARENA_PACKING
+    if (!gemm_detail::unblocked(dst, rhs)) {
+        dst.setZero();
+        gemm_detail::add_blocked(dst, lhs, rhs);
+        return;
+    }
+#endif
+    dst.noalias() = lhs * rhs;
+}
+
+// dst += lhs * rhs; dst must not alias the operands
+template <typename Dst, typename Lhs, typename Rhs>
+void gemm_add(Dst&& dst, const Lhs& lhs, const Rhs& rhs) {
+#if GEMM_ARENA_PACKING
+    if (!gemm_detail::unblocked(dst, rhs)) {
+        gemm_detail::add_blocked(dst, lhs, rhs);
+        return;
+    }
+#endif
+    dst.noalias() += lhs * rhs;
+}
+
+#endif
@@ -7,6 +7,7 @@
 #include <memory>
 #include <chrono>
 #include <iomanip>
+#include <mutex>
 
 enum class LogLevel {
     DEBUG,
@@ -19,6 +20,7 @@ class Logger {
 private:
     std::ofstream log_file;
     LogLevel level;
+    std::mutex mutex; // Serializes writes from pipeline and worker threads
 
     Logger(const std::string& file_path, LogLevel log_level = LogLevel::INFO);
     ~Logger();
@@ -30,10 +32,21 @@ public:
     Logger(const Logger&) = delete;
     Logger& operator=(const Logger&) = delete;
 
-    static Logger& get_instance(const std::string& file_path = "logs/project.log",
-                                LogLevel log_level = LogLevel::DEBUG);
+    // The first call creates the logger; later calls return it
+    static Logger& get_instance(const std::string& file_path, LogLevel log_level = LogLevel::DEBUG);
+
+    // Same, with logs/project.log as the default file. Does not build a path
+    // string on every call, so it is cheap on hot paths.
+    static Logger& get_instance();
 
     void log(const std::string& message, LogLevel message_level = LogLevel::INFO);
+
+    // Literal messages are only turned into strings when they are written
+    void log(const char* message, LogLevel message_level = LogLevel::INFO);
+
+    // Whether a message at message_level would be written; guards messages
+    // that are expensive to build on hot paths
+    bool enabled(LogLevel message_level) const { return message_level >= level; }
     void set_level(LogLevel log_level);
     LogLevel get_level() const { return level; }
 };
@@ -2,6 +2,7 @@
 #define LOSS_H
 
 #include <Eigen/Dense>
+#include <vector>
 
 class Loss {
 public:
@@ -10,6 +11,17 @@ public:
 
     // Compute gradient of cross-entropy loss
     static Eigen::MatrixXd cross_entropy_gradient(const Eigen::MatrixXd& predictions, const Eigen::MatrixXd& targets);
+
+    // Same as above with one target token ID per row; rows with a negative ID are ignored
+    static double cross_entropy(const Eigen::Ref<const Eigen::MatrixXd>& predictions, const std::vector<int>& target_ids);
+    static Eigen::MatrixXd cross_entropy_gradient(const Eigen::Ref<const Eigen::MatrixXd>& predictions,
+                                                  const std::vector<int>& target_ids);
+
+    // Gradient written into gradients (which may be predictions itself) and
+    // multiplied by scale
+    static void cross_entropy_gradient(const Eigen::Ref<const Eigen::MatrixXd>& predictions,
+                                       const std::vector<int>& target_ids, Eigen::Ref<Eigen::MatrixXd> gradients,
+                                       double scale = 1.0);
 };
 
 #endif
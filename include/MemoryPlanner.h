@@ -0,0 +1,53 @@
+#ifndef MEMORY_PLANNER_H
+#define MEMORY_PLANNER_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// One activation or gradient buffer of a step, alive from schedule step
+// first_use through last_use (inclusive)
+struct PlannedBuffer {
+    std::string name;
+    size_t size;   // Doubles, padded to a cache line
+    int first_use;
+    int last_use;
+    size_t offset; // Doubles from the start of the slab; set by MemoryPlanner::plan()
+};
+
+struct MemoryPlan {
+    std::string description;    // Shape the plan was made for
+    std::vector<std::string> steps; // Name of each schedule step
+    std::vector<PlannedBuffer> buffers;
+    size_t slab_size = 0;       // Doubles: peak footprint, with memory reused across lifetimes
+    size_t persistent_size = 0; // Doubles: parameters, gradients and optimizer state
+
+    // Register a schedule step; returns its index
+    int step(const std::string& name);
+
+    // Register a buffer alive over [first_use, last_use]; returns its index
+    size_t add(const std::string& name, size_t size, int first_use, int last_use);
+
+    // Sum of all buffer sizes, i.e. the footprint without any reuse
+    size_t unshared_size() const;
+
+    // Largest total of buffers alive at one step; no placement can go below it
+    size_t live_peak() const;
+};
+
+// Static memory planning: every buffer gets an offset in one slab such that
+// buffers with overlapping lifetimes never share memory. Placement is greedy
+// by size: the largest buffers go first, each at the lowest offset that fits
+// between the already placed buffers it overlaps in time.
+class MemoryPlanner {
+public:
+    // Fill in every buffer's offset and the plan's slab_size
+    static void plan(MemoryPlan& plan);
+
+    // Footprint summary with the largest buffers, one line each
+    static std::string report(const MemoryPlan& plan);
+
+    static std::string megabytes(size_t doubles);
+};
+
+#endif
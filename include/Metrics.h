@@ -2,6 +2,7 @@
 #define METRICS_H
 
 #include <Eigen/Dense>
+#include <vector>
 
 class Metrics {
 public:
@@ -10,6 +11,10 @@ public:
 
     // Compute perplexity
     static double perplexity(const Eigen::MatrixXd& predictions, const Eigen::MatrixXd& targets);
+
+    // Same as above with one target token ID per row; rows with a negative ID are ignored
+    static double accuracy(const Eigen::MatrixXd& predictions, const std::vector<int>& target_ids);
+    static double perplexity(const Eigen::MatrixXd& predictions, const std::vector<int>& target_ids);
 };
 
 #endif
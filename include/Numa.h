@@ -0,0 +1,35 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <cstddef>
+#include <vector>
+
+// NUMA topology read once from /sys/devices/system/node, plus thread pinning
+// and page placement. Placement uses the mbind system call directly, so no
+// libnuma is needed. On a single-node machine (or without /sys) every
+// placement call does nothing and returns true.
+class Numa {
+public:
+    struct Node {
+        int id;
+        std::vector<int> cpus;
+    };
+
+    // Online nodes with at least one CPU, ordered by ID
+    static const std::vector<Node>& nodes();
+    static int num_nodes() { return static_cast<int>(nodes().size()); }
+    static bool is_numa() { return num_nodes() > 1; }
+
+    // Index into nodes() of the node the calling thread is running on
+    static int current_node();
+
+    // Restrict the calling thread to the CPUs of nodes()[node]
+    static bool pin_thread(int node);
+
+    // Move the pages covering [data, data + bytes) to nodes()[node], or spread
+    // them round-robin over all nodes. Later first touches follow the same policy.
+    static bool bind(void* data, size_t bytes, int node);
+    static bool interleave(void* data, size_t bytes);
+};
+
+#endif
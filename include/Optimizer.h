@@ -0,0 +1,134 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "AlignedBuffer.h"
+#include "SparseGradient.h"
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// A trainable tensor: size contiguous values and their gradient
+struct Parameter {
+    std::string name;
+    double* value;
+    double* grad;
+    size_t size;
+};
+
+// A flat optimizer state buffer (e.g. AdamW moments), laid out in parameter order
+struct OptimizerState {
+    std::string name;
+    double* data;
+    size_t size;
+};
+
+struct OptimizerOptions {
+    double learning_rate = 0.001;
+    double momentum = 0.0;     // SGD momentum
+    double beta1 = 0.9;        // AdamW first moment decay
+    double beta2 = 0.999;      // AdamW second moment decay
+    double epsilon = 1e-8;
+    double weight_decay = 0.0; // Decoupled weight decay (AdamW) or L2 penalty (SGD)
+};
+
+// Updates a fixed set of parameters from their gradients. Per-parameter state
+// lives in flat buffers laid out in parameter order, and each step is split
+// into chunks that are processed in parallel on the ThreadPool.
+class Optimizer {
+private:
+    struct Chunk {
+        size_t param;
+        size_t begin;
+        size_t end;
+    };
+    std::vector<Chunk> chunks;
+
+    // Parameters updated from a SparseRowGradient instead of the dense sweep
+    struct SparseParam {
+        size_t param;
+        const SparseRowGradient* gradient;
+        size_t row_step;     // Offset between the first elements of consecutive rows
+        size_t element_step; // Offset between consecutive elements of one row
+    };
+    std::vector<SparseParam> sparse_params;
+
+    // Split every dense parameter into chunks for the parallel sweep
+    void build_chunks();
+
+protected:
+    std::vector<Parameter> params;
+    std::vector<size_t> offsets; // Start of each parameter's state in the flat buffers
+    size_t state_size;
+    OptimizerOptions options;
+    long step_count;
+
+    // Called once per step before the parallel sweep
+    virtual void begin_step() {}
+
+    // Update elements [begin, end) of one parameter
+    virtual void update(size_t param, size_t begin, size_t end) = 0;
+
+    // Update the count elements first, first + stride, ... of one parameter
+    // from the contiguous gradient values grad
+    virtual void update_row(size_t param, size_t first, size_t count, size_t stride, const double* grad) = 0;
+
+public:
+    Optimizer(const std::vector<Parameter>& params, const OptimizerOptions& options);
+    virtual ~Optimizer() = default;
+
+    // Apply one update from the current gradients
+    void step();
+    void zero_grad();
+
+    // Lazy sparse updates for a table parameter: each step reads gradient
+    // (which must stay alive) and updates only the rows it lists, state
+    // included, so the cost scales with the rows touched. Moments of other
+    // rows are left as they are. Null turns the parameter back to dense.
+    void set_sparse(size_t param, const SparseRowGradient* gradient, size_t row_step, size_t element_step);
+
+    void set_learning_rate(double learning_rate) { options.learning_rate = learning_rate; }
+    double get_learning_rate() const { return options.learning_rate; }
+    long get_step_count() const { return step_count; }
+    void set_step_count(long count) { step_count = count; }
+    virtual std::string name() const = 0;
+
+    // State buffers to save and restore with checkpoints
+    virtual std::vector<OptimizerState> state() { return {}; }
+};
+
+// SGD with optional momentum: v = mu * v + g; p -= lr * v
+class SGD : public Optimizer {
+private:
+    AlignedBuffer velocity;
+
+protected:
+    void update(size_t param, size_t begin, size_t end) override;
+    void update_row(size_t param, size_t first, size_t count, size_t stride, const double* grad) override;
+
+public:
+    SGD(const std::vector<Parameter>& params, const OptimizerOptions& options);
+    std::string name() const override { return "sgd"; }
+    std::vector<OptimizerState> state() override;
+};
+
+// Adam with decoupled weight decay. Each chunk is one fused pass that reads
+// param, grad, m and v and writes param, m and v.
+class AdamW : public Optimizer {
+private:
+    AlignedBuffer m;
+    AlignedBuffer v;
+    double step_size;       // lr / (1 - beta1^t)
+    double inv_sqrt_bias2;  // 1 / sqrt(1 - beta2^t)
+
+protected:
+    void begin_step() override;
+    void update(size_t param, size_t begin, size_t end) override;
+    void update_row(size_t param, size_t first, size_t count, size_t stride, const double* grad) override;
+
+public:
+    AdamW(const std::vector<Parameter>& params, const OptimizerOptions& options);
+    std::string name() const override { return "adamw"; }
+    std::vector<OptimizerState> state() override;
+};
+
+#endif
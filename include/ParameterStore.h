@@ -0,0 +1,107 @@
+#ifndef PARAMETER_STORE_H
+#define PARAMETER_STORE_H
+
+#include "AlignedBuffer.h"
+#include "Optimizer.h"
+#include <Eigen/Dense>
+#include <new>
+#include <string>
+#include <vector>
+
+// Layout of the vocabulary-sized tables (embeddings, output weights), so that
+// one token's row is contiguous
+using RowMajorMatrixXd = Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+
+// Owns every model parameter in one aligned flat buffer, and every gradient in
+// a second buffer with the same layout. Layers register their tensors first,
+// then bind Eigen::Map views into the buffers once allocate() has run. Each
+// tensor starts on a cache line, so the layout can be written or mapped as is.
+class ParameterStore {
+public:
+    struct Tensor {
+        std::string name;
+        int rows;
+        int cols;
+        size_t offset; // In doubles, from the start of the buffer
+        size_t size() const { return static_cast<size_t>(rows) * cols; }
+    };
+
+private:
+    std::vector<Tensor> tensors;
+    size_t total_size;
+    AlignedBuffer values;
+    AlignedBuffer gradients;
+    double* value_base; // values.data(), or external memory after attach()
+    std::vector<AlignedBuffer> replicas; // Per NUMA node copies of the replicated tensors, for inference
+    std::vector<size_t> replica_offsets; // Per tensor: offset in each replica, or npos if not replicated
+
+public:
+    static constexpr size_t npos = static_cast<size_t>(-1);
+
+    ParameterStore();
+
+    // Reserve a rows x cols tensor and return its ID. Only valid before allocate().
+    size_t add(const std::string& name, int rows, int cols);
+
+    // Allocate the value and gradient buffers (zero-filled)
+    void allocate();
+
+    // Use external memory with this store's layout (e.g. a mapped checkpoint)
+    // for values. Gradients are allocated on first use.
+    void attach(double* external_values);
+    bool is_allocated() const { return value_base != nullptr; }
+    bool is_attached() const { return value_base != nullptr && value_base != values.data(); }
+
+    // Point view at a tensor's values, or at its gradient within grad_base
+    // (any buffer with this store's layout; defaults to the store's own).
+    template <typename MapType>
+    void bind(MapType& view, size_t id) {
+        new (&view) MapType(value_base + tensors[id].offset, tensors[id].rows, tensors[id].cols);
+    }
+
+    // MatrixType gives the storage order the tensor is used with
+    template <typename MatrixType = Eigen::MatrixXd>
+    Eigen::Map<MatrixType> grad_view(size_t id, double* grad_base = nullptr) {
+        double* base = grad_base ? grad_base : grad_data();
+        return Eigen::Map<MatrixType>(base + tensors[id].offset, tensors[id].rows, tensors[id].cols);
+    }
+
+    // Read-only view of a tensor from the replica on NUMA node node, or from
+    // the values when the tensor is not replicated
+    template <typename MatrixType = Eigen::MatrixXd>
+    Eigen::Map<const MatrixType> replica_view(size_t id, int node) const {
+        const double* data = replicas.empty() || replica_offsets[id] == npos
+                                 ? value_base + tensors[id].offset
+                                 : replicas[node].data() + replica_offsets[id];
+        return Eigen::Map<const MatrixType>(data, tensors[id].rows, tensors[id].cols);
+    }
+
+    const std::vector<Tensor>& get_tensors() const { return tensors; }
+    const Tensor& get_tensor(size_t id) const { return tensors[id]; }
+    size_t size() const { return total_size; } // Including alignment padding
+
+    double* value_data() { return value_base; }
+    double* grad_data();
+
+    // One entry per tensor, pointing into the flat buffers
+    std::vector<Parameter> parameters();
+
+    // NUMA placement of the value and gradient pages: node -1 interleaves them
+    // over all nodes, otherwise they move to that node. No effect on one node.
+    void place(int node);
+
+    // Copy the given tensors to every NUMA node so readers stay node-local.
+    // The copies are not updated by training; drop them before the next step.
+    void replicate(const std::vector<size_t>& ids);
+    void drop_replicas() { replicas.clear(); replica_offsets.clear(); }
+    bool has_replicas() const { return !replicas.empty(); }
+
+    // Single sweeps over the whole gradient buffer
+    void zero_grad() { gradients.zero(); }
+    void zero_grad(size_t begin, size_t end) {
+        if (gradients.size() > 0) std::memset(gradients.data() + begin, 0, (end - begin) * sizeof(double));
+    }
+    double grad_norm() const;
+};
+
+#endif
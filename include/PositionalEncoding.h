@@ -0,0 +1,74 @@
+#ifndef POSITIONAL_ENCODING_H
+#define POSITIONAL_ENCODING_H
+
+#include "ParameterStore.h"
+#include <Eigen/Dense>
+#include <algorithm>
+#include <vector>
+
+enum class PositionType {
+    NONE,       // Bag of tokens: attention cannot tell order
+    SINUSOIDAL, // Fixed sin/cos table added to the embeddings
+    LEARNED,    // Trained table added to the embeddings (a model parameter)
+    ROTARY      // Q and K rotated by position inside every block (RoPE)
+};
+
+// Position tables built once for max_positions positions: the sinusoidal
+// table (max_positions x embedding_dim), or the rotary cos/sin tables
+// (one column per rotated pair of a head, one row per position). Rows are
+// numbered from 0 at the start of every sequence and of every segment within
+// it; positions past the tables use their last row.
+class PositionalEncoding {
+private:
+    PositionType type;
+    int max_positions;
+    int head_dim;                    // Rotary: columns per head; pairs (2j, 2j + 1) are rotated together
+    RowMajorMatrixXd table;          // Sinusoidal
+    Eigen::MatrixXd cos_table;       // Rotary: max_positions x head_dim / 2, each column contiguous
+    Eigen::MatrixXd sin_table;
+
+public:
+    PositionalEncoding(PositionType type = PositionType::NONE, int max_positions = 0, int embedding_dim = 0,
+                       int head_dim = 0);
+
+    PositionType get_type() const { return type; }
+    int get_max_positions() const { return max_positions; }
+    bool additive() const { return type == PositionType::SINUSOIDAL || type == PositionType::LEARNED; }
+    bool rotary() const { return type == PositionType::ROTARY; }
+    const RowMajorMatrixXd& get_table() const { return table; }
+
+    // Call f(row, position) for every row that is not padding (negative
+    // segment ID) of the batch of rows / seq_len sequences in rows
+    template <typename Function>
+    void for_each_position(const std::vector<int>& segments, Eigen::Index rows, int seq_len, Function f) const {
+        int position = 0;
+        for (Eigen::Index i = 0; i < rows; ++i) {
+            const bool starts = seq_len <= 0 || i % seq_len == 0 || (!segments.empty() && segments[i] != segments[i - 1]);
+            position = starts ? 0 : position + 1;
+            if (!segments.empty() && segments[i] < 0) continue;
+            f(i, std::min(position, max_positions - 1));
+        }
+    }
+
+    // hidden.row(i) += values.row(position of row i); values is the sinusoidal
+    // table or a learned one of the same shape
+    void add(const Eigen::Ref<const RowMajorMatrixXd>& values, const std::vector<int>& segments, int seq_len,
+             Eigen::Ref<Eigen::MatrixXd> hidden) const;
+
+    // Gradient of add() w.r.t. a learned table: table_grad.row(position of row i) += grad.row(i)
+    void accumulate(const Eigen::Ref<const Eigen::MatrixXd>& grad, const std::vector<int>& segments, int seq_len,
+                    Eigen::Ref<RowMajorMatrixXd> table_grad) const;
+
+    // Rotate the columns of x (a whole number of heads of stacked sequences of
+    // seq_len rows) by their row's position within its sequence. inverse
+    // rotates back, which maps gradients w.r.t. rotated values to gradients
+    // w.r.t. the unrotated ones. Attention only compares rows of one segment,
+    // and rotary scores depend only on relative positions, so segment starts
+    // need no reset here.
+    void rotate(Eigen::Ref<Eigen::MatrixXd> x, int seq_len, bool inverse) const;
+
+    // Name used in logs and options: "none", "sinusoidal", "learned" or "rope"
+    static const char* name(PositionType type);
+};
+
+#endif
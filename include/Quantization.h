@@ -0,0 +1,76 @@
+#ifndef QUANTIZATION_H
+#define QUANTIZATION_H
+
+#include <Eigen/Dense>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+enum class QuantizationType {
+    NONE,
+    INT8, // One signed byte per value
+    INT4  // Two signed 4-bit values per byte, low nibble first
+};
+
+// Post-training copy of a row-major vocabulary table (embeddings, output
+// weights) for inference. Each row is split into equal groups of columns
+// that share one float scale: value = scale * code, with codes symmetric
+// around zero (int8: -127..127, int4: -7..7). Rows are dequantized on the
+// fly, so the table stays 8x (int8) or 16x (int4) smaller than doubles,
+// plus the scales.
+class QuantizedTable {
+private:
+    QuantizationType type;
+    int rows;
+    int cols;
+    int groups;                       // Scales per row
+    int group_size;                   // Columns per scale; the last group may be shorter
+    size_t row_bytes;                 // Code bytes per row
+    std::vector<uint8_t> owned_codes;
+    std::vector<float> owned_scales;
+    const uint8_t* codes;             // owned_codes, or external memory after attach()
+    const float* scales;              // rows x groups
+
+    void set_shape(QuantizationType type, int rows, int cols, int groups);
+
+public:
+    QuantizedTable();
+
+    // Quantize a rows x cols row-major table. group_size <= 0 (or >= cols)
+    // gives one scale per row; otherwise it is evened out so every group of a
+    // row has the same size, which lets attach() recover it from the group count.
+    void quantize(const double* data, int rows, int cols, QuantizationType type, int group_size);
+
+    // Use external codes and scales in the layout quantize() produces (e.g. a
+    // mapped checkpoint). Returns false if the shape is invalid.
+    bool attach(QuantizationType type, int rows, int cols, int groups, const uint8_t* codes, const float* scales);
+
+    // Drop the table, freeing owned memory
+    void clear();
+
+    bool empty() const { return type == QuantizationType::NONE; }
+    QuantizationType get_type() const { return type; }
+    int get_rows() const { return rows; }
+    int get_cols() const { return cols; }
+    int get_groups() const { return groups; }
+    int get_group_size() const { return group_size; }
+    const uint8_t* code_data() const { return codes; }
+    const float* scale_data() const { return scales; }
+    size_t get_row_bytes() const { return row_bytes; }
+    const uint8_t* row_codes(int row) const { return codes + static_cast<size_t>(row) * row_bytes; }
+    size_t code_bytes() const { return static_cast<size_t>(rows) * row_bytes; }
+    size_t scale_bytes() const { return static_cast<size_t>(rows) * groups * sizeof(float); }
+
+    // Write row's cols values to output
+    void dequantize_row(int row, double* output) const;
+
+    // output (input.rows() x count) = input * rows [first, first + count) transposed,
+    // dequantizing the rows into the calling thread's Arena as one tile
+    void multiply(const Eigen::Ref<const Eigen::MatrixXd>& input, int first, int count,
+                  Eigen::Ref<Eigen::MatrixXd> output) const;
+
+    // Name used in logs, options and checkpoint entries: "int8", "int4" or "none"
+    static const char* name(QuantizationType type);
+};
+
+#endif
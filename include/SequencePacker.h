@@ -0,0 +1,62 @@
+#ifndef SEQUENCE_PACKER_H
+#define SEQUENCE_PACKER_H
+
+#include "TokenBatch.h"
+#include <deque>
+#include <vector>
+
+enum class PackingMode {
+    NONE,        // One sentence per batch, in its own length
+    CONCATENATE, // Token streams concatenated into fixed-length rows
+    BUCKET       // Sentences grouped by length into padded batches
+};
+
+struct PackerOptions {
+    PackingMode mode = PackingMode::NONE;
+    int seq_len = 64;             // Row length (CONCATENATE) or maximum bucket length (BUCKET)
+    int batch_size = 1;           // Rows per emitted batch
+    int separator_token = -1;     // Appended after each document in CONCATENATE mode; -1 disables
+    bool reset_attention = false; // Keep attention from crossing document boundaries
+    int bucket_width = 8;         // Length range covered by one bucket
+    int vocab_size = 0;           // Targets outside [0, vocab_size) are ignored
+};
+
+// Turns a stream of tokenized sentences into fixed-shape TokenBatches
+class SequencePacker {
+private:
+    PackerOptions options;
+
+    // CONCATENATE state: the batch being filled and the write position
+    TokenBatch current;
+    int row;
+    int col;
+    int segment;
+
+    // BUCKET state: pending sentences per length bucket
+    std::vector<std::vector<std::vector<int>>> buckets;
+
+    std::deque<TokenBatch> ready;
+
+    int target_for(int token) const;
+    void append_token(int token);
+    void end_document();
+    void emit_current();
+    void add_to_bucket(std::vector<int> tokens);
+    void emit_bucket(size_t bucket);
+
+public:
+    explicit SequencePacker(const PackerOptions& options);
+
+    // Add one tokenized sentence (document)
+    void add(const std::vector<int>& tokens);
+
+    // Emit whatever is buffered as padded batches
+    void flush();
+
+    // Pop the next completed batch
+    bool pop(TokenBatch& batch);
+
+    const PackerOptions& get_options() const { return options; }
+};
+
+#endif
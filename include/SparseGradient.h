@@ -0,0 +1,58 @@
+#ifndef SPARSE_GRADIENT_H
+#define SPARSE_GRADIENT_H
+
+#include <cstddef>
+#include <vector>
+
+// Gradient of a table (e.g. embeddings) that only a few rows of receive
+// in a step, as (row ID, gradient row) pairs. Repeated rows are summed into
+// one pair by a scatter-add, so each touched row appears once. Clearing
+// costs time in proportion to the rows touched, not to the table size.
+struct SparseRowGradient {
+    int width = 0;               // Values per row
+    std::vector<int> rows;       // Distinct row IDs, in first-touch order
+    std::vector<double> values;  // rows.size() x width, row-major
+    std::vector<int> slots;      // Row ID -> index into rows, or -1
+
+    // Size for a num_rows x width table; drops any accumulated rows
+    void reset(int num_rows, int row_width) {
+        width = row_width;
+        rows.clear();
+        values.clear();
+        slots.assign(num_rows, -1);
+    }
+
+    bool empty() const { return rows.empty(); }
+    size_t size() const { return rows.size(); }
+    double* row_values(size_t i) { return values.data() + i * width; }
+    const double* row_values(size_t i) const { return values.data() + i * width; }
+
+    // Values of row, zero-filled on its first touch. Invalidated by the next call.
+    double* add_row(int row) {
+        int& slot = slots[row];
+        if (slot < 0) {
+            slot = static_cast<int>(rows.size());
+            rows.push_back(row);
+            values.resize(values.size() + width, 0.0);
+        }
+        return values.data() + static_cast<size_t>(slot) * width;
+    }
+
+    // Scatter-add other's pairs, in other's order
+    void add(const SparseRowGradient& other) {
+        for (size_t i = 0; i < other.rows.size(); ++i) {
+            double* target = add_row(other.rows[i]);
+            const double* source = other.row_values(i);
+            for (int k = 0; k < width; ++k) target[k] += source[k];
+        }
+    }
+
+    // Forget the accumulated rows, keeping the capacity
+    void clear() {
+        for (int row : rows) slots[row] = -1;
+        rows.clear();
+        values.clear();
+    }
+};
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef STAGE_THREADS_H
+#define STAGE_THREADS_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Long-lived threads for the stages of pipeline-parallel passes. Stages block
+// on each other's queues, so they cannot be pool tasks; keeping the threads
+// (and with them their thread-local arenas) across steps avoids creating
+// threads and growing fresh arenas every step. Each run() is one handshake:
+// the threads are released together and the caller waits for all of them.
+class StageThreads {
+private:
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable start_cv;
+    std::condition_variable done_cv;
+    const std::function<void(int)>* job; // Current run's work; null between runs
+    uint64_t generation;                 // Incremented by every run()
+    int running;                         // Threads still working on the current run
+    bool stopping;
+
+    void worker_loop(int stage);
+
+public:
+    // count threads, for stages 1..count
+    explicit StageThreads(int count);
+    ~StageThreads();
+
+    StageThreads(const StageThreads&) = delete;
+    StageThreads& operator=(const StageThreads&) = delete;
+
+    int size() const { return static_cast<int>(threads.size()); }
+
+    // job(s) for stage s on thread s (1..size()) and job(0) on the calling
+    // thread; returns once every stage has finished
+    void run(const std::function<void(int)>& job);
+};
+
+#endif
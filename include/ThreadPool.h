@@ -0,0 +1,125 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// The process-wide pool for compute kernels. Every worker owns a deque: it
+// pushes and pops its own tasks at the back and idle workers steal from the
+// front. Tasks submitted from other threads go to a shared injection queue.
+// A thread waiting for a task group runs queued tasks instead of blocking,
+// so kernels can nest parallel_for calls freely.
+//
+// With NUMA placement on, workers are pinned in contiguous blocks per node
+// (or all to one node) and steal from workers on their own node first.
+//
+// Tasks must not block on each other through anything but TaskGroup::wait;
+// long-running stages that block on queues (data pipeline, pipeline-parallel
+// stages, checkpoint and communication threads) keep their own threads.
+class ThreadPool {
+private:
+    using RangeFunction = void (*)(const void* body, size_t begin, size_t end);
+
+    // Either a TaskGroup function or a chunk of a parallel_for body. Chunks
+    // point at the caller's body, so submitting them allocates nothing.
+    struct Task {
+        std::function<void()> function;
+        RangeFunction range = nullptr;
+        const void* body = nullptr;
+        size_t begin = 0;
+        size_t end = 0;
+        std::atomic<int>* pending = nullptr;
+    };
+
+    // Ring buffer of tasks; it only grows, so steady-state pushes do not allocate
+    struct alignas(64) TaskQueue {
+        std::mutex mutex;
+        std::vector<Task> slots;
+        size_t head = 0;
+        size_t count = 0;
+
+        void push_back(Task&& task);
+        bool pop(bool back, Task& task);
+    };
+
+    std::vector<std::unique_ptr<TaskQueue>> queues; // One per worker
+    TaskQueue injection;                             // Tasks from threads outside the pool
+    std::vector<std::thread> workers;
+    std::vector<int> worker_nodes;                   // Index into Numa::nodes() per worker
+    bool numa_enabled;
+    int numa_node;                                   // -1: spread over all nodes
+    std::atomic<bool> stopping;
+    std::atomic<int> queued;
+    std::atomic<int> sleeping;
+    std::mutex sleep_mutex;
+    std::condition_variable sleep_cv;
+
+    ThreadPool();
+    void start(int num_threads);
+    void stop();
+    void push(Task&& task);
+    size_t chunk_grain(size_t count, size_t grain) const; // Grain raised to cap the chunk count
+    void run_range(size_t begin, size_t end, size_t grain, RangeFunction range, const void* body);
+    bool try_run_one();
+    void worker_loop(int index);
+
+public:
+    // Tasks whose completion can be waited for together
+    class TaskGroup {
+    private:
+        ThreadPool& pool;
+        std::atomic<int> pending;
+
+    public:
+        explicit TaskGroup(ThreadPool& pool = ThreadPool::instance()) : pool(pool), pending(0) {}
+        ~TaskGroup() { wait(); }
+        TaskGroup(const TaskGroup&) = delete;
+        TaskGroup& operator=(const TaskGroup&) = delete;
+
+        void run(std::function<void()> task);
+
+        // Runs queued tasks until every task of this group has finished
+        void wait();
+    };
+
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    static ThreadPool& instance();
+
+    // Total threads doing work, counting the thread that waits. Call at start-up,
+    // while no tasks are running. Defaults to the number of hardware threads.
+    static void set_num_threads(int num_threads);
+    int get_num_threads() const { return static_cast<int>(workers.size()) + 1; }
+
+    // Pin workers (and the calling thread) to NUMA nodes: node -1 spreads them
+    // over all nodes, otherwise all run on that node (e.g. one rank per node).
+    // Restarts the workers like set_num_threads. No effect on one node.
+    static void set_numa(bool enabled, int node = -1);
+
+    // Node the calling thread runs on, as an index into Numa::nodes()
+    static int current_node();
+
+    // Largest chunk parallel_for() hands its body for count elements and grain
+    size_t max_chunk(size_t count, size_t grain) const;
+
+    // body(chunk_begin, chunk_end) over [begin, end) in chunks of at least
+    // grain elements; runs inline when there is only one chunk
+    template <typename Body>
+    void parallel_for(size_t begin, size_t end, size_t grain, const Body& body) {
+        run_range(begin, end, grain,
+                  [](const void* context, size_t chunk_begin, size_t chunk_end) {
+                      (*static_cast<const Body*>(context))(chunk_begin, chunk_end);
+                  },
+                  &body);
+    }
+};
+
+#endif
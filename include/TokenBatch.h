@@ -0,0 +1,39 @@
+#ifndef TOKEN_BATCH_H
+#define TOKEN_BATCH_H
+
+#include <cstddef>
+#include <vector>
+
+// Fixed-shape block of token sequences (batch_size x seq_len, row-major).
+// Positions past a row's length are padding and carry -1 everywhere.
+struct TokenBatch {
+    int batch_size = 0;         // Number of rows (sequences)
+    int seq_len = 0;            // Positions per row
+    std::vector<int> tokens;    // Input token IDs
+    std::vector<int> targets;   // Target token IDs; -1 is ignored by the loss
+    std::vector<int> segments;  // Attention segment IDs; attention stays within a segment
+    std::vector<int> lengths;   // Non-padded length of each row
+
+    void resize(int rows, int cols) {
+        batch_size = rows;
+        seq_len = cols;
+        tokens.assign(static_cast<size_t>(rows) * cols, -1);
+        targets.assign(tokens.size(), -1);
+        segments.assign(tokens.size(), -1);
+        lengths.assign(rows, 0);
+    }
+
+    // Non-padded slice of one row of tokens, targets or segments
+    std::vector<int> row(const std::vector<int>& values, int b) const {
+        auto begin = values.begin() + static_cast<size_t>(b) * seq_len;
+        return std::vector<int>(begin, begin + lengths[b]);
+    }
+
+    int num_tokens() const {
+        int total = 0;
+        for (int length : lengths) total += length;
+        return total;
+    }
+};
+
+#endif
@@ -18,8 +18,25 @@ public:
     // Build vocabulary from a corpus of sentences
     void build_vocab(const std::vector<std::string>& corpus);
 
+    // Add the words of one sentence to the vocabulary, assigning new IDs in order
+    void add_to_vocab(const std::string& sentence);
+
     // Tokenize a given input string into token IDs
     std::vector<int> tokenize(const std::string& text) const;
+
+    // ID of a single word, or -1 if it is not in the vocabulary
+    int lookup(const std::string& word) const;
+
+    size_t size() const { return vocab.size(); }
+
+    // Vocabulary words ordered by ID, and the inverse: replace the vocabulary
+    // so that words[i] gets ID i (used for checkpoints)
+    std::vector<std::string> words() const;
+    void set_vocab(const std::vector<std::string>& words);
+
+    // Renumber the vocabulary by decreasing counts[id] (ties keep their
+    // order), so the most frequent word gets ID 0
+    void sort_by_frequency(const std::vector<long>& counts);
 };
 
 #endif
@@ -1,7 +1,11 @@
 #ifndef TRANSFORMER_BLOCK_H
 #define TRANSFORMER_BLOCK_H
 
+#include "ParameterStore.h"
+#include "PositionalEncoding.h"
 #include <Eigen/Dense>
+#include <string>
+#include <vector>
 
 class TransformerBlock {
 private:
@@ -9,20 +13,130 @@ private:
     int num_heads;
     int feedforward_dim;
 
+    // Views into the model's ParameterStore
+    ParameterStore* store;
+    enum { T_W_Q, T_W_K, T_W_V, T_W_O, T_W1, T_W2, T_B1, T_B2, NUM_TENSORS };
+    size_t tensor_ids[NUM_TENSORS];
+
     // Parameters for multi-head attention
-    Eigen::MatrixXd W_q, W_k, W_v, W_o;
+    Eigen::Map<Eigen::MatrixXd> W_q, W_k, W_v, W_o;
 
     // Parameters for feed-forward network
-    Eigen::MatrixXd W1, W2;
-    Eigen::VectorXd b1, b2;
+    Eigen::Map<Eigen::MatrixXd> W1, W2;
+    Eigen::Map<Eigen::VectorXd> b1, b2;
+
+    int tensor_parallel; // Parts the heads and FFN are split into by forward(); 1 runs the plain forward
+    bool recompute;      // Activation checkpointing: save only the input, recompute the rest in backward()
+    const PositionalEncoding* positional; // Rotary tables applied to Q and K; null or non-rotary: none
 
+public:
+    // Activations saved by forward() for backward(). They live in the arena
+    // of the thread that ran forward(), so they are valid for the current step.
+    struct Cache {
+        int batch_size = 0;
+        int seq_len = 0;
+        // Checkpointed: only input (and segments, which must outlive backward())
+        // is saved and the other activations are recomputed
+        bool checkpointed = false;
+        const std::vector<int>* segments = nullptr;
+        Eigen::Map<Eigen::MatrixXd> input{nullptr, 0, 0};
+        Eigen::Map<Eigen::MatrixXd> Q{nullptr, 0, 0}, K{nullptr, 0, 0}, V{nullptr, 0, 0};
+        // seq_len x seq_len weights per (sequence b, head h), at rows (b * num_heads + h) * seq_len
+        Eigen::Map<Eigen::MatrixXd> attention_weights{nullptr, 0, 0};
+        Eigen::Map<Eigen::MatrixXd> attention_output{nullptr, 0, 0};
+        Eigen::Map<Eigen::MatrixXd> residual_output{nullptr, 0, 0};
+        Eigen::Map<Eigen::MatrixXd> hidden{nullptr, 0, 0}; // FFN hidden layer after ReLU
+    };
+
+private:
     // Helper methods
-    Eigen::MatrixXd scaled_dot_product_attention(
-        const Eigen::MatrixXd& Q, const Eigen::MatrixXd& K, const Eigen::MatrixXd& V);
+    // Attention over one sequence for heads [head_begin, head_end), written to the
+    // matching columns of output. segments may be null. Head h's attention
+    // weights are computed in place in rows h * seq_len.. of weights
+    // ((num_heads * seq_len) x seq_len).
+    void scaled_dot_product_attention(
+        const Eigen::Ref<const Eigen::MatrixXd>& Q, const Eigen::Ref<const Eigen::MatrixXd>& K,
+        const Eigen::Ref<const Eigen::MatrixXd>& V, const int* segments, int head_begin, int head_end,
+        Eigen::Ref<Eigen::MatrixXd> output, Eigen::Ref<Eigen::MatrixXd> weights);
+
+    // Forward split into tensor_parallel parts (Megatron-style): each part
+    // computes Q, K, V and attention for its heads and the W_o product for those
+    // heads, and the FFN for its rows of W1 and columns of W2. The partial sums
+    // of each half are joined by one reduction, itself split by rows. Parts and
+    // row ranges run as thread pool tasks.
+    Eigen::Map<Eigen::MatrixXd> forward_tensor_parallel(const Eigen::Ref<const Eigen::MatrixXd>& input,
+                                                        const std::vector<int>& segments, Cache& cache);
+
+    // Forward body on the activations bound in cache
+    Eigen::Map<Eigen::MatrixXd> compute(const Eigen::Ref<const Eigen::MatrixXd>& input,
+                                        const std::vector<int>& segments, Cache& cache);
+
+    // Forward that saves only the input in cache; the activations are arena
+    // scratch released before returning
+    Eigen::Map<Eigen::MatrixXd> forward_checkpointed(const Eigen::Ref<const Eigen::MatrixXd>& input, int batch_size,
+                                                     int seq_len, const std::vector<int>& segments, Cache& cache);
+
+    // Allocate cache's activations in the calling thread's arena. The input is
+    // copied only when keep_input is set (backward needs it).
+    void bind_cache(Cache& cache, const Eigen::Ref<const Eigen::MatrixXd>& input, int batch_size, int seq_len,
+                    bool keep_input);
 
 public:
-    TransformerBlock(int embedding_dim, int num_heads, int feedforward_dim);
-    Eigen::MatrixXd forward(const Eigen::MatrixXd& input);
+    // Registers the block's tensors in store under names starting with prefix
+    TransformerBlock(int embedding_dim, int num_heads, int feedforward_dim,
+                     ParameterStore& store, const std::string& prefix);
+
+    // Bind parameter views once the store is allocated (or attached)
+    void bind_views();
+
+    // bind_views(), then draw initial values
+    void initialize();
+
+    // Split forward() into this many tensor-parallel parts (1: off)
+    void set_tensor_parallel(int parts) { tensor_parallel = parts; }
+
+    // Activation checkpointing: forward() with a cache keeps only the block
+    // input, and backward() recomputes the block's activations from it
+    void set_recompute(bool enabled) { recompute = enabled; }
+    bool get_recompute() const { return recompute; }
+
+    // Rotate Q and K by position (RoPE) with encoding's tables, which must
+    // outlive the block; Cache::Q and K then hold the rotated values
+    void set_positional_encoding(const PositionalEncoding* encoding) { positional = encoding; }
+
+    // The block's tensors are registered consecutively, starting with this one
+    size_t first_tensor_id() const { return tensor_ids[0]; }
+
+    // segments: optional per-row segment IDs; rows only attend within their segment.
+    // Takes arena scratch only for the duration of the call.
+    Eigen::MatrixXd forward(const Eigen::MatrixXd& input, const std::vector<int>& segments = {});
+
+    // Batched forward over batch_size sequences of seq_len rows stacked in input.
+    // A negative segment ID marks a padding row, which no other row attends to.
+    // The result and every temporary live in the calling thread's Arena.
+    Eigen::Map<Eigen::MatrixXd> forward(const Eigen::Ref<const Eigen::MatrixXd>& input, int batch_size, int seq_len,
+                                        const std::vector<int>& segments, Cache* cache = nullptr);
+
+    // Accumulates parameter gradients from grad_output into grad_base (a buffer
+    // with the store's layout; null means the store's own) and returns the
+    // gradient with respect to the block input, in the calling thread's Arena.
+    // cache must come from forward() in the same step.
+    Eigen::Map<Eigen::MatrixXd> backward(const Cache& cache, const Eigen::Ref<const Eigen::MatrixXd>& grad_output,
+                                         double* grad_base = nullptr);
+
+    // Same, writing the input gradient into grad_input. The scratch of the pass
+    // is released before returning, so consecutive blocks reuse it.
+    void backward(const Cache& cache, const Eigen::Ref<const Eigen::MatrixXd>& grad_output,
+                  Eigen::Ref<Eigen::MatrixXd> grad_input, double* grad_base = nullptr);
+
+    // Memory planning, in arena doubles for batch_size sequences of seq_len:
+    // what a forward pass allocates for its result (with tensor-parallel
+    // partial sums) besides the Cache activations, and the most scratch it or
+    // backward() (besides its gradient buffers) holds at once on top of that
+    int get_num_heads() const { return num_heads; }
+    size_t forward_output_size(int batch_size, int seq_len) const;
+    size_t forward_scratch_size(int batch_size, int seq_len) const;
+    size_t backward_scratch_size(int batch_size, int seq_len) const;
 };
 
 #endif
@@ -0,0 +1,44 @@
+#ifndef VOCABULARY_HASH_H
+#define VOCABULARY_HASH_H
+
+#include <cstdint>
+
+// Maps token IDs to rows of a vocabulary table (embeddings, output weights).
+// Plain tables have one row per token. Hashed tables (the hashing trick, or
+// multi-hash compositional embeddings) hold num_hashes blocks of buckets rows;
+// a token owns one row in each block, picked by an independent hash of its
+// ID, and its vector is the sum of those rows. The table size then no longer
+// depends on the vocabulary size, and two tokens share their whole vector only
+// if all of their hashes collide.
+class VocabularyHash {
+private:
+    int num_hashes; // 0: plain table
+    int buckets;    // Rows per block
+
+public:
+    VocabularyHash(int num_hashes = 0, int buckets = 0)
+        : num_hashes(buckets > 0 ? num_hashes : 0), buckets(buckets) {}
+
+    bool hashed() const { return num_hashes > 0; }
+    int get_num_hashes() const { return num_hashes; }
+    int get_buckets() const { return buckets; }
+
+    // Rows summed per token
+    int rows_per_token() const { return hashed() ? num_hashes : 1; }
+
+    // Rows of a table for vocab_size tokens
+    int table_rows(int vocab_size) const { return hashed() ? num_hashes * buckets : vocab_size; }
+
+    // Row of token in block k (k < rows_per_token())
+    int row(int token, int k) const {
+        if (!hashed()) return token;
+        // splitmix64 finalizer over the token ID, seeded per block
+        uint64_t x = static_cast<uint64_t>(token) + 0x9E3779B97F4A7C15ull * static_cast<uint64_t>(k + 1);
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+        x ^= x >> 31;
+        return k * buckets + static_cast<int>(x % static_cast<uint64_t>(buckets));
+    }
+};
+
+#endif
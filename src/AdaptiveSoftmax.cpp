@@ -0,0 +1,247 @@
+#include "AdaptiveSoftmax.h"
+#include "Arena.h"
+#include "Gemm.h"
+#include "Logger.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+const int shrink = 4;              // Each tail cluster projects to a quarter of the previous width
+const double epsilon = 1e-12;      // Avoid log(0) and division by zero
+const size_t predict_grain = 32;   // Rows per predict() task
+
+// Row-wise softmax, in place, on the calling thread
+void softmax_rows(Eigen::Ref<Eigen::MatrixXd> x) {
+    for (Eigen::Index i = 0; i < x.rows(); ++i) {
+        auto row = x.row(i);
+        row = (row.array() - row.maxCoeff()).exp();
+        row /= std::max(row.sum(), epsilon);
+    }
+}
+
+} // namespace
+
+AdaptiveSoftmax::AdaptiveSoftmax(int vocab_size, int embedding_dim, const std::vector<int>& cutoffs,
+                                 ParameterStore& store, const std::string& prefix)
+    : store(&store), vocab_size(vocab_size), embedding_dim(embedding_dim),
+      shortlist(cutoffs.empty() ? vocab_size : cutoffs[0]) {
+    for (size_t k = 0; k < cutoffs.size(); ++k) {
+        Cluster cluster;
+        cluster.begin = cutoffs[k];
+        cluster.end = k + 1 < cutoffs.size() ? cutoffs[k + 1] : vocab_size;
+        int dim = embedding_dim;
+        for (size_t level = 0; level <= k; ++level) dim = std::max(1, dim / shrink);
+        cluster.dim = dim;
+        clusters.push_back(cluster);
+    }
+
+    head_weights_id = store.add(prefix + "head_weights", head_size(), embedding_dim);
+    head_bias_id = store.add(prefix + "head_bias", head_size(), 1);
+    for (size_t k = 0; k < clusters.size(); ++k) {
+        Cluster& cluster = clusters[k];
+        const std::string name = prefix + "tail" + std::to_string(k) + ".";
+        cluster.projection_id = store.add(name + "projection", embedding_dim, cluster.dim);
+        cluster.weights_id = store.add(name + "weights", cluster.end - cluster.begin, cluster.dim);
+        cluster.bias_id = store.add(name + "bias", cluster.end - cluster.begin, 1);
+        Logger::get_instance().log("Adaptive softmax tail cluster " + std::to_string(k) + ": tokens " +
+                                   std::to_string(cluster.begin) + "-" + std::to_string(cluster.end - 1) + " on " +
+                                   std::to_string(cluster.dim) + " dimensions", LogLevel::INFO);
+    }
+    Logger::get_instance().log("Adaptive softmax head: " + std::to_string(shortlist) + " tokens and " +
+                               std::to_string(clusters.size()) + " clusters", LogLevel::INFO);
+}
+
+void AdaptiveSoftmax::initialize() {
+    Eigen::Map<RowMajorMatrixXd> head_weights(nullptr, 0, 0);
+    Eigen::Map<Eigen::MatrixXd> head_bias(nullptr, 0, 0);
+    store->bind(head_weights, head_weights_id);
+    store->bind(head_bias, head_bias_id);
+    head_weights = Eigen::MatrixXd(Eigen::MatrixXd::Random(head_size(), embedding_dim) * 0.01); // Small values
+    head_bias.setZero();
+    for (const Cluster& cluster : clusters) {
+        Eigen::Map<Eigen::MatrixXd> projection(nullptr, 0, 0);
+        Eigen::Map<RowMajorMatrixXd> weights(nullptr, 0, 0);
+        Eigen::Map<Eigen::MatrixXd> bias(nullptr, 0, 0);
+        store->bind(projection, cluster.projection_id);
+        store->bind(weights, cluster.weights_id);
+        store->bind(bias, cluster.bias_id);
+        // Projections keep the scale of the hidden state
+        projection = Eigen::MatrixXd::Random(embedding_dim, cluster.dim) / std::sqrt(static_cast<double>(embedding_dim));
+        weights = Eigen::MatrixXd(Eigen::MatrixXd::Random(cluster.end - cluster.begin, cluster.dim) * 0.01);
+        bias.setZero();
+    }
+}
+
+std::vector<int> AdaptiveSoftmax::get_cutoffs() const {
+    std::vector<int> cutoffs;
+    for (const Cluster& cluster : clusters) cutoffs.push_back(cluster.begin);
+    return cutoffs;
+}
+
+int AdaptiveSoftmax::head_entry(int token) const {
+    if (token < shortlist) return token;
+    int k = static_cast<int>(clusters.size()) - 1;
+    while (k > 0 && token < clusters[k].begin) --k;
+    return shortlist + k;
+}
+
+double AdaptiveSoftmax::loss(const Eigen::Ref<const Eigen::MatrixXd>& hidden, const std::vector<int>& targets,
+                             double scale, double* grad_base, Eigen::Ref<Eigen::MatrixXd> grad_hidden) const {
+    const Eigen::Index rows = hidden.rows();
+    int count = 0;
+    for (int id : targets) count += id >= 0;
+    const double weight = scale / std::max(count, 1);
+
+    Arena& arena = Arena::local();
+    Arena::Mark mark = arena.mark();
+    auto head_weights = store->replica_view<RowMajorMatrixXd>(head_weights_id, ThreadPool::current_node());
+    auto head_bias = store->replica_view<Eigen::VectorXd>(head_bias_id, ThreadPool::current_node());
+
+    // Head: probabilities, then in place the loss gradient w.r.t. its logits
+    Eigen::Map<Eigen::MatrixXd> head = arena.matrix(rows, head_size());
+    gemm(head, hidden, head_weights.transpose());
+    head.rowwise() += head_bias.transpose();
+    ThreadPool::instance().parallel_for(0, rows, 16, [&](size_t begin, size_t end) {
+        softmax_rows(head.middleRows(begin, end - begin));
+    });
+    double total = 0.0;
+    for (Eigen::Index i = 0; i < rows; ++i) {
+        if (targets[i] < 0) {
+            head.row(i).setZero();
+            continue;
+        }
+        const int entry = head_entry(targets[i]);
+        total -= std::log(std::max(head(i, entry), epsilon));
+        head.row(i) *= weight;
+        head(i, entry) -= weight;
+    }
+    gemm_add(store->grad_view<RowMajorMatrixXd>(head_weights_id, grad_base), head.transpose(), hidden);
+    store->grad_view(head_bias_id, grad_base) += head.colwise().sum().transpose();
+    gemm(grad_hidden, head, head_weights);
+
+    // Tail clusters are independent tasks over the rows targeting them; each
+    // adds to its own rows of grad_hidden
+    Eigen::Map<Eigen::VectorXd> tail_losses(arena.allocate(clusters.size()), clusters.size());
+    tail_losses.setZero();
+    ThreadPool::instance().parallel_for(0, clusters.size(), 1, [&](size_t first, size_t last) {
+        for (size_t k = first; k < last; ++k) {
+            const Cluster& cluster = clusters[k];
+            auto is_member = [&](Eigen::Index i) { return targets[i] >= cluster.begin && targets[i] < cluster.end; };
+            Eigen::Index n = 0;
+            for (Eigen::Index i = 0; i < rows; ++i) n += is_member(i);
+            if (n == 0) continue;
+
+            Arena& local = Arena::local();
+            Arena::Mark cluster_mark = local.mark();
+            const int node = ThreadPool::current_node();
+            auto projection = store->replica_view(cluster.projection_id, node);
+            auto weights = store->replica_view<RowMajorMatrixXd>(cluster.weights_id, node);
+            auto bias = store->replica_view<Eigen::VectorXd>(cluster.bias_id, node);
+
+            Eigen::Map<Eigen::MatrixXd> input = local.matrix(n, embedding_dim);
+            for (Eigen::Index i = 0, j = 0; i < rows; ++i) {
+                if (is_member(i)) input.row(j++) = hidden.row(i);
+            }
+            Eigen::Map<Eigen::MatrixXd> projected = local.matrix(n, cluster.dim);
+            gemm(projected, input, projection);
+            Eigen::Map<Eigen::MatrixXd> scores = local.matrix(n, cluster.end - cluster.begin);
+            gemm(scores, projected, weights.transpose());
+            scores.rowwise() += bias.transpose();
+            softmax_rows(scores);
+            for (Eigen::Index i = 0, j = 0; i < rows; ++i) {
+                if (!is_member(i)) continue;
+                const int column = targets[i] - cluster.begin;
+                tail_losses[k] -= std::log(std::max(scores(j, column), epsilon));
+                scores.row(j) *= weight;
+                scores(j, column) -= weight;
+                ++j;
+            }
+
+            gemm_add(store->grad_view<RowMajorMatrixXd>(cluster.weights_id, grad_base), scores.transpose(), projected);
+            store->grad_view(cluster.bias_id, grad_base) += scores.colwise().sum().transpose();
+            Eigen::Map<Eigen::MatrixXd> grad_projected = local.matrix(n, cluster.dim);
+            gemm(grad_projected, scores, weights);
+            gemm_add(store->grad_view(cluster.projection_id, grad_base), input.transpose(), grad_projected);
+            // The input rows are no longer needed; they receive its gradient
+            gemm(input, grad_projected, projection.transpose());
+            for (Eigen::Index i = 0, j = 0; i < rows; ++i) {
+                if (is_member(i)) grad_hidden.row(i) += input.row(j++);
+            }
+            local.release(cluster_mark);
+        }
+    });
+    total += tail_losses.sum();
+    arena.release(mark);
+
+    double loss = count > 0 ? total / count : 0.0;
+    return loss * scale;
+}
+
+void AdaptiveSoftmax::predict(const Eigen::Ref<const Eigen::MatrixXd>& hidden,
+                              Eigen::Ref<Eigen::MatrixXd> probabilities) const {
+    // Rows are independent; each task scores the head and every cluster for its rows
+    ThreadPool::instance().parallel_for(0, hidden.rows(), predict_grain, [&](size_t begin, size_t end) {
+        const Eigen::Index n = static_cast<Eigen::Index>(end - begin);
+        const int node = ThreadPool::current_node();
+        Arena& arena = Arena::local();
+        Arena::Mark mark = arena.mark();
+        auto input = hidden.middleRows(begin, n);
+        auto output = probabilities.middleRows(begin, n);
+
+        Eigen::Map<Eigen::MatrixXd> head = arena.matrix(n, head_size());
+        gemm(head, input, store->replica_view<RowMajorMatrixXd>(head_weights_id, node).transpose());
+        head.rowwise() += store->replica_view<Eigen::VectorXd>(head_bias_id, node).transpose();
+        softmax_rows(head);
+        output.leftCols(shortlist) = head.leftCols(shortlist);
+
+        for (size_t k = 0; k < clusters.size(); ++k) {
+            const Cluster& cluster = clusters[k];
+            Eigen::Map<Eigen::MatrixXd> projected = arena.matrix(n, cluster.dim);
+            gemm(projected, input, store->replica_view(cluster.projection_id, node));
+            auto scores = output.middleCols(cluster.begin, cluster.end - cluster.begin);
+            gemm(scores, projected, store->replica_view<RowMajorMatrixXd>(cluster.weights_id, node).transpose());
+            scores.rowwise() += store->replica_view<Eigen::VectorXd>(cluster.bias_id, node).transpose();
+            softmax_rows(scores);
+            scores.array().colwise() *= head.col(shortlist + k).array();
+        }
+        arena.release(mark);
+    });
+}
+
+size_t AdaptiveSoftmax::loss_scratch_size(size_t rows) const {
+    // Head probabilities and cluster losses; then one cluster at a time (on
+    // one thread) holds its input, projection, scores and their gradient,
+    // sized as if every row targeted it
+    const Eigen::Index n = static_cast<Eigen::Index>(rows);
+    size_t scratch = std::max({gemm_scratch_size(n, head_size(), embedding_dim),
+                               gemm_scratch_size(head_size(), embedding_dim, n),
+                               gemm_scratch_size(n, embedding_dim, head_size())});
+    for (const Cluster& cluster : clusters) {
+        const int size = cluster.end - cluster.begin;
+        scratch = std::max(scratch, AlignedBuffer::padded(rows * embedding_dim) + 2 * AlignedBuffer::padded(rows * cluster.dim) +
+                                        AlignedBuffer::padded(rows * size) +
+                                        std::max({gemm_scratch_size(n, cluster.dim, embedding_dim),
+                                                  gemm_scratch_size(n, size, cluster.dim),
+                                                  gemm_scratch_size(size, cluster.dim, n),
+                                                  gemm_scratch_size(n, cluster.dim, size),
+                                                  gemm_scratch_size(embedding_dim, cluster.dim, n),
+                                                  gemm_scratch_size(n, embedding_dim, cluster.dim)}));
+    }
+    return AlignedBuffer::padded(rows * head_size()) + AlignedBuffer::padded(clusters.size()) + scratch;
+}
+
+size_t AdaptiveSoftmax::predict_scratch_size(size_t rows) const {
+    // A task's head probabilities and every cluster's projection
+    const size_t chunk = ThreadPool::instance().max_chunk(rows, predict_grain);
+    const Eigen::Index n = static_cast<Eigen::Index>(chunk);
+    size_t size = AlignedBuffer::padded(chunk * head_size());
+    size_t products = gemm_scratch_size(n, head_size(), embedding_dim);
+    for (const Cluster& cluster : clusters) {
+        size += AlignedBuffer::padded(chunk * cluster.dim);
+        products = std::max({products, gemm_scratch_size(n, cluster.dim, embedding_dim),
+                             gemm_scratch_size(n, cluster.end - cluster.begin, cluster.dim)});
+    }
+    return size + products;
+}
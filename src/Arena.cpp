@@ -0,0 +1,78 @@
+#include "Arena.h"
+#include "Logger.h"
+#include <algorithm>
+
+namespace {
+
+const size_t min_block_size = 1 << 16; // Doubles (512 KB)
+
+} // namespace
+
+std::atomic<uint64_t> Arena::step_generation(0);
+std::atomic<size_t> Arena::largest_peak(0);
+
+Arena::Arena() : current(0), offset(0), used(0), peak(0), generation(0) {}
+
+Arena& Arena::local() {
+    thread_local Arena arena;
+    return arena;
+}
+
+void Arena::begin_step() {
+    step_generation.fetch_add(1, std::memory_order_release);
+}
+
+void Arena::rewind() {
+    generation = step_generation.load(std::memory_order_acquire);
+    if (blocks.size() > 1) {
+        // Replace the blocks of a growing step by one that holds all of them
+        size_t total = capacity();
+        blocks.clear();
+        blocks.emplace_back(total);
+        Logger::get_instance().log("Arena merged into one block of " + std::to_string(total) + " doubles",
+                                   LogLevel::DEBUG);
+    }
+    current = 0;
+    offset = 0;
+    used = 0;
+}
+
+double* Arena::allocate(size_t n) {
+    if (generation != step_generation.load(std::memory_order_acquire)) rewind();
+    n = AlignedBuffer::padded(std::max<size_t>(n, 1));
+    // Blocks after current are free again when a release went back past them
+    while (current < blocks.size() && offset + n > blocks[current].size()) {
+        ++current;
+        offset = 0;
+    }
+    if (current == blocks.size()) blocks.emplace_back(std::max({n, capacity(), min_block_size}));
+    double* data = blocks[current].data() + offset;
+    offset += n;
+    used += n;
+    if (used > peak) {
+        peak = used;
+        size_t largest = largest_peak.load(std::memory_order_relaxed);
+        while (largest < peak && !largest_peak.compare_exchange_weak(largest, peak, std::memory_order_relaxed)) {
+        }
+    }
+    return data;
+}
+
+Arena::Mark Arena::mark() {
+    if (generation != step_generation.load(std::memory_order_acquire)) rewind();
+    return {current, offset, used, generation};
+}
+
+void Arena::release(const Mark& mark) {
+    // A mark from an earlier step has nothing left to release
+    if (mark.generation != generation) return;
+    current = mark.block;
+    offset = mark.offset;
+    used = mark.used;
+}
+
+size_t Arena::capacity() const {
+    size_t total = 0;
+    for (const auto& block : blocks) total += block.size();
+    return total;
+}
@@ -0,0 +1,81 @@
+#include "CandidateSampler.h"
+#include "Logger.h"
+#include <cmath>
+
+CandidateSampler::CandidateSampler(SamplerType type, int vocab_size, const std::vector<long>& counts,
+                                   unsigned int seed)
+    : type(type), rng(seed) {
+    if (vocab_size <= 0) return;
+    probabilities.resize(vocab_size);
+    double total = 0.0;
+    for (int id = 0; id < vocab_size; ++id) {
+        if (type == SamplerType::LOG_UNIFORM) {
+            probabilities[id] = std::log1p(1.0 / (id + 1.0));
+        } else {
+            probabilities[id] = 1.0 + (static_cast<size_t>(id) < counts.size() ? counts[id] : 0);
+        }
+        total += probabilities[id];
+    }
+    for (double& p : probabilities) p /= total;
+
+    // Vose's construction: buckets scaled to an average of one; each small
+    // bucket is topped up by a large one, which becomes its alias
+    thresholds.resize(vocab_size);
+    aliases.resize(vocab_size);
+    std::vector<int> small, large;
+    for (int id = 0; id < vocab_size; ++id) {
+        thresholds[id] = probabilities[id] * vocab_size;
+        aliases[id] = id;
+        (thresholds[id] < 1.0 ? small : large).push_back(id);
+    }
+    while (!small.empty() && !large.empty()) {
+        int low = small.back();
+        int high = large.back();
+        small.pop_back();
+        aliases[low] = high;
+        thresholds[high] -= 1.0 - thresholds[low];
+        if (thresholds[high] < 1.0) {
+            large.pop_back();
+            small.push_back(high);
+        }
+    }
+    // Leftovers are full buckets up to rounding
+    for (int id : small) thresholds[id] = 1.0;
+    for (int id : large) thresholds[id] = 1.0;
+    taken.assign(vocab_size, 0);
+
+    Logger::get_instance().log(std::string("Candidate sampler: ") + name(type) + " over " +
+                               std::to_string(vocab_size) + " tokens", LogLevel::INFO);
+}
+
+int CandidateSampler::sample() {
+    std::uniform_int_distribution<int> bucket(0, size() - 1);
+    std::uniform_real_distribution<double> coin(0.0, 1.0);
+    int id = bucket(rng);
+    return coin(rng) < thresholds[id] ? id : aliases[id];
+}
+
+long CandidateSampler::sample_unique(int count, std::vector<int>& samples) {
+    samples.clear();
+    long tries = 0;
+    while (static_cast<int>(samples.size()) < count && static_cast<int>(samples.size()) < size()) {
+        int id = sample();
+        ++tries;
+        if (taken[id]) continue;
+        taken[id] = 1;
+        samples.push_back(id);
+    }
+    for (int id : samples) taken[id] = 0;
+    return tries;
+}
+
+double CandidateSampler::expected_count(int id, long tries) const {
+    return -std::expm1(tries * std::log1p(-probabilities[id]));
+}
+
+const char* CandidateSampler::name(SamplerType type) {
+    switch (type) {
+        case SamplerType::UNIGRAM: return "unigram";
+        default: return "log-uniform";
+    }
+}
@@ -0,0 +1,238 @@
+#include "Checkpoint.h"
+#include "Logger.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace {
+
+const char checkpoint_magic[8] = {'M', 'A', 'I', 'R', 'C', 'K', 'P', 'T'};
+const uint64_t segment_alignment = 64;
+
+uint64_t align_up(uint64_t n) {
+    return (n + segment_alignment - 1) / segment_alignment * segment_alignment;
+}
+
+// writev may stop short on large buffers; continue from where it stopped
+bool write_all(int fd, std::vector<iovec> iov) {
+    size_t index = 0;
+    while (index < iov.size()) {
+        int count = static_cast<int>(std::min<size_t>(iov.size() - index, IOV_MAX));
+        ssize_t written = ::writev(fd, iov.data() + index, count);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        size_t remaining = static_cast<size_t>(written);
+        while (index < iov.size() && remaining >= iov[index].iov_len) {
+            remaining -= iov[index].iov_len;
+            ++index;
+        }
+        if (remaining > 0) {
+            iov[index].iov_base = static_cast<char*>(iov[index].iov_base) + remaining;
+            iov[index].iov_len -= remaining;
+        }
+    }
+    return true;
+}
+
+// Make a rename durable
+void sync_parent_directory(const std::string& path) {
+    size_t slash = path.find_last_of('/');
+    std::string directory = slash == std::string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+    int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) return;
+    ::fsync(fd);
+    ::close(fd);
+}
+
+} // namespace
+
+double* CheckpointSnapshot::stage(size_t i, size_t n) {
+    if (buffers.size() <= i) buffers.resize(i + 1);
+    if (buffers[i].size() != n) buffers[i] = AlignedBuffer(n);
+    return buffers[i].data();
+}
+
+bool Checkpoint::write(const std::string& path, const CheckpointHeader& header_template,
+                       const std::vector<CheckpointSegment>& segments,
+                       const std::vector<CheckpointTensor>& tensors) {
+    // Lay out segments after the entry table, each on a 64-byte boundary
+    uint64_t data_offset = align_up(sizeof(CheckpointHeader) + tensors.size() * sizeof(CheckpointEntry));
+    std::vector<uint64_t> segment_offsets;
+    uint64_t end = data_offset;
+    for (const auto& segment : segments) {
+        segment_offsets.push_back(end);
+        end = align_up(end + segment.nbytes);
+    }
+
+    std::vector<char> meta(data_offset, 0);
+    CheckpointHeader header = header_template;
+    std::memcpy(header.magic, checkpoint_magic, sizeof(header.magic));
+    header.version = version;
+    header.num_entries = static_cast<uint32_t>(tensors.size());
+    header.data_offset = data_offset;
+    header.file_size = end;
+    std::memcpy(meta.data(), &header, sizeof(header));
+
+    for (size_t i = 0; i < tensors.size(); ++i) {
+        const auto& tensor = tensors[i];
+        CheckpointEntry entry;
+        std::memset(&entry, 0, sizeof(entry));
+        if (tensor.name.size() >= sizeof(entry.name)) {
+            Logger::get_instance().log("Checkpoint tensor name too long: " + tensor.name, LogLevel::ERROR);
+            return false;
+        }
+        std::memcpy(entry.name, tensor.name.data(), tensor.name.size());
+        entry.dtype = static_cast<uint32_t>(tensor.dtype);
+        entry.rows = tensor.rows;
+        entry.cols = tensor.cols;
+        entry.offset = segment_offsets[tensor.segment] + tensor.offset;
+        entry.nbytes = tensor.nbytes;
+        std::memcpy(meta.data() + sizeof(CheckpointHeader) + i * sizeof(CheckpointEntry), &entry, sizeof(entry));
+    }
+
+    // One gather list: metadata, then each segment followed by its alignment padding
+    static const char zeros[segment_alignment] = {};
+    std::vector<iovec> iov;
+    iov.push_back({meta.data(), meta.size()});
+    for (size_t i = 0; i < segments.size(); ++i) {
+        if (segments[i].nbytes > 0) iov.push_back({const_cast<void*>(segments[i].data), segments[i].nbytes});
+        size_t padding = align_up(segment_offsets[i] + segments[i].nbytes) - (segment_offsets[i] + segments[i].nbytes);
+        if (padding > 0) iov.push_back({const_cast<char*>(zeros), padding});
+    }
+
+    // Write a temporary file and rename it into place once it is durable. This
+    // also leaves existing mappings of the old file (a loaded model) intact.
+    std::string temp_path = path + ".tmp";
+    int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        Logger::get_instance().log("Could not open checkpoint " + temp_path + ": " + std::strerror(errno), LogLevel::ERROR);
+        return false;
+    }
+    bool ok = write_all(fd, std::move(iov)) && ::fsync(fd) == 0;
+    if (::close(fd) != 0) ok = false;
+    if (!ok || ::rename(temp_path.c_str(), path.c_str()) != 0) {
+        Logger::get_instance().log("Failed writing checkpoint " + path + ": " + std::strerror(errno), LogLevel::ERROR);
+        ::unlink(temp_path.c_str());
+        return false;
+    }
+    sync_parent_directory(path);
+
+    Logger::get_instance().log("Wrote checkpoint " + path + " (" + std::to_string(end) + " bytes, " +
+                               std::to_string(tensors.size()) + " entries)", LogLevel::INFO);
+    return true;
+}
+
+MappedCheckpoint::~MappedCheckpoint() {
+    if (base) ::munmap(base, length);
+}
+
+std::unique_ptr<MappedCheckpoint> MappedCheckpoint::open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        Logger::get_instance().log("Could not open checkpoint " + path + ": " + std::strerror(errno), LogLevel::ERROR);
+        return nullptr;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(CheckpointHeader)) {
+        Logger::get_instance().log("Checkpoint " + path + " is too small", LogLevel::ERROR);
+        ::close(fd);
+        return nullptr;
+    }
+
+    // Private writable mapping: training on a loaded model copies touched pages
+    // instead of modifying the file
+    size_t length = static_cast<size_t>(st.st_size);
+    void* base = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        Logger::get_instance().log("Could not map checkpoint " + path + ": " + std::strerror(errno), LogLevel::ERROR);
+        return nullptr;
+    }
+    std::unique_ptr<MappedCheckpoint> mapped(new MappedCheckpoint(base, length));
+
+    const CheckpointHeader& header = mapped->header();
+    if (std::memcmp(header.magic, checkpoint_magic, sizeof(header.magic)) != 0 || header.version != Checkpoint::version) {
+        Logger::get_instance().log("Checkpoint " + path + " has an unknown format or version", LogLevel::ERROR);
+        return nullptr;
+    }
+    if (header.file_size != length ||
+        sizeof(CheckpointHeader) + static_cast<uint64_t>(header.num_entries) * sizeof(CheckpointEntry) > header.data_offset) {
+        Logger::get_instance().log("Checkpoint " + path + " is truncated or corrupt", LogLevel::ERROR);
+        return nullptr;
+    }
+    for (uint32_t i = 0; i < header.num_entries; ++i) {
+        const CheckpointEntry& entry = mapped->entries()[i];
+        if (entry.name[sizeof(entry.name) - 1] != '\0' || entry.offset + entry.nbytes > length) {
+            Logger::get_instance().log("Checkpoint " + path + " has an invalid entry table", LogLevel::ERROR);
+            return nullptr;
+        }
+    }
+
+    Logger::get_instance().log("Mapped checkpoint " + path + " (" + std::to_string(length) + " bytes)", LogLevel::INFO);
+    return mapped;
+}
+
+const CheckpointEntry* MappedCheckpoint::find(const std::string& name) const {
+    for (uint32_t i = 0; i < header().num_entries; ++i) {
+        if (name == entries()[i].name) return &entries()[i];
+    }
+    return nullptr;
+}
+
+CheckpointWriter::CheckpointWriter() : busy(false), stopping(false), last_result(true) {
+    worker = std::thread(&CheckpointWriter::run, this);
+}
+
+CheckpointWriter::~CheckpointWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_all();
+    worker.join();
+}
+
+CheckpointSnapshot* CheckpointWriter::acquire() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return busy ? nullptr : &staging;
+}
+
+void CheckpointWriter::submit(const std::string& path) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending_path = path;
+        busy = true;
+    }
+    cv.notify_all();
+}
+
+bool CheckpointWriter::wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [this] { return !busy; });
+    return last_result;
+}
+
+void CheckpointWriter::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        cv.wait(lock, [this] { return busy || stopping; });
+        if (!busy) return; // Stopping with nothing pending
+
+        // The training thread does not touch staging while busy is set
+        std::string path = pending_path;
+        lock.unlock();
+        bool result = Checkpoint::write(path, staging);
+        lock.lock();
+        last_result = result;
+        busy = false;
+        cv.notify_all();
+    }
+}
@@ -0,0 +1,197 @@
+#include "Communicator.h"
+#include "Logger.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Shared-memory counters must be lock-free");
+
+const int attach_timeout_ms = 60000;
+
+size_t align_up(size_t n) {
+    return (n + 63) / 64 * 64;
+}
+
+// Spin, then yield, then sleep until counter reaches target
+void wait_for(const std::atomic<uint64_t>& counter, uint64_t target) {
+    int attempt = 0;
+    while (counter.load(std::memory_order_acquire) < target) {
+        if (attempt < 64) {
+            // Busy spin: another rank is usually close behind
+        } else if (attempt < 256) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+        ++attempt;
+    }
+}
+
+} // namespace
+
+ShmCommunicator::ShmCommunicator(const std::string& name, int rank, int world_size, size_t count,
+                                 const std::vector<GradientBucket>& buckets)
+    : name(name), rank(rank), world_size(world_size), count(count), buckets(buckets), base(nullptr), length(0),
+      step(0), barrier_generation(0), sum_generation(0), bucket_steps(buckets.size(), 0),
+      posted(std::max<size_t>(buckets.size(), 2)) {}
+
+ShmCommunicator::~ShmCommunicator() {
+    posted.close();
+    if (reducer.joinable()) reducer.join();
+    if (base) ::munmap(base, length);
+    if (rank == 0) ::shm_unlink(name.c_str());
+}
+
+bool ShmCommunicator::map_segment() {
+    // Layout: control counters, per-bucket counters, scratch values, slots, results
+    size_t control_bytes = 3 * sizeof(Counter);
+    size_t bucket_bytes = 2 * buckets.size() * sizeof(Counter);
+    size_t value_bytes = align_up(2 * world_size * sizeof(int64_t));
+    size_t slot_bytes = align_up(count * sizeof(double));
+    length = control_bytes + bucket_bytes + value_bytes + (world_size + 2) * slot_bytes;
+
+    int fd = -1;
+    if (rank == 0) {
+        ::shm_unlink(name.c_str()); // Drop a segment left behind by a crashed run
+        fd = ::shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd >= 0 && ::ftruncate(fd, static_cast<off_t>(length)) != 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    } else {
+        // Wait for rank 0 to create and size the segment
+        for (int waited = 0; waited < attach_timeout_ms; waited += 10) {
+            fd = ::shm_open(name.c_str(), O_RDWR, 0600);
+            struct stat st;
+            if (fd >= 0 && ::fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) == length) break;
+            if (fd >= 0) ::close(fd);
+            fd = -1;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+    if (fd < 0) {
+        Logger::get_instance().log("Could not open shared memory segment " + name + ": " + std::strerror(errno),
+                                   LogLevel::ERROR);
+        return false;
+    }
+    base = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        base = nullptr;
+        Logger::get_instance().log("Could not map shared memory segment " + name + ": " + std::strerror(errno),
+                                   LogLevel::ERROR);
+        return false;
+    }
+
+    // A new segment is zero-filled, which is a valid state for every counter
+    char* cursor = static_cast<char*>(base);
+    ready = reinterpret_cast<Counter*>(cursor);
+    attached = ready + 1;
+    barrier_count = ready + 2;
+    cursor += control_bytes;
+    arrived = reinterpret_cast<Counter*>(cursor);
+    reduced = arrived + buckets.size();
+    cursor += bucket_bytes;
+    values = reinterpret_cast<int64_t*>(cursor);
+    cursor += value_bytes;
+    slots = reinterpret_cast<double*>(cursor);
+    results = slots + world_size * (slot_bytes / sizeof(double));
+    return true;
+}
+
+std::unique_ptr<ShmCommunicator> ShmCommunicator::create(const std::string& name, int rank, int world_size, size_t count,
+                                                         const std::vector<GradientBucket>& buckets) {
+    if (world_size <= 0 || rank < 0 || rank >= world_size) {
+        Logger::get_instance().log("Invalid rank " + std::to_string(rank) + " for world size " +
+                                   std::to_string(world_size), LogLevel::ERROR);
+        return nullptr;
+    }
+    std::unique_ptr<ShmCommunicator> comm(new ShmCommunicator(name, rank, world_size, count, buckets));
+    if (!comm->map_segment()) return nullptr;
+
+    if (rank == 0) comm->ready->value.store(1, std::memory_order_release);
+    wait_for(comm->ready->value, 1);
+    comm->attached->value.fetch_add(1, std::memory_order_acq_rel);
+    wait_for(comm->attached->value, static_cast<uint64_t>(world_size));
+
+    comm->reducer = std::thread(&ShmCommunicator::reduce_loop, comm.get());
+    Logger::get_instance().log("Rank " + std::to_string(rank) + " of " + std::to_string(world_size) +
+                               " attached to " + name + " (" + std::to_string(comm->length) + " bytes, " +
+                               std::to_string(buckets.size()) + " buckets)", LogLevel::INFO);
+    return comm;
+}
+
+void ShmCommunicator::post(size_t b, const double* grad) {
+    const GradientBucket& bucket = buckets[b];
+    std::memcpy(slots + rank * align_up(count * sizeof(double)) / sizeof(double) + bucket.begin, grad + bucket.begin,
+                (bucket.end - bucket.begin) * sizeof(double));
+    arrived[b].value.fetch_add(1, std::memory_order_acq_rel);
+    posted.push(b);
+}
+
+void ShmCommunicator::reduce_loop() {
+    const size_t stride = align_up(count * sizeof(double)) / sizeof(double);
+    const double scale = 1.0 / world_size;
+    size_t b;
+    while (posted.pop(b)) {
+        uint64_t generation = ++bucket_steps[b];
+        wait_for(arrived[b].value, generation * world_size);
+
+        // This rank's shard of the bucket, summed in rank order so every rank
+        // produces the same bits
+        const GradientBucket& bucket = buckets[b];
+        size_t size = bucket.end - bucket.begin;
+        size_t begin = bucket.begin + size * rank / world_size;
+        size_t end = bucket.begin + size * (rank + 1) / world_size;
+        double* __restrict result = results + (generation % 2) * stride;
+        for (size_t k = begin; k < end; ++k) result[k] = slots[k];
+        for (int r = 1; r < world_size; ++r) {
+            const double* __restrict slot = slots + r * stride;
+            for (size_t k = begin; k < end; ++k) result[k] += slot[k];
+        }
+        for (size_t k = begin; k < end; ++k) result[k] *= scale;
+        reduced[b].value.fetch_add(1, std::memory_order_acq_rel);
+    }
+}
+
+void ShmCommunicator::finish(double* grad) {
+    ++step;
+    const size_t stride = align_up(count * sizeof(double)) / sizeof(double);
+    const double* result = results + (step % 2) * stride;
+    for (size_t b = 0; b < buckets.size(); ++b) {
+        wait_for(reduced[b].value, step * world_size);
+        std::memcpy(grad + buckets[b].begin, result + buckets[b].begin,
+                    (buckets[b].end - buckets[b].begin) * sizeof(double));
+    }
+}
+
+void ShmCommunicator::broadcast(double* data, size_t n) {
+    n = std::min(n, count);
+    if (rank == 0) std::memcpy(slots, data, n * sizeof(double));
+    barrier();
+    if (rank != 0) std::memcpy(data, slots, n * sizeof(double));
+    barrier();
+}
+
+void ShmCommunicator::barrier() {
+    ++barrier_generation;
+    barrier_count->value.fetch_add(1, std::memory_order_acq_rel);
+    wait_for(barrier_count->value, barrier_generation * world_size);
+}
+
+int64_t ShmCommunicator::all_reduce_sum(int64_t value) {
+    // Alternate between two scratch rows; a rank can only get one call ahead
+    int64_t* row = values + (sum_generation++ % 2) * world_size;
+    row[rank] = value;
+    barrier();
+    int64_t sum = 0;
+    for (int r = 0; r < world_size; ++r) sum += row[r];
+    return sum;
+}
@@ -0,0 +1,285 @@
+#include "DataPipeline.h"
+#include "Logger.h"
+#include <json.hpp>
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <numeric>
+#include <random>
+
+using json = nlohmann::json;
+
+namespace {
+
+// Restores pass order for items that parallel stages emit out of order.
+// Holds at most the number of items in flight upstream.
+class Reorderer {
+private:
+    std::map<size_t, Example> pending;
+    size_t next_index = 0;
+
+public:
+    void push(Example&& example) { pending.emplace(example.index, std::move(example)); }
+
+    bool pop_ready(Example& example) {
+        auto it = pending.find(next_index);
+        if (it == pending.end()) return false;
+        example = std::move(it->second);
+        pending.erase(it);
+        ++next_index;
+        return true;
+    }
+};
+
+const size_t batch_prefetch_depth = 4; // Batches the trainer can run behind the pipeline
+
+} // namespace
+
+DataPipeline::DataPipeline(const PipelineOptions& options, Tokenizer& tokenizer, int vocab_size)
+    : options(options), tokenizer(tokenizer), cancelled(false) {
+    this->options.worker_threads = std::max(1, options.worker_threads);
+    this->options.packing.vocab_size = vocab_size;
+    this->options.queue_depth = std::max<size_t>(2, options.queue_depth);
+    Logger::get_instance().log("DataPipeline initialized for " + options.json_file + " with " +
+                               std::to_string(this->options.worker_threads) + " threads per stage", LogLevel::INFO);
+}
+
+DataPipeline::~DataPipeline() {
+    stop();
+}
+
+std::string DataPipeline::clean_text(const std::string& text) {
+    std::string cleaned;
+
+    // Remove unwanted characters and normalize case
+    for (char ch : text) {
+        unsigned char c = static_cast<unsigned char>(ch);
+        if (std::isalnum(c) || std::isspace(c)) {
+            cleaned += static_cast<char>(std::tolower(c));
+        }
+    }
+
+    // Normalize whitespace
+    std::string normalized;
+    bool in_whitespace = false;
+    for (char ch : cleaned) {
+        if (std::isspace(static_cast<unsigned char>(ch))) {
+            if (!in_whitespace) {
+                normalized += ' ';
+                in_whitespace = true;
+            }
+        } else {
+            normalized += ch;
+            in_whitespace = false;
+        }
+    }
+
+    return normalized;
+}
+
+void DataPipeline::reset_queues() {
+    raw_queue = std::make_unique<BoundedQueue<Example>>(options.queue_depth);
+    clean_queue = std::make_unique<BoundedQueue<Example>>(options.queue_depth);
+    token_queue = std::make_unique<BoundedQueue<Example>>(options.queue_depth);
+    batch_queue = std::make_unique<BoundedQueue<TokenBatch>>(batch_prefetch_depth);
+    cancelled = false;
+}
+
+void DataPipeline::stop() {
+    cancelled = true;
+    for (auto* queue : {raw_queue.get(), clean_queue.get(), token_queue.get()}) {
+        if (queue) queue->close();
+    }
+    if (batch_queue) batch_queue->close();
+    for (auto& worker : workers) {
+        if (worker.joinable()) worker.join();
+    }
+    workers.clear();
+}
+
+template <typename Stage>
+void DataPipeline::spawn_parallel(BoundedQueue<Example>& out, Stage stage) {
+    // The last thread of a stage to finish closes the downstream queue
+    auto remaining = std::make_shared<std::atomic<int>>(options.worker_threads);
+    for (int t = 0; t < options.worker_threads; ++t) {
+        workers.emplace_back([this, &out, stage, remaining]() {
+            (this->*stage)();
+            if (remaining->fetch_sub(1) == 1) out.close();
+        });
+    }
+}
+
+void DataPipeline::read_all_stage() {
+    std::ifstream file(options.json_file);
+    if (!file.is_open()) {
+        Logger::get_instance().log("Could not open file " + options.json_file, LogLevel::ERROR);
+        raw_queue->close();
+        return;
+    }
+
+    std::string line;
+    size_t index = 0;
+    std::streamoff offset = file.tellg();
+    while (!cancelled && std::getline(file, line)) {
+        Example example;
+        example.index = index++;
+        example.offset = offset;
+        example.text = std::move(line);
+        if (!raw_queue->push(std::move(example))) break;
+        offset = file.tellg();
+    }
+    raw_queue->close();
+}
+
+void DataPipeline::read_stage(const std::vector<size_t>& order) {
+    std::ifstream file(options.json_file);
+    if (!file.is_open()) {
+        Logger::get_instance().log("Could not open file " + options.json_file, LogLevel::ERROR);
+        raw_queue->close();
+        return;
+    }
+
+    std::string line;
+    for (size_t i = 0; i < order.size() && !cancelled; ++i) {
+        file.seekg(offsets[order[i]]);
+        if (!std::getline(file, line)) break;
+        Example example;
+        example.index = i;
+        example.offset = offsets[order[i]];
+        example.text = std::move(line);
+        if (!raw_queue->push(std::move(example))) break;
+    }
+    raw_queue->close();
+}
+
+void DataPipeline::clean_stage() {
+    Example example;
+    while (raw_queue->pop(example)) {
+        example.valid = false;
+        try {
+            json parsed_line = json::parse(example.text);
+            if (parsed_line.contains("text")) {
+                example.text = clean_text(parsed_line["text"].get<std::string>());
+                example.valid = true;
+            }
+        } catch (const json::exception& e) {
+            Logger::get_instance().log("Error parsing JSON line " + std::to_string(example.index) +
+                                       ": " + e.what(), LogLevel::WARNING);
+        }
+        if (!example.valid) example.text.clear();
+        if (!clean_queue->push(std::move(example))) return;
+    }
+}
+
+void DataPipeline::tokenize_stage() {
+    Example example;
+    while (clean_queue->pop(example)) {
+        example.tokens = tokenizer.tokenize(example.text);
+        if (!token_queue->push(std::move(example))) return;
+    }
+}
+
+void DataPipeline::pack_stage() {
+    // Packing concatenates documents, so it consumes them in pass order
+    SequencePacker packer(options.packing);
+    Reorderer reorderer;
+    TokenBatch batch;
+    Example example;
+    while (token_queue->pop(example)) {
+        reorderer.push(std::move(example));
+        while (reorderer.pop_ready(example)) {
+            packer.add(example.tokens);
+            while (packer.pop(batch)) {
+                if (!batch_queue->push(std::move(batch))) return;
+            }
+        }
+    }
+    if (!cancelled) {
+        packer.flush();
+        while (packer.pop(batch)) {
+            if (!batch_queue->push(std::move(batch))) return;
+        }
+    }
+    batch_queue->close();
+}
+
+size_t DataPipeline::build_index() {
+    Logger::get_instance().log("Indexing " + options.json_file + " and building vocabulary", LogLevel::INFO);
+    stop();
+    reset_queues();
+    offsets.clear();
+    counts.clear();
+
+    workers.emplace_back(&DataPipeline::read_all_stage, this);
+    spawn_parallel(*clean_queue, &DataPipeline::clean_stage);
+
+    // Vocabulary IDs are assigned in file order, so consume entries in order.
+    // A vocabulary loaded with a checkpoint keeps its IDs.
+    const bool sort = options.sort_vocab && tokenizer.size() == 0;
+    const bool count = options.sort_vocab || options.count_tokens;
+    Reorderer reorderer;
+    Example example;
+    bool done = false;
+    while (!done && clean_queue->pop(example)) {
+        reorderer.push(std::move(example));
+        while (!done && reorderer.pop_ready(example)) {
+            if (!example.valid) continue;
+            tokenizer.add_to_vocab(example.text);
+            if (count) {
+                counts.resize(tokenizer.size());
+                for (int id : tokenizer.tokenize(example.text)) ++counts[id];
+            }
+            offsets.push_back(example.offset);
+            done = static_cast<int>(offsets.size()) >= options.max_entries;
+        }
+    }
+    stop();
+
+    // Cleaned text never contains the separator word, so it cannot collide with a corpus token
+    const bool separated = options.packing.mode == PackingMode::CONCATENATE && !options.separator.empty();
+    if (separated) tokenizer.add_to_vocab(options.separator);
+    if (count) {
+        counts.resize(tokenizer.size());
+        if (separated) counts[tokenizer.lookup(options.separator)] += static_cast<long>(offsets.size()); // One per entry
+    }
+    if (sort) {
+        tokenizer.sort_by_frequency(counts);
+        // The new IDs follow the same stable order
+        std::stable_sort(counts.begin(), counts.end(), std::greater<long>());
+    }
+    if (separated) options.packing.separator_token = tokenizer.lookup(options.separator);
+
+    Logger::get_instance().log("Indexed " + std::to_string(offsets.size()) + " entries", LogLevel::INFO);
+    return offsets.size();
+}
+
+void DataPipeline::start_epoch(int epoch) {
+    stop();
+    reset_queues();
+
+    std::vector<size_t> order(offsets.size());
+    std::iota(order.begin(), order.end(), 0);
+    if (options.shuffle) {
+        std::mt19937 rng(options.seed + static_cast<unsigned int>(epoch));
+        std::shuffle(order.begin(), order.end(), rng);
+    }
+    if (options.world_size > 1) {
+        // Every rank shuffles with the same seed, so the shards are disjoint
+        std::vector<size_t> shard;
+        for (size_t i = options.rank; i < order.size(); i += options.world_size) shard.push_back(order[i]);
+        order.swap(shard);
+    }
+
+    workers.emplace_back([this, order]() { read_stage(order); });
+    spawn_parallel(*clean_queue, &DataPipeline::clean_stage);
+    spawn_parallel(*token_queue, &DataPipeline::tokenize_stage);
+    workers.emplace_back(&DataPipeline::pack_stage, this);
+}
+
+bool DataPipeline::next_batch(TokenBatch& batch) {
+    if (batch_queue && batch_queue->pop(batch)) return true;
+    stop();
+    return false;
+}
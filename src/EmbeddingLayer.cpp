@@ -1,32 +1,157 @@
 #include "EmbeddingLayer.h"
+#include "Arena.h"
 #include "Logger.h"
+#include "ThreadPool.h"
+#include <atomic>
+#include <cmath>
 
-EmbeddingLayer::EmbeddingLayer(int vocab_size, int embedding_dim)
-    : vocab_size(vocab_size), embedding_dim(embedding_dim) {
+namespace {
+
+const size_t prefetch_distance = 8;   // Tokens ahead whose rows are prefetched
+const size_t parallel_tokens = 4096;  // Smaller gathers run on the calling thread
+const size_t gather_grain = 1024;     // Tokens per pool task
+
+} // namespace
+
+EmbeddingLayer::EmbeddingLayer(int vocab_size, int embedding_dim, ParameterStore& store, const std::string& prefix,
+                               const VocabularyHash& hash)
+    : store(&store), embedding_matrix(nullptr, 0, 0), vocab_size(vocab_size), embedding_dim(embedding_dim), hash(hash) {
     Logger::get_instance().log("Initializing EmbeddingLayer", LogLevel::INFO);
-    embedding_matrix = Eigen::MatrixXd::Random(vocab_size, embedding_dim);
+    tensor_id = store.add(prefix + "embedding_matrix", table_rows(), embedding_dim);
+    if (hash.hashed()) {
+        Logger::get_instance().log("Embeddings summed from " + std::to_string(hash.get_num_hashes()) + " hashed rows of " +
+                                   std::to_string(hash.get_buckets()) + " buckets each", LogLevel::INFO);
+    }
+}
+
+void EmbeddingLayer::bind_views() {
+    store->bind(embedding_matrix, tensor_id);
+}
+
+void EmbeddingLayer::initialize() {
+    bind_views();
+    // Drawn in column order, as before the table became row-major
+    embedding_matrix = Eigen::MatrixXd(Eigen::MatrixXd::Random(table_rows(), embedding_dim));
+    // A sum of k rows keeps the variance of one
+    if (hash.hashed()) embedding_matrix /= std::sqrt(static_cast<double>(hash.get_num_hashes()));
     Logger::get_instance().log("Embedding matrix initialized with dimensions: " +
-                               std::to_string(vocab_size) + "x" +
+                               std::to_string(table_rows()) + "x" +
                                std::to_string(embedding_dim), LogLevel::DEBUG);
 }
 
+void EmbeddingLayer::quantize(QuantizationType type, int group_size) {
+    if (type == QuantizationType::NONE) {
+        quantized.clear();
+        return;
+    }
+    quantized.quantize(embedding_matrix.data(), table_rows(), embedding_dim, type, group_size);
+}
+
 Eigen::MatrixXd EmbeddingLayer::get_embeddings(const std::vector<int>& token_ids) {
-    Logger::get_instance().log("Fetching embeddings for token IDs", LogLevel::DEBUG);
+    return get_embeddings(token_ids, {});
+}
+
+Eigen::MatrixXd EmbeddingLayer::get_embeddings(const std::vector<int>& token_ids, const std::vector<int>& segments) {
     Eigen::MatrixXd result(token_ids.size(), embedding_dim);
+    get_embeddings(token_ids, segments, result);
+    return result;
+}
+
+void EmbeddingLayer::get_embeddings(const std::vector<int>& token_ids, const std::vector<int>& segments,
+                                    Eigen::Ref<Eigen::MatrixXd> result) {
+    Logger::get_instance().log("Fetching embeddings for token IDs", LogLevel::DEBUG);
+    const size_t count = token_ids.size();
+    const bool dequantize = !quantized.empty();
+    const int per_token = hash.rows_per_token();
+    const size_t row_bytes = dequantize ? quantized.get_row_bytes()
+                                        : static_cast<size_t>(embedding_dim) * sizeof(double);
+    std::atomic<size_t> invalid(0);
+
+    auto gather = [&](size_t begin, size_t end) {
+        // Each task reads the replica on its own NUMA node
+        auto table = store->replica_view<RowMajorMatrixXd>(tensor_id, ThreadPool::current_node());
+        const double* data = table.data();
+        Arena& arena = Arena::local();
+        Arena::Mark mark = arena.mark();
+        Eigen::Map<Eigen::RowVectorXd> row_values(dequantize ? arena.allocate(embedding_dim) : nullptr, embedding_dim);
+        size_t bad = 0;
+        for (size_t i = begin; i < end; ++i) {
+            // Every cache line of an upcoming row, so it is in cache when its turn comes
+            if (i + prefetch_distance < end) {
+                int ahead = token_ids[i + prefetch_distance];
+                for (int k = 0; ahead >= 0 && ahead < vocab_size && k < per_token; ++k) {
+                    const int table_row = hash.row(ahead, k);
+                    const char* row = dequantize ? reinterpret_cast<const char*>(quantized.row_codes(table_row))
+                                                 : reinterpret_cast<const char*>(data + static_cast<size_t>(table_row) * embedding_dim);
+                    for (size_t line = 0; line < row_bytes; line += AlignedBuffer::alignment) __builtin_prefetch(row + line);
+                }
+            }
+            int token_id = token_ids[i];
+            if (!segments.empty() && segments[i] < 0) {
+                result.row(i).setZero(); // Padding
+            } else if (token_id >= 0 && token_id < vocab_size) {
+                for (int k = 0; k < per_token; ++k) {
+                    const int table_row = hash.row(token_id, k);
+                    if (dequantize) {
+                        quantized.dequantize_row(table_row, row_values.data());
+                        if (k == 0) result.row(i) = row_values;
+                        else result.row(i) += row_values;
+                    } else if (k == 0) {
+                        result.row(i) = table.row(table_row);
+                    } else {
+                        result.row(i) += table.row(table_row);
+                    }
+                }
+            } else {
+                result.row(i).setZero();
+                ++bad;
+            }
+        }
+        arena.release(mark);
+        if (bad > 0) invalid.fetch_add(bad, std::memory_order_relaxed);
+    };
+
+    if (count < parallel_tokens) {
+        gather(0, count);
+    } else {
+        ThreadPool::instance().parallel_for(0, count, gather_grain, gather);
+    }
+
+    if (invalid.load() > 0) {
+        Logger::get_instance().log(std::to_string(invalid.load()) + " invalid token IDs. Using zero vectors.",
+                                   LogLevel::WARNING);
+    }
+    if (Logger::get_instance().enabled(LogLevel::DEBUG)) {
+        Logger::get_instance().log("Embedding lookup completed for sequence of length: " +
+                                   std::to_string(token_ids.size()), LogLevel::DEBUG);
+    }
+}
 
+void EmbeddingLayer::backward(const std::vector<int>& token_ids, const std::vector<int>& segments,
+                              const Eigen::Ref<const Eigen::MatrixXd>& grad_output, double* grad_base) {
+    auto grad_embedding_matrix = store->grad_view<RowMajorMatrixXd>(tensor_id, grad_base);
     for (size_t i = 0; i < token_ids.size(); ++i) {
         int token_id = token_ids[i];
-        if (token_id >= 0 && token_id < vocab_size) {
-            result.row(i) = embedding_matrix.row(token_id);
-        } else {
-            result.row(i).setZero();
-            Logger::get_instance().log("Invalid token ID " + std::to_string(token_id) +
-                                       ". Using zero vector.", LogLevel::WARNING);
+        if (!segments.empty() && segments[i] < 0) continue;
+        if (token_id < 0 || token_id >= vocab_size) continue;
+        for (int k = 0; k < hash.rows_per_token(); ++k) {
+            grad_embedding_matrix.row(hash.row(token_id, k)) += grad_output.row(i);
         }
     }
+}
 
-    Logger::get_instance().log("Embedding lookup completed for sequence of length: " +
-                               std::to_string(token_ids.size()), LogLevel::DEBUG);
-
-    return result;
+void EmbeddingLayer::backward(const std::vector<int>& token_ids, const std::vector<int>& segments,
+                              const Eigen::Ref<const Eigen::MatrixXd>& grad_output, SparseRowGradient& gradient) {
+    if (gradient.slots.size() != static_cast<size_t>(table_rows()) || gradient.width != embedding_dim) {
+        gradient.reset(table_rows(), embedding_dim);
+    }
+    for (size_t i = 0; i < token_ids.size(); ++i) {
+        int token_id = token_ids[i];
+        if (!segments.empty() && segments[i] < 0) continue;
+        if (token_id < 0 || token_id >= vocab_size) continue;
+        for (int k = 0; k < hash.rows_per_token(); ++k) {
+            double* row = gradient.add_row(hash.row(token_id, k));
+            for (int j = 0; j < embedding_dim; ++j) row[j] += grad_output(i, j);
+        }
+    }
 }
@@ -1,62 +1,1357 @@
 #include "GPTModel.h"
+#include "Arena.h"
+#include "Gemm.h"
 #include "Logger.h"
+#include "BoundedQueue.h"
+#include "ThreadPool.h"
+#include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <limits>
 
-Eigen::MatrixXd softmax(const Eigen::MatrixXd& logits) {
-    const double epsilon = 1e-12; // Avoid division by zero
-    Eigen::VectorXd row_max = logits.rowwise().maxCoeff();
-    Eigen::MatrixXd stable_logits = logits.array().colwise() - row_max.array();
+namespace {
 
-    Eigen::MatrixXd exp_logits = stable_logits.array().exp();
-    Eigen::VectorXd row_sums = exp_logits.rowwise().sum().array().max(epsilon); // Clamp row sums
+// Row-wise softmax, in place
+void softmax(Eigen::Ref<Eigen::MatrixXd> logits) {
+    const double epsilon = 1e-12; // Avoid division by zero
 
-    Eigen::MatrixXd probabilities = exp_logits.array().colwise() / row_sums.array();
+    // Rows are independent; each chunk of rows is one task
+    ThreadPool::instance().parallel_for(0, logits.rows(), 16, [&](size_t begin, size_t end) {
+        const Eigen::Index rows = static_cast<Eigen::Index>(end - begin);
+        Arena& arena = Arena::local();
+        const Arena::Mark mark = arena.mark();
+        Eigen::Map<Eigen::VectorXd> row_max(arena.allocate(rows), rows);
+        Eigen::Map<Eigen::VectorXd> row_sums(arena.allocate(rows), rows);
+        auto block = logits.middleRows(begin, rows);
+        row_max = block.rowwise().maxCoeff();
+        block = (block.array().colwise() - row_max.array()).exp();
+        row_sums = block.rowwise().sum().array().max(epsilon); // Clamp row sums
+        block = block.array().colwise() / row_sums.array();
+        arena.release(mark);
+    });
 
-    Logger::get_instance().log("Softmax output min: " + std::to_string(probabilities.minCoeff()) +
-                               ", max: " + std::to_string(probabilities.maxCoeff()), LogLevel::DEBUG);
+    if (Logger::get_instance().enabled(LogLevel::DEBUG)) {
+        Logger::get_instance().log("Softmax output min: " + std::to_string(logits.minCoeff()) +
+                                   ", max: " + std::to_string(logits.maxCoeff()), LogLevel::DEBUG);
+    }
+}
 
-    return probabilities;
+// Reorder a rows x cols column-major tensor to row-major, in place
+void to_row_major(double* data, int rows, int cols) {
+    Eigen::MatrixXd column_major = Eigen::Map<const Eigen::MatrixXd>(data, rows, cols);
+    Eigen::Map<RowMajorMatrixXd>(data, rows, cols) = column_major;
 }
 
+} // namespace
 
 
-GPTModel::GPTModel(int vocab_size, int embedding_dim, int num_layers, int num_heads, int feedforward_dim, double learning_rate)
-    : embedding_layer(vocab_size, embedding_dim), learning_rate(learning_rate) {
+
+GPTModel::GPTModel(int vocab_size, int embedding_dim, int num_layers, int num_heads, int feedforward_dim,
+                   double learning_rate, bool tie_embeddings, const VocabularyHash& hash, PositionType position_type,
+                   int max_positions, const std::vector<int>& softmax_cutoffs, bool allocate)
+    : vocab_size(vocab_size), embedding_dim(embedding_dim), num_heads(num_heads), feedforward_dim(feedforward_dim),
+      tied_embeddings(tie_embeddings), embedding_layer(vocab_size, embedding_dim, store, "embedding.", hash),
+      output_weights(nullptr, 0, 0), output_bias(nullptr, 0), learning_rate(learning_rate), num_threads(1),
+      communicator(nullptr), pipeline_stages(1), micro_batches(1), sparse_embeddings(false),
+      positional(position_type, max_positions, embedding_dim,
+                 embedding_dim % num_heads == 0 ? embedding_dim / num_heads : embedding_dim),
+      position_embedding_id(0), position_embedding(nullptr, 0, 0), num_negatives(0), negative_tries(0) {
     Logger::get_instance().log("Initializing GPTModel", LogLevel::INFO);
+    // Registered next to the embedding matrix, so its gradient is dense and in the embedding's bucket
+    if (positional.get_type() == PositionType::LEARNED) {
+        position_embedding_id = store.add("position_embedding", max_positions, embedding_dim);
+    }
     for (int i = 0; i < num_layers; ++i) {
-        layers.emplace_back(TransformerBlock(embedding_dim, num_heads, feedforward_dim));
+        layers.emplace_back(embedding_dim, num_heads, feedforward_dim, store, "layers." + std::to_string(i) + ".");
+        if (positional.rotary()) layers.back().set_positional_encoding(&positional);
         Logger::get_instance().log("Added TransformerBlock " + std::to_string(i + 1), LogLevel::DEBUG);
     }
-    output_weights = Eigen::MatrixXd::Random(vocab_size, embedding_dim) * 0.01; // Small values
-    output_bias = Eigen::VectorXd::Zero(vocab_size);
-    Logger::get_instance().log("Output layer initialized", LogLevel::DEBUG);
+    bool valid_cutoffs = true;
+    for (size_t k = 0; k < softmax_cutoffs.size(); ++k) {
+        if (softmax_cutoffs[k] <= (k > 0 ? softmax_cutoffs[k - 1] : 0) || softmax_cutoffs[k] >= vocab_size) {
+            valid_cutoffs = false;
+        }
+    }
+    if (!softmax_cutoffs.empty() && (tie_embeddings || hash.hashed())) {
+        Logger::get_instance().log("The adaptive softmax is not combined with tied or hashed tables; "
+                                   "using the full output layer", LogLevel::WARNING);
+    } else if (!softmax_cutoffs.empty() && !valid_cutoffs) {
+        // Callers validate the cutoffs (the driver and load() do); never end the host process here
+        Logger::get_instance().log("Adaptive softmax cutoffs must increase strictly within (0, vocab_size); "
+                                   "using the full output layer", LogLevel::ERROR);
+    } else if (!softmax_cutoffs.empty()) {
+        adaptive_softmax = std::make_unique<AdaptiveSoftmax>(vocab_size, embedding_dim, softmax_cutoffs, store,
+                                                             "adaptive_softmax.");
+    }
+    // The adaptive softmax registers its own head and clusters instead
+    if (!adaptive_softmax) {
+        output_weights_id = tied_embeddings ? embedding_layer.get_tensor_id()
+                                            : store.add("output_weights", embedding_layer.table_rows(), embedding_dim);
+        output_bias_id = store.add("output_bias", vocab_size, 1);
+    }
+    if (allocate) store.allocate();
 }
 
-Eigen::MatrixXd GPTModel::forward(const std::string& input_text) {
-    Logger::get_instance().log("Starting forward pass", LogLevel::INFO);
-    auto tokens = tokenizer.tokenize(input_text);
-    Eigen::MatrixXd embeddings = embedding_layer.get_embeddings(tokens);
+GPTModel::GPTModel(int vocab_size, int embedding_dim, int num_layers, int num_heads, int feedforward_dim,
+                   double learning_rate, bool tie_embeddings, const VocabularyHash& hash, PositionType position_type,
+                   int max_positions, const std::vector<int>& softmax_cutoffs)
+    : GPTModel(vocab_size, embedding_dim, num_layers, num_heads, feedforward_dim, learning_rate, tie_embeddings, hash,
+               position_type, max_positions, softmax_cutoffs, true) {
+    // All shapes are registered and allocated; bind every view and draw initial values
+    embedding_layer.initialize();
+    for (auto& layer : layers) layer.initialize();
+    if (adaptive_softmax) {
+        adaptive_softmax->initialize();
+    } else {
+        store.bind(output_weights, output_weights_id);
+        store.bind(output_bias, output_bias_id);
+        if (!tied_embeddings) {
+            output_weights = Eigen::MatrixXd(Eigen::MatrixXd::Random(output_weights.rows(), embedding_dim) * 0.01); // Small values
+            if (hash.hashed()) output_weights /= std::sqrt(static_cast<double>(hash.get_num_hashes()));
+        }
+        output_bias.setZero();
+    }
+    if (positional.get_type() == PositionType::LEARNED) {
+        store.bind(position_embedding, position_embedding_id);
+        position_embedding = Eigen::MatrixXd(Eigen::MatrixXd::Random(position_embedding.rows(), embedding_dim) * 0.01);
+    }
+    Logger::get_instance().log(tied_embeddings ? "Output layer initialized with tied embedding weights"
+                                               : "Output layer initialized", LogLevel::DEBUG);
+
+    OptimizerOptions options;
+    options.learning_rate = learning_rate;
+    optimizer = std::make_unique<SGD>(parameters(), options);
+}
+
+void GPTModel::bind_views() {
+    embedding_layer.bind_views();
+    for (auto& layer : layers) layer.bind_views();
+    if (!adaptive_softmax) {
+        store.bind(output_weights, output_weights_id);
+        store.bind(output_bias, output_bias_id);
+    }
+    if (positional.get_type() == PositionType::LEARNED) store.bind(position_embedding, position_embedding_id);
+}
+
+void GPTModel::snapshot(CheckpointSnapshot& snapshot, bool stage) {
+    CheckpointHeader& header = snapshot.header;
+    std::memset(&header, 0, sizeof(header));
+    header.vocab_size = vocab_size;
+    header.embedding_dim = embedding_dim;
+    header.num_layers = static_cast<int32_t>(layers.size());
+    header.num_heads = num_heads;
+    header.feedforward_dim = feedforward_dim;
+    header.flags = CHECKPOINT_ROW_MAJOR_TABLES;
+    if (tied_embeddings) header.flags |= CHECKPOINT_TIED_EMBEDDINGS;
+    switch (positional.get_type()) {
+        case PositionType::SINUSOIDAL: header.flags |= CHECKPOINT_SINUSOIDAL_POSITIONS; break;
+        case PositionType::LEARNED: header.flags |= CHECKPOINT_LEARNED_POSITIONS; break;
+        case PositionType::ROTARY: header.flags |= CHECKPOINT_ROTARY_POSITIONS; break;
+        default: break;
+    }
+    if (adaptive_softmax) header.flags |= CHECKPOINT_ADAPTIVE_SOFTMAX;
+    header.num_hashes = embedding_layer.get_hash().get_num_hashes();
+    header.hash_buckets = embedding_layer.get_hash().get_buckets();
+    snapshot.segments.clear();
+    snapshot.tensors.clear();
+
+    // Segment 0: the whole parameter buffer, with each tensor at its store offset
+    const double* values = store.value_data();
+    if (stage) {
+        double* copy = snapshot.stage(0, store.size());
+        std::memcpy(copy, values, store.size() * sizeof(double));
+        values = copy;
+    }
+    snapshot.segments.push_back({values, store.size() * sizeof(double)});
+    for (const auto& tensor : store.get_tensors()) {
+        snapshot.tensors.push_back({tensor.name, CheckpointDType::FLOAT64, tensor.rows, tensor.cols, 0,
+                                    tensor.offset * sizeof(double), tensor.size() * sizeof(double)});
+    }
+
+    // One segment per optimizer state buffer
+    const std::string prefix = "optimizer." + optimizer->name() + ".";
+    std::vector<OptimizerState> state = optimizer->state();
+    for (size_t i = 0; i < state.size(); ++i) {
+        const double* data = state[i].data;
+        if (stage) {
+            double* copy = snapshot.stage(i + 1, state[i].size);
+            std::memcpy(copy, data, state[i].size * sizeof(double));
+            data = copy;
+        }
+        snapshot.segments.push_back({data, state[i].size * sizeof(double)});
+        snapshot.tensors.push_back({prefix + state[i].name, CheckpointDType::FLOAT64,
+                                    static_cast<int64_t>(state[i].size), 1, i + 1, 0, state[i].size * sizeof(double)});
+    }
+
+    // Quantized copies of the vocabulary tables: codes and scales, one segment each
+    for (size_t id : table_tensor_ids()) {
+        const QuantizedTable& table = quantized_table(id);
+        if (table.empty()) continue;
+        const void* parts[2] = {table.code_data(), table.scale_data()};
+        const size_t sizes[2] = {table.code_bytes(), table.scale_bytes()};
+        for (int part = 0; part < 2; ++part) {
+            if (stage) {
+                size_t index = snapshot.segments.size();
+                double* copy = snapshot.stage(index, (sizes[part] + sizeof(double) - 1) / sizeof(double));
+                std::memcpy(copy, parts[part], sizes[part]);
+                parts[part] = copy;
+            }
+            snapshot.segments.push_back({parts[part], sizes[part]});
+        }
+        const std::string& name = store.get_tensor(id).name;
+        const size_t segment = snapshot.segments.size() - 2;
+        snapshot.tensors.push_back({name + "." + QuantizedTable::name(table.get_type()),
+                                    table.get_type() == QuantizationType::INT8 ? CheckpointDType::INT8
+                                                                               : CheckpointDType::INT4,
+                                    table.get_rows(), table.get_cols(), segment, 0, sizes[0]});
+        snapshot.tensors.push_back({name + ".scales", CheckpointDType::FLOAT32, table.get_rows(), table.get_groups(),
+                                    segment + 1, 0, sizes[1]});
+    }
+
+    // Last segment: the vocabulary as NUL-terminated words in ID order, then the
+    // step count, the size of the position tables and the adaptive softmax cutoffs
+    snapshot.blob.clear();
+    std::vector<std::string> words = tokenizer.words();
+    for (const auto& word : words) {
+        snapshot.blob += word;
+        snapshot.blob.push_back('\0');
+    }
+    size_t vocab_bytes = snapshot.blob.size();
+    int64_t step_count = optimizer->get_step_count();
+    snapshot.blob.append(reinterpret_cast<const char*>(&step_count), sizeof(step_count));
+    int64_t max_positions = positional.get_max_positions();
+    snapshot.blob.append(reinterpret_cast<const char*>(&max_positions), sizeof(max_positions));
+    std::vector<int64_t> cutoffs;
+    if (adaptive_softmax) {
+        for (int cutoff : adaptive_softmax->get_cutoffs()) cutoffs.push_back(cutoff);
+        snapshot.blob.append(reinterpret_cast<const char*>(cutoffs.data()), cutoffs.size() * sizeof(int64_t));
+    }
+
+    size_t segment = snapshot.segments.size();
+    snapshot.segments.push_back({snapshot.blob.data(), snapshot.blob.size()});
+    snapshot.tensors.push_back({"tokenizer.vocab", CheckpointDType::BYTES, static_cast<int64_t>(words.size()), 1,
+                                segment, 0, vocab_bytes});
+    snapshot.tensors.push_back({prefix + "step_count", CheckpointDType::BYTES, 1, 1,
+                                segment, vocab_bytes, sizeof(step_count)});
+    snapshot.tensors.push_back({"model.max_positions", CheckpointDType::BYTES, 1, 1,
+                                segment, vocab_bytes + sizeof(step_count), sizeof(max_positions)});
+    if (adaptive_softmax) {
+        snapshot.tensors.push_back({"model.softmax_cutoffs", CheckpointDType::BYTES, static_cast<int64_t>(cutoffs.size()),
+                                    1, segment, vocab_bytes + sizeof(step_count) + sizeof(max_positions),
+                                    cutoffs.size() * sizeof(int64_t)});
+    }
+}
+
+bool GPTModel::save(const std::string& path) {
+    CheckpointSnapshot live;
+    snapshot(live, false);
+    return Checkpoint::write(path, live);
+}
+
+bool GPTModel::save_async(CheckpointWriter& writer, const std::string& path) {
+    CheckpointSnapshot* staging = writer.acquire();
+    if (!staging) {
+        Logger::get_instance().log("Previous checkpoint still being written; skipping " + path, LogLevel::WARNING);
+        return false;
+    }
+    snapshot(*staging, true);
+    writer.submit(path);
+    Logger::get_instance().log("Checkpoint staged for background write to " + path, LogLevel::INFO);
+    return true;
+}
+
+void GPTModel::restore_optimizer_state() {
+    const std::string prefix = "optimizer." + optimizer->name() + ".";
+    const CheckpointEntry* steps = checkpoint->find(prefix + "step_count");
+    if (!steps || steps->nbytes != sizeof(int64_t)) return;
+
+    std::vector<OptimizerState> state = optimizer->state();
+    std::vector<const CheckpointEntry*> entries;
+    for (const auto& buffer : state) {
+        const CheckpointEntry* entry = checkpoint->find(prefix + buffer.name);
+        if (!entry || entry->nbytes != buffer.size * sizeof(double)) {
+            Logger::get_instance().log("Saved " + optimizer->name() + " state does not match the optimizer; starting fresh",
+                                       LogLevel::WARNING);
+            return;
+        }
+        entries.push_back(entry);
+    }
+    const bool row_major = (checkpoint->header().flags & CHECKPOINT_ROW_MAJOR_TABLES) != 0;
+    for (size_t i = 0; i < state.size(); ++i) {
+        std::memcpy(state[i].data, checkpoint->data(*entries[i]), entries[i]->nbytes);
+        // State buffers share the store's layout, tables included
+        if (row_major) continue;
+        for (size_t id : table_tensor_ids()) {
+            const ParameterStore::Tensor& tensor = store.get_tensor(id);
+            to_row_major(state[i].data + tensor.offset, tensor.rows, tensor.cols);
+        }
+    }
+    int64_t step_count;
+    std::memcpy(&step_count, checkpoint->data(*steps), sizeof(step_count));
+    optimizer->set_step_count(static_cast<long>(step_count));
+    Logger::get_instance().log("Restored " + optimizer->name() + " state at step " + std::to_string(step_count),
+                               LogLevel::INFO);
+}
+
+std::unique_ptr<GPTModel> GPTModel::load(const std::string& path, double learning_rate) {
+    std::unique_ptr<MappedCheckpoint> mapped = MappedCheckpoint::open(path);
+    if (!mapped) return nullptr;
+    const CheckpointHeader& header = mapped->header();
+    if (header.vocab_size <= 0 || header.embedding_dim <= 0 || header.num_layers < 0 ||
+        header.num_heads <= 0 || header.feedforward_dim <= 0 || header.num_hashes < 0 || header.hash_buckets < 0) {
+        Logger::get_instance().log("Checkpoint " + path + " has an invalid model configuration", LogLevel::ERROR);
+        return nullptr;
+    }
+    const bool tied = (header.flags & CHECKPOINT_TIED_EMBEDDINGS) != 0;
+    PositionType position_type = PositionType::NONE;
+    if (header.flags & CHECKPOINT_SINUSOIDAL_POSITIONS) position_type = PositionType::SINUSOIDAL;
+    if (header.flags & CHECKPOINT_LEARNED_POSITIONS) position_type = PositionType::LEARNED;
+    if (header.flags & CHECKPOINT_ROTARY_POSITIONS) position_type = PositionType::ROTARY;
+    int64_t max_positions = 0;
+    if (position_type != PositionType::NONE) {
+        const CheckpointEntry* positions = mapped->find("model.max_positions");
+        if (positions && positions->nbytes == sizeof(max_positions)) {
+            std::memcpy(&max_positions, mapped->data(*positions), sizeof(max_positions));
+        }
+        if (max_positions <= 0 || max_positions > INT32_MAX) {
+            Logger::get_instance().log("Checkpoint " + path + " has no valid position table size", LogLevel::ERROR);
+            return nullptr;
+        }
+    }
+    std::vector<int> cutoffs;
+    if (header.flags & CHECKPOINT_ADAPTIVE_SOFTMAX) {
+        const CheckpointEntry* entry = mapped->find("model.softmax_cutoffs");
+        bool valid = entry && entry->rows > 0 && entry->nbytes == static_cast<uint64_t>(entry->rows) * sizeof(int64_t);
+        for (int64_t k = 0; valid && k < entry->rows; ++k) {
+            int64_t cutoff;
+            std::memcpy(&cutoff, mapped->data(*entry) + k * sizeof(int64_t), sizeof(cutoff));
+            valid = cutoff > (cutoffs.empty() ? 0 : cutoffs.back()) && cutoff < header.vocab_size;
+            cutoffs.push_back(static_cast<int>(cutoff));
+        }
+        if (!valid) {
+            Logger::get_instance().log("Checkpoint " + path + " has invalid adaptive softmax cutoffs", LogLevel::ERROR);
+            return nullptr;
+        }
+    }
+    std::unique_ptr<GPTModel> model(new GPTModel(header.vocab_size, header.embedding_dim, header.num_layers,
+                                                 header.num_heads, header.feedforward_dim, learning_rate, tied,
+                                                 VocabularyHash(header.num_hashes, header.hash_buckets), position_type,
+                                                 static_cast<int>(max_positions), cutoffs, false));
+    ParameterStore& store = model->store;
+
+    // Every tensor must be present with the right shape; the mapping can be used
+    // in place when each one also sits at the store's offset
+    std::vector<const CheckpointEntry*> entries;
+    bool in_place = true;
+    for (const auto& tensor : store.get_tensors()) {
+        const CheckpointEntry* entry = mapped->find(tensor.name);
+        if (!entry || entry->dtype != static_cast<uint32_t>(CheckpointDType::FLOAT64) ||
+            entry->rows != tensor.rows || entry->cols != tensor.cols || entry->nbytes != tensor.size() * sizeof(double)) {
+            Logger::get_instance().log("Checkpoint " + path + " is missing tensor " + tensor.name +
+                                       " or it has the wrong shape", LogLevel::ERROR);
+            return nullptr;
+        }
+        in_place = in_place && entry->offset == header.data_offset + tensor.offset * sizeof(double);
+        entries.push_back(entry);
+    }
+    in_place = in_place && header.data_offset + store.size() * sizeof(double) <= header.file_size;
+    // Older files hold the vocabulary tables column-major
+    const bool row_major = (header.flags & CHECKPOINT_ROW_MAJOR_TABLES) != 0;
+    in_place = in_place && row_major;
+
+    if (in_place) {
+        store.attach(reinterpret_cast<double*>(mapped->data_at(header.data_offset)));
+    } else {
+        Logger::get_instance().log("Checkpoint layout differs from the model; copying parameters", LogLevel::WARNING);
+        store.allocate();
+        for (size_t i = 0; i < entries.size(); ++i) {
+            std::memcpy(store.value_data() + store.get_tensor(i).offset, mapped->data(*entries[i]), entries[i]->nbytes);
+        }
+        if (!row_major) {
+            Logger::get_instance().log("Converting column-major vocabulary tables of an older checkpoint",
+                                       LogLevel::INFO);
+            for (size_t id : model->table_tensor_ids()) {
+                const ParameterStore::Tensor& tensor = store.get_tensor(id);
+                to_row_major(store.value_data() + tensor.offset, tensor.rows, tensor.cols);
+            }
+        }
+    }
+    model->bind_views();
+
+    // Quantized tables are used straight from the mapping
+    for (size_t id : model->table_tensor_ids()) {
+        const ParameterStore::Tensor& tensor = store.get_tensor(id);
+        const CheckpointEntry* scales = mapped->find(tensor.name + ".scales");
+        if (!scales) continue;
+        for (QuantizationType type : {QuantizationType::INT8, QuantizationType::INT4}) {
+            const CheckpointEntry* codes = mapped->find(tensor.name + "." + QuantizedTable::name(type));
+            if (!codes) continue;
+            QuantizedTable& table = model->quantized_table(id);
+            bool valid = row_major && codes->rows == tensor.rows && codes->cols == tensor.cols &&
+                         scales->dtype == static_cast<uint32_t>(CheckpointDType::FLOAT32) && scales->rows == tensor.rows &&
+                         table.attach(type, tensor.rows, tensor.cols, static_cast<int>(scales->cols),
+                                      reinterpret_cast<const uint8_t*>(mapped->data(*codes)),
+                                      reinterpret_cast<const float*>(mapped->data(*scales))) &&
+                         codes->nbytes == table.code_bytes() && scales->nbytes == table.scale_bytes();
+            if (!valid) {
+                table.clear();
+                Logger::get_instance().log("Ignoring malformed quantized copy of " + tensor.name, LogLevel::WARNING);
+            }
+        }
+    }
+    if (model->is_quantized()) {
+        Logger::get_instance().log(std::string("Serving vocabulary tables from ") +
+                                   QuantizedTable::name(model->embedding_layer.get_quantized().get_type()) +
+                                   " copies in the checkpoint", LogLevel::INFO);
+    }
+
+    const CheckpointEntry* vocab_entry = mapped->find("tokenizer.vocab");
+    if (vocab_entry) {
+        std::vector<std::string> words;
+        const char* begin = mapped->data(*vocab_entry);
+        const char* end = begin + vocab_entry->nbytes;
+        while (begin < end) {
+            const char* word_end = static_cast<const char*>(std::memchr(begin, '\0', end - begin));
+            if (!word_end) word_end = end;
+            words.emplace_back(begin, word_end);
+            begin = word_end + 1;
+        }
+        model->tokenizer.set_vocab(words);
+    } else {
+        Logger::get_instance().log("Checkpoint " + path + " has no vocabulary", LogLevel::WARNING);
+    }
+
+    model->checkpoint = std::move(mapped);
+    OptimizerOptions options;
+    options.learning_rate = learning_rate;
+    model->set_optimizer(std::make_unique<SGD>(model->parameters(), options));
+    Logger::get_instance().log("Loaded GPTModel from " + path, LogLevel::INFO);
+    return model;
+}
+
+std::vector<size_t> GPTModel::table_tensor_ids() const {
+    std::vector<size_t> ids = {embedding_layer.get_tensor_id()};
+    if (!tied_embeddings && !adaptive_softmax) ids.push_back(output_weights_id);
+    return ids;
+}
+
+QuantizedTable& GPTModel::quantized_table(size_t id) {
+    return id == embedding_layer.get_tensor_id() ? embedding_layer.get_quantized() : quantized_output;
+}
+
+const QuantizedTable& GPTModel::output_table() const {
+    return tied_embeddings ? embedding_layer.get_quantized() : quantized_output;
+}
+
+void GPTModel::replicate_weights() {
+    std::vector<size_t> ids;
+    for (size_t id : table_tensor_ids()) {
+        if (quantized_table(id).empty()) ids.push_back(id);
+    }
+    store.replicate(ids);
+}
+
+void GPTModel::quantize(QuantizationType type, int group_size) {
+    embedding_layer.quantize(type, group_size);
+    if (tied_embeddings || adaptive_softmax || type == QuantizationType::NONE) {
+        quantized_output.clear();
+    } else {
+        quantized_output.quantize(output_weights.data(), output_weights.rows(), embedding_dim, type, group_size);
+    }
+    if (type == QuantizationType::NONE) return;
+
+    size_t quantized_bytes = 0;
+    size_t double_bytes = 0;
+    for (size_t id : table_tensor_ids()) {
+        const QuantizedTable& table = quantized_table(id);
+        quantized_bytes += table.code_bytes() + table.scale_bytes();
+        double_bytes += store.get_tensor(id).size() * sizeof(double);
+    }
+    Logger::get_instance().log(std::string("Quantized vocabulary tables to ") + QuantizedTable::name(type) + " (" +
+                               std::to_string(embedding_layer.get_quantized().get_group_size()) +
+                               " values per scale): " + std::to_string(quantized_bytes) + " bytes instead of " +
+                               std::to_string(double_bytes), LogLevel::INFO);
+}
+
+void GPTModel::drop_quantized() {
+    if (!is_quantized()) return;
+    quantize(QuantizationType::NONE);
+    Logger::get_instance().log("Dropped quantized vocabulary tables before training", LogLevel::INFO);
+}
+
+std::vector<Parameter> GPTModel::parameters() {
+    return store.parameters();
+}
+
+std::vector<GradientBucket> GPTModel::gradient_buckets() const {
+    // Tensors were registered as embedding, blocks in order, output layer. Tied
+    // output weights are part of the embedding bucket, which is posted last.
+    std::vector<size_t> starts = {0};
+    for (const auto& layer : layers) starts.push_back(store.get_tensor(layer.first_tensor_id()).offset);
+    size_t output_id = tied_embeddings ? output_bias_id : output_weights_id;
+    if (adaptive_softmax) output_id = adaptive_softmax->first_tensor_id();
+    starts.push_back(store.get_tensor(output_id).offset);
+    starts.push_back(store.size());
+
+    std::vector<GradientBucket> buckets;
+    for (size_t i = starts.size() - 1; i-- > 0;) buckets.push_back({starts[i], starts[i + 1]});
+    return buckets;
+}
+
+void GPTModel::set_communicator(ShmCommunicator* comm) {
+    communicator = comm;
+    if (!communicator) return;
+    if (sparse_embeddings) {
+        Logger::get_instance().log("Sparse embedding gradients are not averaged across processes; using dense ones",
+                                   LogLevel::WARNING);
+        set_sparse_embeddings(false);
+    }
+    communicator->broadcast(store.value_data(), store.size());
+    Logger::get_instance().log("Parameters synchronized from rank 0", LogLevel::INFO);
+}
+
+void GPTModel::skip_batch() {
+    if (!communicator) return;
+    Logger::get_instance().log("No local batch; joining the step with zero gradients", LogLevel::DEBUG);
+    drop_quantized();
+    apply_gradients(false);
+}
+
+void GPTModel::set_pipeline(int stages, int micro_batches) {
+    pipeline_stages = std::max(1, stages);
+    this->micro_batches = std::max(1, micro_batches);
+    // Stage 0 runs on the caller; the threads and their arenas are kept for every pass
+    const int used_stages = std::min<int>(pipeline_stages, static_cast<int>(layers.size()));
+    stage_threads = used_stages > 1 ? std::make_unique<StageThreads>(used_stages - 1) : nullptr;
+    stage_activations.clear();
+    stage_gradients.clear();
+    for (int s = 0; s + 1 < used_stages; ++s) {
+        stage_activations.push_back(std::make_unique<BoundedQueue<StageMessage>>(this->micro_batches));
+        stage_gradients.push_back(std::make_unique<BoundedQueue<StageMessage>>(this->micro_batches));
+    }
+    stage_states.assign(used_stages > 1 ? used_stages : 0, PipelineStage());
+    for (auto& state : stage_states) {
+        state.caches.resize(this->micro_batches);
+        state.output_inputs.resize(this->micro_batches, Eigen::Map<Eigen::MatrixXd>(nullptr, 0, 0));
+        state.output_grads.resize(this->micro_batches, Eigen::Map<Eigen::MatrixXd>(nullptr, 0, 0));
+    }
+    pipeline_slices.resize(this->micro_batches);
+    pipeline_losses.assign(this->micro_batches, 0.0);
+    Logger::get_instance().log("Pipeline with " + std::to_string(pipeline_stages) + " stages and " +
+                               std::to_string(this->micro_batches) + " micro-batches", LogLevel::INFO);
+}
+
+void GPTModel::set_tensor_parallel(int parts) {
+    for (auto& layer : layers) layer.set_tensor_parallel(parts);
+    Logger::get_instance().log("Tensor-parallel blocks split " + std::to_string(std::max(parts, 1)) + " ways",
+                               LogLevel::INFO);
+}
+
+void GPTModel::set_activation_checkpointing(int every) {
+    int count = 0;
+    for (size_t l = 0; l < layers.size(); ++l) {
+        layers[l].set_recompute(every > 0 && l % every == 0);
+        count += layers[l].get_recompute();
+    }
+    Logger::get_instance().log("Activation checkpointing on " + std::to_string(count) + " of " +
+                               std::to_string(layers.size()) + " blocks", LogLevel::INFO);
+}
+
+void GPTModel::set_activation_checkpointing(size_t layer, bool enabled) {
+    if (layer >= layers.size()) {
+        Logger::get_instance().log("No block " + std::to_string(layer) + " to checkpoint", LogLevel::WARNING);
+        return;
+    }
+    layers[layer].set_recompute(enabled);
+}
+
+void GPTModel::set_sparse_embeddings(bool enabled) {
+    if (enabled && (tied_embeddings || communicator)) {
+        Logger::get_instance().log(std::string("Sparse embedding gradients need untied embeddings and a single process; ") +
+                                   "keeping them dense", LogLevel::WARNING);
+        enabled = false;
+    }
+    if (enabled == sparse_embeddings) return;
+    sparse_embeddings = enabled;
+    if (embedding_gradients.empty()) embedding_gradients.resize(1);
+    for (auto& gradient : embedding_gradients) gradient.reset(embedding_layer.table_rows(), embedding_dim);
+    optimizer->set_sparse(embedding_layer.get_tensor_id(), enabled ? &embedding_gradients[0] : nullptr,
+                          embedding_layer.row_step(), embedding_layer.element_step());
+}
+
+void GPTModel::set_sampled_softmax(int negatives, SamplerType sampler_type, const std::vector<long>& counts) {
+    if (negatives > 0 && (adaptive_softmax || embedding_layer.get_hash().hashed())) {
+        Logger::get_instance().log("Sampled softmax needs a plain output layer; training with the full softmax",
+                                   LogLevel::WARNING);
+        negatives = 0;
+    }
+    if (negatives >= vocab_size) {
+        Logger::get_instance().log("Sampled softmax needs fewer negatives than tokens; training with the full softmax",
+                                   LogLevel::WARNING);
+        negatives = 0;
+    }
+    num_negatives = std::max(0, negatives);
+    sampler = num_negatives > 0 ? CandidateSampler(sampler_type, vocab_size, counts) : CandidateSampler();
+    this->negatives.clear();
+    if (num_negatives > 0) {
+        Logger::get_instance().log("Sampled softmax training with " + std::to_string(num_negatives) + " " +
+                                   CandidateSampler::name(sampler_type) + " negatives per step", LogLevel::INFO);
+    }
+}
+
+void GPTModel::draw_negatives() {
+    if (sampler.empty()) return;
+    negative_tries = sampler.sample_unique(num_negatives, negatives);
+}
+
+size_t GPTModel::dense_gradient_begin() const {
+    if (!sparse_embeddings) return 0;
+    // The embedding matrix is registered first
+    const ParameterStore::Tensor& table = store.get_tensor(embedding_layer.get_tensor_id());
+    return table.offset + AlignedBuffer::padded(table.size());
+}
+
+void GPTModel::set_num_threads(int threads) {
+    num_threads = std::max(1, threads);
+    Logger::get_instance().log("Data-parallel training with " + std::to_string(num_threads) + " slices", LogLevel::INFO);
+}
+
+void GPTModel::set_numa(int node) {
+    ThreadPool::set_numa(true, node);
+    store.place(node);
+}
+
+void GPTModel::set_optimizer(std::unique_ptr<Optimizer> new_optimizer) {
+    optimizer = std::move(new_optimizer);
+    Logger::get_instance().log("Using optimizer: " + optimizer->name(), LogLevel::INFO);
+    if (sparse_embeddings) {
+        optimizer->set_sparse(embedding_layer.get_tensor_id(), &embedding_gradients[0], embedding_layer.row_step(),
+                              embedding_layer.element_step());
+    }
+    if (checkpoint) restore_optimizer_state();
+}
+
+MemoryPlan GPTModel::plan_memory(int batch_size, int seq_len, bool training) {
+    MemoryPlan plan;
+    plan.description = std::to_string(batch_size) + " x " + std::to_string(seq_len) + " tokens, " +
+                       (training ? "training" : "inference");
+    const size_t rows = static_cast<size_t>(batch_size) * seq_len;
+    const size_t width = embedding_dim;
+    const size_t num_layers = layers.size();
+    const Eigen::Index n = static_cast<Eigen::Index>(rows);
+    ThreadPool& pool = ThreadPool::instance();
+
+    // Schedule: embedding, blocks, output layer, then (training) backward in
+    // reverse, with a recompute step before each checkpointed block's backward
+    const int embedding_step = plan.step("embedding");
+    std::vector<int> forward_steps(num_layers), recompute_steps(num_layers), backward_steps(num_layers);
+    for (size_t l = 0; l < num_layers; ++l) forward_steps[l] = plan.step("block " + std::to_string(l) + " forward");
+    const int output_step = plan.step("output layer");
+    if (training) {
+        plan.step("output layer backward");
+        for (size_t l = num_layers; l-- > 0;) {
+            const std::string block = "block " + std::to_string(l);
+            recompute_steps[l] = layers[l].get_recompute() ? plan.step(block + " recompute") : -1;
+            backward_steps[l] = plan.step(block + " backward");
+        }
+        plan.step("embedding backward");
+    }
+    const int output_backward_step = output_step + 1;
+
+    // Lifetimes are the arena's: what a step allocates outside a mark/release
+    // pair stays until the step ends, scratch only for its schedule step
+    const int end_step = static_cast<int>(plan.steps.size()) - 1;
+
+    // A block's Cache activations, its output and the scratch of computing them
+    auto add_forward = [&](size_t l, const std::string& prefix, int step, int last, bool keep_input) {
+        const TransformerBlock& layer = layers[l];
+        if (keep_input) plan.add(prefix + "input", rows * width, step, last);
+        plan.add(prefix + "Q", rows * width, step, last);
+        plan.add(prefix + "K", rows * width, step, last);
+        plan.add(prefix + "V", rows * width, step, last);
+        plan.add(prefix + "attention weights", rows * layer.get_num_heads() * seq_len, step, last);
+        plan.add(prefix + "attention output", rows * width, step, last);
+        plan.add(prefix + "residual", rows * width, step, last);
+        plan.add(prefix + "FFN hidden", rows * feedforward_dim, step, last);
+        plan.add(prefix + "output", layer.forward_output_size(batch_size, seq_len), step, last);
+        plan.add(prefix + "forward scratch", layer.forward_scratch_size(batch_size, seq_len), step, step);
+    };
+
+    // Forward: cached blocks keep their activations to the end of the step;
+    // checkpointed blocks (and every block in inference) keep their output only
+    plan.add("embeddings", rows * width, embedding_step, end_step);
+    for (size_t l = 0; l < num_layers; ++l) {
+        const std::string prefix = "block " + std::to_string(l) + " ";
+        const int step = forward_steps[l];
+        if (training && !layers[l].get_recompute()) {
+            add_forward(l, prefix, step, end_step, true);
+            continue;
+        }
+        if (training) plan.add(prefix + "input", rows * width, step, end_step);
+        plan.add(prefix + "output", rows * width, step, end_step);
+        add_forward(l, prefix + "scratch ", step, step, false);
+    }
+
+    // Output layer: the loss, or the predictions, whose probabilities the
+    // loss gradient replaces in place
+    const Eigen::Index table_rows = output_weights.rows();
+    if (adaptive_softmax) {
+        if (training) {
+            plan.add("output layer gradient", rows * width, output_step, end_step);
+            plan.add("adaptive softmax scratch", adaptive_softmax->loss_scratch_size(rows), output_step, output_step);
+        } else {
+            plan.add("probabilities", rows * vocab_size, output_step, end_step);
+            plan.add("adaptive softmax scratch", adaptive_softmax->predict_scratch_size(rows), output_step, output_step);
+        }
+    } else if (!sampler.empty() && training) {
+        // Gathered negatives' rows and biases, targets' and negatives' logits, row losses
+        const Eigen::Index sampled = num_negatives;
+        plan.add("output layer gradient", rows * width, output_step, end_step);
+        plan.add("sampled softmax scratch",
+                 AlignedBuffer::padded(sampled * width) + AlignedBuffer::padded(sampled) +
+                     AlignedBuffer::padded(rows * (sampled + 1)) + AlignedBuffer::padded(rows) +
+                     std::max({gemm_scratch_size(n, sampled, width), gemm_scratch_size(n, width, sampled),
+                               gemm_scratch_size(sampled, width, n)}),
+                 output_step, output_step);
+    } else {
+        plan.add("logits", rows * vocab_size, output_step, end_step);
+        // Products with every table row (hashed tables), then each tile's GEMM,
+        // dequantized rows when the table is quantized; the softmax's row scratch after them
+        const size_t tile = pool.max_chunk(table_rows, 256);
+        const bool quantized = !training && !output_table().empty();
+        size_t tiles = 0;
+        for (size_t tile_width : {tile, static_cast<size_t>(table_rows) % tile}) {
+            const Eigen::Index columns = static_cast<Eigen::Index>(tile_width);
+            tiles = std::max(tiles, gemm_scratch_size(n, columns, width) +
+                                        (quantized ? AlignedBuffer::padded(tile_width * width) : 0));
+        }
+        const size_t products = embedding_layer.get_hash().hashed() ? AlignedBuffer::padded(rows * table_rows) : 0;
+        plan.add("output layer scratch", std::max(products + tiles, 2 * AlignedBuffer::padded(pool.max_chunk(rows, 16))),
+                 output_step, output_step);
+    }
+
+    if (training) {
+        // Input gradients alternate between two buffers for the whole backward pass
+        plan.add("hidden gradient", rows * width, output_backward_step, end_step);
+        plan.add("next hidden gradient", rows * width, output_backward_step, end_step);
+        if (!output_loss_gives_hidden_gradient()) {
+            // Logit gradients summed per hashed table row, and the two products with them
+            const size_t summed = embedding_layer.get_hash().hashed() ? AlignedBuffer::padded(rows * table_rows) : 0;
+            plan.add("output layer backward scratch",
+                     summed + std::max(gemm_scratch_size(table_rows, width, n), gemm_scratch_size(n, width, table_rows)),
+                     output_backward_step, output_backward_step);
+        }
+        for (size_t l = num_layers; l-- > 0;) {
+            const std::string prefix = "block " + std::to_string(l) + " ";
+            const int step = backward_steps[l];
+            if (recompute_steps[l] >= 0) add_forward(l, prefix + "recomputed ", recompute_steps[l], step, false);
+            plan.add(prefix + "FFN hidden gradient", rows * feedforward_dim, step, step);
+            plan.add(prefix + "residual gradient", rows * width, step, step);
+            plan.add(prefix + "attention gradient", rows * width, step, step);
+            plan.add(prefix + "Q gradient", rows * width, step, step);
+            plan.add(prefix + "K gradient", rows * width, step, step);
+            plan.add(prefix + "V gradient", rows * width, step, step);
+            plan.add(prefix + "backward scratch", layers[l].backward_scratch_size(batch_size, seq_len), step, step);
+        }
+    }
+
+    // Parameters, plus gradients, optimizer state and data-parallel gradient buffers when training
+    plan.persistent_size = store.size();
+    if (training) {
+        plan.persistent_size += store.size() * std::max(1, num_threads);
+        for (const auto& state : optimizer->state()) plan.persistent_size += state.size;
+    }
+    MemoryPlanner::plan(plan);
+    return plan;
+}
+
+Eigen::Map<Eigen::MatrixXd> GPTModel::hidden_states(const std::vector<int>& tokens, int batch_size, int seq_len,
+                                                    const std::vector<int>& segments,
+                                                    std::vector<TransformerBlock::Cache>* caches) {
+    Eigen::Map<Eigen::MatrixXd> hidden = Arena::local().matrix(tokens.size(), embedding_dim);
+    embedding_layer.get_embeddings(tokens, segments, hidden);
+    add_positions(segments, seq_len, hidden);
+    if (caches) caches->resize(layers.size());
     for (size_t i = 0; i < layers.size(); ++i) {
-        embeddings = layers[i].forward(embeddings);
-        Logger::get_instance().log("Passed through TransformerBlock " + std::to_string(i + 1), LogLevel::DEBUG);
+        Arena::rebind(hidden, layers[i].forward(hidden, batch_size, seq_len, segments, caches ? &(*caches)[i] : nullptr));
+        if (Logger::get_instance().enabled(LogLevel::DEBUG)) {
+            Logger::get_instance().log("Passed through TransformerBlock " + std::to_string(i + 1), LogLevel::DEBUG);
+        }
+    }
+    return hidden;
+}
+
+void GPTModel::add_positions(const std::vector<int>& segments, int seq_len, Eigen::Ref<Eigen::MatrixXd> hidden) const {
+    if (positional.get_type() == PositionType::LEARNED) {
+        positional.add(position_embedding, segments, seq_len, hidden);
+    } else if (positional.additive()) {
+        positional.add(positional.get_table(), segments, seq_len, hidden);
+    }
+}
+
+Eigen::Map<Eigen::MatrixXd> GPTModel::predict(const Eigen::Ref<const Eigen::MatrixXd>& hidden) {
+    if (adaptive_softmax) {
+        Eigen::Map<Eigen::MatrixXd> probabilities = Arena::local().matrix(hidden.rows(), vocab_size);
+        adaptive_softmax->predict(hidden, probabilities);
+        return probabilities;
     }
-    Eigen::MatrixXd logits = (embeddings * output_weights.transpose()).rowwise() + output_bias.transpose();
+    Eigen::Map<Eigen::MatrixXd> logits = output_logits(hidden);
+    softmax(logits);
+    return logits;
+}
+
+Eigen::Map<Eigen::MatrixXd> GPTModel::output_logits(const Eigen::Ref<const Eigen::MatrixXd>& hidden) {
+    // Tiles of table rows are independent GEMMs against slices of the output weights
+    const size_t tile = 256;
+    const VocabularyHash& hash = embedding_layer.get_hash();
+    Arena& arena = Arena::local();
+    Eigen::Map<Eigen::MatrixXd> logits = arena.matrix(hidden.rows(), vocab_size);
+    // Hashed tables: products with every table row, summed per token below
+    Arena::Mark mark = arena.mark();
+    Eigen::Map<Eigen::MatrixXd> products = hash.hashed() ? arena.matrix(hidden.rows(), output_weights.rows()) : logits;
+    const QuantizedTable& quantized = output_table();
+    ThreadPool::instance().parallel_for(0, output_weights.rows(), tile, [&](size_t begin, size_t end) {
+        const Eigen::Index width = static_cast<Eigen::Index>(end - begin);
+        if (!quantized.empty()) {
+            quantized.multiply(hidden, static_cast<int>(begin), static_cast<int>(width), products.middleCols(begin, width));
+        } else {
+            auto weights = store.replica_view<RowMajorMatrixXd>(output_weights_id, ThreadPool::current_node());
+            gemm(products.middleCols(begin, width), hidden, weights.middleRows(begin, width).transpose());
+        }
+        if (!hash.hashed()) logits.middleCols(begin, width).rowwise() += output_bias.segment(begin, width).transpose();
+    });
+    if (hash.hashed()) {
+        ThreadPool::instance().parallel_for(0, vocab_size, tile, [&](size_t begin, size_t end) {
+            for (size_t t = begin; t < end; ++t) {
+                const int token = static_cast<int>(t);
+                logits.col(t) = products.col(hash.row(token, 0));
+                for (int k = 1; k < hash.get_num_hashes(); ++k) logits.col(t) += products.col(hash.row(token, k));
+            }
+            const Eigen::Index width = static_cast<Eigen::Index>(end - begin);
+            logits.middleCols(begin, width).rowwise() += output_bias.segment(begin, width).transpose();
+        });
+    }
+    arena.release(mark);
     Logger::get_instance().log("Computed logits", LogLevel::DEBUG);
-    return softmax(logits);
+    return logits;
+}
+
+double GPTModel::output_loss(const Eigen::Ref<const Eigen::MatrixXd>& hidden, const std::vector<int>& targets,
+                             double scale, double* grad_base, Eigen::Map<Eigen::MatrixXd>& gradients) {
+    if (adaptive_softmax) {
+        Arena::rebind(gradients, Arena::local().matrix(hidden.rows(), embedding_dim));
+        return adaptive_softmax->loss(hidden, targets, scale, grad_base, gradients);
+    }
+    if (!sampler.empty()) {
+        Arena::rebind(gradients, Arena::local().matrix(hidden.rows(), embedding_dim));
+        return sampled_loss(hidden, targets, scale, store.grad_view<RowMajorMatrixXd>(output_weights_id, grad_base),
+                            store.grad_view(output_bias_id, grad_base), gradients);
+    }
+    // The loss gradient replaces the probabilities
+    Arena::rebind(gradients, predict(hidden));
+    double loss = Loss::cross_entropy(gradients, targets) * scale;
+    Loss::cross_entropy_gradient(gradients, targets, gradients, scale);
+    return loss;
+}
+
+double GPTModel::sampled_loss(const Eigen::Ref<const Eigen::MatrixXd>& hidden, const std::vector<int>& targets,
+                              double scale, Eigen::Ref<RowMajorMatrixXd> weight_grad,
+                              Eigen::Ref<Eigen::MatrixXd> bias_grad, Eigen::Ref<Eigen::MatrixXd> grad_hidden) {
+    const double epsilon = 1e-12; // Avoid log(0)
+    const Eigen::Index rows = hidden.rows();
+    const Eigen::Index sampled = static_cast<Eigen::Index>(negatives.size());
+    int count = 0;
+    for (int id : targets) count += id >= 0;
+    const double weight = scale / std::max(count, 1);
+
+    // The negatives' rows, gathered once for the whole step, and their corrected biases
+    Arena& arena = Arena::local();
+    Arena::Mark mark = arena.mark();
+    Eigen::Map<Eigen::MatrixXd> sampled_weights = arena.matrix(sampled, embedding_dim);
+    Eigen::Map<Eigen::VectorXd> sampled_bias(arena.allocate(sampled), sampled);
+    for (Eigen::Index j = 0; j < sampled; ++j) {
+        sampled_weights.row(j) = output_weights.row(negatives[j]);
+        sampled_bias[j] = output_bias[negatives[j]] - std::log(sampler.expected_count(negatives[j], negative_tries));
+    }
+
+    // Column 0 holds each row's target, the others the shared negatives;
+    // probabilities are replaced in place by the loss gradient
+    Eigen::Map<Eigen::MatrixXd> logits = arena.matrix(rows, sampled + 1);
+    gemm(logits.rightCols(sampled), hidden, sampled_weights.transpose());
+    logits.rightCols(sampled).rowwise() += sampled_bias.transpose();
+    Eigen::Map<Eigen::VectorXd> row_losses(arena.allocate(rows), rows);
+    ThreadPool::instance().parallel_for(0, rows, 16, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            const int target = targets[i];
+            auto row = logits.row(i);
+            if (target < 0) {
+                row.setZero();
+                row_losses[i] = 0.0;
+                continue;
+            }
+            row(0) = hidden.row(i).dot(output_weights.row(target)) + output_bias[target] -
+                     std::log(sampler.expected_count(target, negative_tries));
+            for (Eigen::Index j = 0; j < sampled; ++j) {
+                if (negatives[j] == target) row(j + 1) = -std::numeric_limits<double>::infinity();
+            }
+            row = (row.array() - row.maxCoeff()).exp();
+            row /= row.sum();
+            row_losses[i] = -std::log(std::max(row(0), epsilon));
+            row *= weight;
+            row(0) -= weight;
+        }
+    });
+
+    // Negatives: dense products; targets: one row each
+    gemm(grad_hidden, logits.rightCols(sampled), sampled_weights);
+    // The gathered rows are done with; their buffer takes the rows' gradients
+    gemm(sampled_weights, logits.rightCols(sampled).transpose(), hidden);
+    for (Eigen::Index j = 0; j < sampled; ++j) {
+        weight_grad.row(negatives[j]) += sampled_weights.row(j);
+        bias_grad(negatives[j], 0) += logits.col(j + 1).sum();
+    }
+    for (Eigen::Index i = 0; i < rows; ++i) {
+        if (targets[i] < 0) continue;
+        grad_hidden.row(i) += logits(i, 0) * output_weights.row(targets[i]);
+        weight_grad.row(targets[i]) += logits(i, 0) * hidden.row(i);
+        bias_grad(targets[i], 0) += logits(i, 0);
+    }
+    double loss = count > 0 ? row_losses.sum() / count : 0.0;
+    arena.release(mark);
+    return loss * scale;
+}
+
+void GPTModel::output_backward(const Eigen::Ref<const Eigen::MatrixXd>& gradients,
+                               const Eigen::Ref<const Eigen::MatrixXd>& hidden, Eigen::Ref<RowMajorMatrixXd> weight_grad,
+                               Eigen::Ref<Eigen::MatrixXd> bias_grad, Eigen::Ref<Eigen::MatrixXd> grad_hidden) {
+    bias_grad += gradients.colwise().sum().transpose();
+    const VocabularyHash& hash = embedding_layer.get_hash();
+    if (!hash.hashed()) {
+        gemm_add(weight_grad, gradients.transpose(), hidden);
+        gemm(grad_hidden, gradients, output_weights);
+        return;
+    }
+
+    // A table row's logit gradient is the sum over the tokens hashed to it.
+    // Each hash fills its own block of rows, so blocks are independent tasks.
+    Arena& arena = Arena::local();
+    Arena::Mark mark = arena.mark();
+    Eigen::Map<Eigen::MatrixXd> row_gradients = arena.matrix(gradients.rows(), output_weights.rows());
+    row_gradients.setZero();
+    ThreadPool::instance().parallel_for(0, hash.get_num_hashes(), 1, [&](size_t begin, size_t end) {
+        for (size_t k = begin; k < end; ++k) {
+            for (int t = 0; t < vocab_size; ++t) row_gradients.col(hash.row(t, static_cast<int>(k))) += gradients.col(t);
+        }
+    });
+    gemm_add(weight_grad, row_gradients.transpose(), hidden);
+    gemm(grad_hidden, row_gradients, output_weights);
+    arena.release(mark);
+}
+
+void GPTModel::backward(const std::vector<int>& tokens, const std::vector<int>& segments, int seq_len,
+                        const Eigen::Ref<const Eigen::MatrixXd>& hidden,
+                        const std::vector<TransformerBlock::Cache>& caches,
+                        const Eigen::Ref<const Eigen::MatrixXd>& gradients, double* grad_base, ShmCommunicator* comm,
+                        int worker) {
+    double* grad = grad_base ? grad_base : store.grad_data();
+    size_t bucket = 0;
+    Arena& arena = Arena::local();
+    Eigen::Map<Eigen::MatrixXd> grad_hidden = arena.matrix(gradients.rows(), embedding_dim);
+    Eigen::Map<Eigen::MatrixXd> grad_next = arena.matrix(gradients.rows(), embedding_dim);
+    if (output_loss_gives_hidden_gradient()) {
+        grad_hidden = gradients;
+    } else {
+        output_backward(gradients, hidden, store.grad_view<RowMajorMatrixXd>(output_weights_id, grad_base),
+                        store.grad_view(output_bias_id, grad_base), grad_hidden);
+    }
+    if (comm) comm->post(bucket++, grad);
+
+    // Input gradients alternate between two buffers, and each block's scratch
+    // is released when it returns, so the blocks share one set of scratch
+    for (size_t i = layers.size(); i-- > 0;) {
+        layers[i].backward(caches[i], grad_hidden, grad_next, grad_base);
+        Eigen::Map<Eigen::MatrixXd> done(grad_hidden);
+        Arena::rebind(grad_hidden, grad_next);
+        Arena::rebind(grad_next, done);
+        if (comm) comm->post(bucket++, grad);
+    }
+    if (positional.get_type() == PositionType::LEARNED) {
+        positional.accumulate(grad_hidden, segments, seq_len,
+                              store.grad_view<RowMajorMatrixXd>(position_embedding_id, grad_base));
+    }
+    if (sparse_embeddings) {
+        embedding_layer.backward(tokens, segments, grad_hidden, embedding_gradients[worker]);
+    } else {
+        embedding_layer.backward(tokens, segments, grad_hidden, grad_base);
+    }
+    if (comm) comm->post(bucket++, grad);
+    Logger::get_instance().log("Computed gradients for all parameters", LogLevel::DEBUG);
+}
+
+void GPTModel::apply_gradients(bool posted) {
+    if (communicator) {
+        if (!posted) {
+            for (size_t b = 0; b < communicator->num_buckets(); ++b) communicator->post(b, store.grad_data());
+        }
+        communicator->finish(store.grad_data());
+    }
+    if (store.has_replicas()) {
+        store.drop_replicas();
+        Logger::get_instance().log("Dropped NUMA weight replicas before the optimizer step", LogLevel::INFO);
+    }
+    optimizer->step();
+    if (sparse_embeddings) {
+        store.zero_grad(dense_gradient_begin(), store.size());
+        embedding_gradients[0].clear();
+    } else {
+        store.zero_grad();
+    }
+}
+
+void GPTModel::backward_and_update(const std::vector<int>& tokens, const std::vector<int>& segments, int seq_len,
+                                   const Eigen::Ref<const Eigen::MatrixXd>& hidden,
+                                   const std::vector<TransformerBlock::Cache>& caches,
+                                   const Eigen::Ref<const Eigen::MatrixXd>& gradients) {
+    backward(tokens, segments, seq_len, hidden, caches, gradients, nullptr, communicator);
+    apply_gradients(true);
+    Logger::get_instance().log("Updated weights and biases", LogLevel::DEBUG);
+}
+
+Eigen::MatrixXd GPTModel::forward(const std::string& input_text) {
+    return forward(tokenizer.tokenize(input_text));
+}
+
+Eigen::MatrixXd GPTModel::forward(const std::vector<int>& tokens, const std::vector<int>& segments) {
+    Logger::get_instance().log("Starting forward pass", LogLevel::INFO);
+    Arena::begin_step();
+    return predict(hidden_states(tokens, 1, static_cast<int>(tokens.size()), segments));
+}
+
+Eigen::MatrixXd GPTModel::forward(const TokenBatch& batch) {
+    Eigen::MatrixXd predictions;
+    forward(batch, predictions);
+    return predictions;
+}
+
+void GPTModel::forward(const TokenBatch& batch, Eigen::MatrixXd& predictions) {
+    Logger::get_instance().log("Starting batched forward pass", LogLevel::INFO);
+    Arena::begin_step();
+    int stages = std::min<int>(pipeline_stages, static_cast<int>(layers.size()));
+    if (stages > 1) {
+        run_pipeline(batch, stages, &predictions);
+        return;
+    }
+    predictions = predict(hidden_states(batch.tokens, batch.batch_size, batch.seq_len, batch.segments));
 }
 
 double GPTModel::train(const std::string& input_text, const Eigen::MatrixXd& targets) {
+    if (output_loss_gives_hidden_gradient()) {
+        // The adaptive and sampled softmax take target IDs: the hot column of each row
+        std::vector<int> target_ids(targets.rows(), -1);
+        for (Eigen::Index i = 0; i < targets.rows(); ++i) {
+            if (targets.row(i).sum() > 0.0) targets.row(i).maxCoeff(&target_ids[i]);
+        }
+        return train(tokenizer.tokenize(input_text), {}, target_ids);
+    }
     Logger::get_instance().log("Starting training pass", LogLevel::INFO);
-    Eigen::MatrixXd predictions = forward(input_text);
+    Arena::begin_step();
+    drop_quantized();
+    auto tokens = tokenizer.tokenize(input_text);
+    std::vector<TransformerBlock::Cache> caches;
+    Eigen::Map<Eigen::MatrixXd> hidden = hidden_states(tokens, 1, static_cast<int>(tokens.size()), {}, &caches);
+    Eigen::MatrixXd predictions = predict(hidden);
     double loss = Loss::cross_entropy(predictions, targets);
     Logger::get_instance().log("Loss: " + std::to_string(loss), LogLevel::INFO);
 
-    Eigen::MatrixXd gradients = Loss::cross_entropy_gradient(predictions, targets);
-    Eigen::MatrixXd embeddings = embedding_layer.get_embeddings(tokenizer.tokenize(input_text));
+    backward_and_update(tokens, {}, static_cast<int>(tokens.size()), hidden, caches, Loss::cross_entropy_gradient(predictions, targets));
+    return loss;
+}
 
-    output_weights -= learning_rate * gradients.transpose() * embeddings;
-    output_bias -= learning_rate * gradients.colwise().sum().transpose();
-    Logger::get_instance().log("Updated weights and biases", LogLevel::DEBUG);
+double GPTModel::train(const std::vector<int>& tokens, const std::vector<int>& segments, const std::vector<int>& targets) {
+    Logger::get_instance().log("Starting training pass", LogLevel::INFO);
+    Arena::begin_step();
+    drop_quantized();
+    draw_negatives();
+    if (worker_caches.empty()) worker_caches.resize(1);
+    auto& caches = worker_caches[0];
+    Eigen::Map<Eigen::MatrixXd> hidden = hidden_states(tokens, 1, static_cast<int>(tokens.size()), segments, &caches);
+    Eigen::Map<Eigen::MatrixXd> gradients(nullptr, 0, 0);
+    double loss = output_loss(hidden, targets, 1.0, nullptr, gradients);
+    if (Logger::get_instance().enabled(LogLevel::INFO)) {
+        Logger::get_instance().log("Loss: " + std::to_string(loss), LogLevel::INFO);
+    }
+    backward_and_update(tokens, segments, static_cast<int>(tokens.size()), hidden, caches, gradients);
+    return loss;
+}
+
+double GPTModel::train(const TokenBatch& batch) {
+    Logger::get_instance().log("Starting batched training pass", LogLevel::INFO);
+    Arena::begin_step();
+    drop_quantized();
+    draw_negatives();
+    int stages = std::min<int>(pipeline_stages, static_cast<int>(layers.size()));
+    if (stages > 1) return run_pipeline(batch, stages, nullptr);
+    int workers = std::min(num_threads, batch.batch_size);
+    if (workers > 1) return train_data_parallel(batch, workers);
+
+    if (worker_caches.empty()) worker_caches.resize(1);
+    auto& caches = worker_caches[0];
+    Eigen::Map<Eigen::MatrixXd> hidden = hidden_states(batch.tokens, batch.batch_size, batch.seq_len, batch.segments,
+                                                       &caches);
+    Eigen::Map<Eigen::MatrixXd> gradients(nullptr, 0, 0);
+    double loss = output_loss(hidden, batch.targets, 1.0, nullptr, gradients);
+    if (Logger::get_instance().enabled(LogLevel::INFO)) {
+        Logger::get_instance().log("Loss: " + std::to_string(loss), LogLevel::INFO);
+    }
+    backward_and_update(batch.tokens, batch.segments, batch.seq_len, hidden, caches, gradients);
+    return loss;
+}
 
+double GPTModel::train_data_parallel(const TokenBatch& batch, int workers) {
+    if (worker_gradients.size() != static_cast<size_t>(workers - 1)) {
+        worker_gradients.clear();
+        for (int w = 1; w < workers; ++w) worker_gradients.emplace_back(store.size());
+    }
+
+    // Each slice's loss and gradient are rescaled from its own target count
+    // to the batch's, so the sum equals the full-batch mean
+    int total_count = 0;
+    for (int id : batch.targets) total_count += id >= 0;
+    total_count = std::max(total_count, 1);
+
+    // Sized before the tasks start, so the tasks never resize them
+    if (worker_caches.size() < static_cast<size_t>(workers)) worker_caches.resize(workers);
+    if (worker_slices.size() < static_cast<size_t>(workers)) worker_slices.resize(workers);
+    if (sparse_embeddings && embedding_gradients.size() < static_cast<size_t>(workers)) {
+        // Growing moves element 0, so the optimizer is pointed at it again
+        embedding_gradients.resize(workers);
+        for (int w = 1; w < workers; ++w) embedding_gradients[w].reset(embedding_layer.table_rows(), embedding_dim);
+        optimizer->set_sparse(embedding_layer.get_tensor_id(), &embedding_gradients[0], embedding_layer.row_step(),
+                              embedding_layer.element_step());
+    }
+    worker_losses.assign(workers, 0.0);
+    auto work = [&](int w) {
+        MicroBatch& slice = worker_slices[w];
+        slice_batch(batch, batch.batch_size * w / workers, batch.batch_size * (w + 1) / workers, slice);
+        if (slice.count == 0) return;
+        double scale = static_cast<double>(slice.count) / total_count;
+
+        auto& caches = worker_caches[w];
+        Eigen::Map<Eigen::MatrixXd> hidden = hidden_states(slice.tokens, slice.rows, batch.seq_len, slice.segments,
+                                                           &caches);
+        double* grad_base = w == 0 ? nullptr : worker_gradients[w - 1].data();
+        Eigen::Map<Eigen::MatrixXd> gradients(nullptr, 0, 0);
+        worker_losses[w] = output_loss(hidden, slice.targets, scale, grad_base, gradients);
+        backward(slice.tokens, slice.segments, batch.seq_len, hidden, caches, gradients, grad_base, nullptr, w);
+    };
+
+    // Slices are pool tasks; the layers below them parallelize further on the same pool
+    {
+        ThreadPool::TaskGroup group;
+        for (int w = 1; w < workers; ++w) group.run([&work, w] { work(w); });
+        work(0);
+        group.wait();
+    }
+
+    reduce_gradients(workers);
+    apply_gradients(false);
+
+    double loss = 0.0;
+    for (double slice_loss : worker_losses) loss += slice_loss;
+    if (Logger::get_instance().enabled(LogLevel::INFO)) {
+        Logger::get_instance().log("Loss: " + std::to_string(loss), LogLevel::INFO);
+    }
+    return loss;
+}
+
+void GPTModel::reduce_gradients(int workers) {
+    const size_t chunk_size = 1 << 14; // 128 KB per buffer, so a chunk's tree stays in cache
+    const size_t first = dense_gradient_begin();
+    const size_t total = store.size();
+    const size_t num_chunks = (total - first + chunk_size - 1) / chunk_size;
+
+    double* store_gradients = store.grad_data();
+    auto buffer = [&](int i) { return i == 0 ? store_gradients : worker_gradients[i - 1].data(); };
+
+    // Pairwise tree per chunk: the summation order depends only on the worker
+    // count, never on which thread handles the chunk
+    ThreadPool::instance().parallel_for(0, num_chunks, 1, [&](size_t chunk_begin, size_t chunk_end) {
+        for (size_t c = chunk_begin; c < chunk_end; ++c) {
+            size_t begin = first + c * chunk_size;
+            size_t end = std::min(total, begin + chunk_size);
+            for (int stride = 1; stride < workers; stride *= 2) {
+                for (int i = 0; i + stride < workers; i += 2 * stride) {
+                    double* __restrict dst = buffer(i);
+                    const double* __restrict src = buffer(i + stride);
+                    for (size_t k = begin; k < end; ++k) dst[k] += src[k];
+                }
+            }
+            for (int i = 1; i < workers; ++i) {
+                std::memset(buffer(i) + begin, 0, (end - begin) * sizeof(double));
+            }
+        }
+    });
+
+    // Sparse embedding rows are merged in worker order
+    if (sparse_embeddings) {
+        for (int i = 1; i < workers; ++i) {
+            embedding_gradients[0].add(embedding_gradients[i]);
+            embedding_gradients[i].clear();
+        }
+    }
+}
+
+void GPTModel::slice_batch(const TokenBatch& batch, int row_begin, int row_end, MicroBatch& slice) {
+    slice.begin = static_cast<size_t>(row_begin) * batch.seq_len;
+    slice.rows = row_end - row_begin;
+    size_t end = static_cast<size_t>(row_end) * batch.seq_len;
+    slice.tokens.assign(batch.tokens.begin() + slice.begin, batch.tokens.begin() + end);
+    slice.targets.assign(batch.targets.begin() + slice.begin, batch.targets.begin() + end);
+    if (batch.segments.empty()) {
+        slice.segments.clear();
+    } else {
+        slice.segments.assign(batch.segments.begin() + slice.begin, batch.segments.begin() + end);
+    }
+    slice.count = 0;
+    for (int id : slice.targets) slice.count += id >= 0;
+}
+
+double GPTModel::run_pipeline(const TokenBatch& batch, int stages, Eigen::MatrixXd* predictions) {
+    const bool training = predictions == nullptr;
+    const int num_micro = std::max(1, std::min(micro_batches, batch.batch_size));
+    const int seq_len = batch.seq_len;
+
+    std::vector<MicroBatch>& micro = pipeline_slices;
+    for (int i = 0; i < num_micro; ++i) {
+        slice_batch(batch, batch.batch_size * i / num_micro, batch.batch_size * (i + 1) / num_micro, micro[i]);
+    }
+    int total_count = 0;
+    for (int i = 0; i < num_micro; ++i) total_count += micro[i].count;
+    total_count = std::max(total_count, 1);
+    if (predictions) predictions->resize(batch.tokens.size(), vocab_size);
+    if (training) store.grad_data(); // Allocate before the stages share it
+    std::fill(pipeline_losses.begin(), pipeline_losses.end(), 0.0);
+
+    // Stages own disjoint tensors, so they accumulate into the store's gradients
+    // directly. Tied output weights share the first stage's embedding matrix,
+    // so the last stage collects their gradient separately until the join.
+    RowMajorMatrixXd& tied_gradient = pipeline_tied_gradient;
+    if (training && tied_embeddings) tied_gradient.setZero(output_weights.rows(), embedding_dim);
+    auto run_stage = [&](int s) {
+        const size_t first = layers.size() * s / stages;
+        const size_t last = layers.size() * (s + 1) / stages;
+        const bool is_last = s + 1 == stages;
+        PipelineStage& state = stage_states[s];
+        Arena& arena = Arena::local();
+
+        // Messages are views into the sender's arena, which lives until the next step
+        auto send = [&](BoundedQueue<StageMessage>& queue, int i, Eigen::Map<Eigen::MatrixXd>& data) {
+            StageMessage message{i, data.data(), data.rows()};
+            queue.push(message);
+        };
+        auto receive = [&](BoundedQueue<StageMessage>& queue, Eigen::Map<Eigen::MatrixXd>& data) {
+            StageMessage message;
+            queue.pop(message);
+            Arena::rebind(data, Eigen::Map<Eigen::MatrixXd>(message.data, message.rows, embedding_dim));
+        };
+
+        auto forward_step = [&](int i) {
+            const MicroBatch& mb = micro[i];
+            Eigen::Map<Eigen::MatrixXd> hidden(nullptr, 0, 0);
+            if (s == 0) {
+                arena.bind(hidden, static_cast<Eigen::Index>(mb.tokens.size()), embedding_dim);
+                embedding_layer.get_embeddings(mb.tokens, mb.segments, hidden);
+                add_positions(mb.segments, seq_len, hidden);
+            } else {
+                receive(*stage_activations[s - 1], hidden);
+            }
+            if (training) state.caches[i].resize(last - first);
+            for (size_t l = first; l < last; ++l) {
+                Arena::rebind(hidden, layers[l].forward(hidden, mb.rows, seq_len, mb.segments,
+                                                        training ? &state.caches[i][l - first] : nullptr));
+            }
+            if (!is_last) {
+                send(*stage_activations[s], i, hidden);
+                return;
+            }
+            if (!training) {
+                predictions->middleRows(mb.begin, hidden.rows()) = predict(hidden);
+                return;
+            }
+            // The adaptive and sampled softmax accumulate their gradients here, and hand back the one w.r.t. hidden
+            double scale = static_cast<double>(mb.count) / total_count;
+            Eigen::Map<Eigen::MatrixXd> gradients(nullptr, 0, 0);
+            double loss;
+            if (tied_embeddings && !sampler.empty()) {
+                // Stage 0 writes the embedding gradient meanwhile
+                Arena::rebind(gradients, arena.matrix(hidden.rows(), embedding_dim));
+                loss = sampled_loss(hidden, mb.targets, scale, tied_gradient, store.grad_view(output_bias_id), gradients);
+            } else {
+                loss = output_loss(hidden, mb.targets, scale, nullptr, gradients);
+            }
+            pipeline_losses[i] = mb.count > 0 ? loss : 0.0;
+            Arena::rebind(state.output_grads[i], gradients);
+            Arena::rebind(state.output_inputs[i], hidden);
+        };
+
+        auto backward_step = [&](int i) {
+            Eigen::Map<Eigen::MatrixXd> grad(nullptr, 0, 0);
+            if (is_last && output_loss_gives_hidden_gradient()) {
+                Arena::rebind(grad, state.output_grads[i]);
+            } else if (is_last) {
+                arena.bind(grad, state.output_grads[i].rows(), embedding_dim);
+                if (tied_embeddings) {
+                    output_backward(state.output_grads[i], state.output_inputs[i], tied_gradient,
+                                    store.grad_view(output_bias_id), grad);
+                } else {
+                    output_backward(state.output_grads[i], state.output_inputs[i],
+                                    store.grad_view<RowMajorMatrixXd>(output_weights_id), store.grad_view(output_bias_id),
+                                    grad);
+                }
+            } else {
+                receive(*stage_gradients[s], grad);
+            }
+            for (size_t l = last; l-- > first;) {
+                Arena::rebind(grad, layers[l].backward(state.caches[i][l - first], grad));
+            }
+            if (s == 0 && positional.get_type() == PositionType::LEARNED) {
+                positional.accumulate(grad, micro[i].segments, seq_len,
+                                      store.grad_view<RowMajorMatrixXd>(position_embedding_id));
+            }
+            if (s == 0 && sparse_embeddings) {
+                embedding_layer.backward(micro[i].tokens, micro[i].segments, grad, embedding_gradients[0]);
+            } else if (s == 0) {
+                embedding_layer.backward(micro[i].tokens, micro[i].segments, grad);
+            } else {
+                send(*stage_gradients[s - 1], i, grad);
+            }
+        };
+
+        if (!training) {
+            for (int i = 0; i < num_micro; ++i) forward_step(i);
+            return;
+        }
+        // 1F1B: enough forwards to fill the stages behind this one, then
+        // alternate, then drain the remaining backwards
+        int warmup = std::min(stages - s - 1, num_micro);
+        for (int i = 0; i < warmup; ++i) forward_step(i);
+        for (int i = warmup; i < num_micro; ++i) {
+            forward_step(i);
+            backward_step(i - warmup);
+        }
+        for (int i = num_micro - warmup; i < num_micro; ++i) backward_step(i);
+    };
+
+    // Wrapped so the std::function holds one reference and does not allocate
+    stage_threads->run([&run_stage](int s) { run_stage(s); });
+    if (!training) return 0.0;
+    if (tied_embeddings) store.grad_view<RowMajorMatrixXd>(output_weights_id) += tied_gradient;
+
+    apply_gradients(false);
+    double loss = 0.0;
+    for (int i = 0; i < num_micro; ++i) loss += pipeline_losses[i];
+    if (Logger::get_instance().enabled(LogLevel::INFO)) {
+        Logger::get_instance().log("Loss: " + std::to_string(loss), LogLevel::INFO);
+    }
     return loss;
 }
@@ -20,6 +20,11 @@ Logger& Logger::get_instance(const std::string& file_path, LogLevel log_level) {
     return instance;
 }
 
+Logger& Logger::get_instance() {
+    static Logger& instance = get_instance("logs/project.log", LogLevel::DEBUG);
+    return instance;
+}
+
 std::string Logger::level_to_string(LogLevel level) const {
     switch (level) {
         case LogLevel::DEBUG: return "DEBUG";
@@ -43,6 +48,7 @@ std::string Logger::current_timestamp() const {
 
 void Logger::log(const std::string& message, LogLevel message_level) {
     if (message_level >= level) {
+        std::lock_guard<std::mutex> lock(mutex);
         std::string output = "[" + current_timestamp() + "] [" + 
                              level_to_string(message_level) + "] " + message;
         std::cout << output << std::endl;
@@ -52,6 +58,10 @@ void Logger::log(const std::string& message, LogLevel message_level) {
     }
 }
 
+void Logger::log(const char* message, LogLevel message_level) {
+    if (message_level >= level) log(std::string(message), message_level);
+}
+
 void Logger::set_level(LogLevel log_level) {
     level = log_level;
 }
\ No newline at end of file
@@ -1,5 +1,7 @@
 #include "Loss.h"
 #include "Logger.h"
+#include "ThreadPool.h"
+#include <algorithm>
 #include <cmath>
 
 double Loss::cross_entropy(const Eigen::MatrixXd& predictions, const Eigen::MatrixXd& targets) {
@@ -26,3 +28,55 @@ Eigen::MatrixXd Loss::cross_entropy_gradient(const Eigen::MatrixXd& predictions,
 
     return gradients;
 }
+
+double Loss::cross_entropy(const Eigen::Ref<const Eigen::MatrixXd>& predictions, const std::vector<int>& target_ids) {
+    Logger::get_instance().log("Calculating cross-entropy loss", LogLevel::DEBUG);
+
+    const double epsilon = 1e-12; // Avoid log(0)
+    double total = 0.0;
+    int count = 0;
+    for (size_t i = 0; i < target_ids.size(); ++i) {
+        if (target_ids[i] < 0) continue;
+        double p = std::min(std::max(predictions(i, target_ids[i]), epsilon), 1.0 - epsilon);
+        total -= std::log(p);
+        ++count;
+    }
+
+    double loss = count > 0 ? total / count : 0.0;
+    if (Logger::get_instance().enabled(LogLevel::INFO)) {
+        Logger::get_instance().log("Cross-entropy loss: " + std::to_string(loss), LogLevel::INFO);
+    }
+
+    return loss;
+}
+
+Eigen::MatrixXd Loss::cross_entropy_gradient(const Eigen::Ref<const Eigen::MatrixXd>& predictions,
+                                             const std::vector<int>& target_ids) {
+    Eigen::MatrixXd gradients(predictions.rows(), predictions.cols());
+    cross_entropy_gradient(predictions, target_ids, gradients);
+    return gradients;
+}
+
+void Loss::cross_entropy_gradient(const Eigen::Ref<const Eigen::MatrixXd>& predictions,
+                                  const std::vector<int>& target_ids, Eigen::Ref<Eigen::MatrixXd> gradients,
+                                  double scale) {
+    Logger::get_instance().log("Calculating cross-entropy gradient", LogLevel::DEBUG);
+
+    int count = 0;
+    for (int id : target_ids) count += id >= 0;
+
+    // Rows are independent; each task scales and adjusts its own rows
+    const int divisor = std::max(count, 1);
+    ThreadPool::instance().parallel_for(0, target_ids.size(), 16, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            if (target_ids[i] < 0) {
+                gradients.row(i).setZero();
+                continue;
+            }
+            gradients.row(i) = predictions.row(i) / divisor;
+            gradients(i, target_ids[i]) -= 1.0 / count;
+            if (scale != 1.0) gradients.row(i) *= scale;
+        }
+    });
+    Logger::get_instance().log("Cross-entropy gradient calculated", LogLevel::DEBUG);
+}
@@ -0,0 +1,106 @@
+#include "MemoryPlanner.h"
+#include "AlignedBuffer.h"
+#include <algorithm>
+#include <cstdio>
+#include <numeric>
+#include <utility>
+
+namespace {
+
+bool overlaps(const PlannedBuffer& a, const PlannedBuffer& b) {
+    return a.first_use <= b.last_use && b.first_use <= a.last_use;
+}
+
+} // namespace
+
+int MemoryPlan::step(const std::string& name) {
+    steps.push_back(name);
+    return static_cast<int>(steps.size()) - 1;
+}
+
+size_t MemoryPlan::add(const std::string& name, size_t size, int first_use, int last_use) {
+    buffers.push_back({name, AlignedBuffer::padded(size), first_use, std::max(first_use, last_use), 0});
+    return buffers.size() - 1;
+}
+
+size_t MemoryPlan::unshared_size() const {
+    size_t total = 0;
+    for (const auto& buffer : buffers) total += buffer.size;
+    return total;
+}
+
+size_t MemoryPlan::live_peak() const {
+    size_t peak = 0;
+    for (int s = 0; s < static_cast<int>(steps.size()); ++s) {
+        size_t live = 0;
+        for (const auto& buffer : buffers) {
+            if (buffer.first_use <= s && s <= buffer.last_use) live += buffer.size;
+        }
+        peak = std::max(peak, live);
+    }
+    return peak;
+}
+
+void MemoryPlanner::plan(MemoryPlan& plan) {
+    std::vector<PlannedBuffer>& buffers = plan.buffers;
+    std::vector<size_t> order(buffers.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        if (buffers[a].size != buffers[b].size) return buffers[a].size > buffers[b].size;
+        return buffers[a].first_use < buffers[b].first_use;
+    });
+
+    std::vector<size_t> placed;
+    std::vector<std::pair<size_t, size_t>> taken;
+    plan.slab_size = 0;
+    for (size_t index : order) {
+        PlannedBuffer& buffer = buffers[index];
+
+        // Ranges held by placed buffers that are alive at the same time
+        taken.clear();
+        for (size_t other : placed) {
+            if (overlaps(buffer, buffers[other])) {
+                taken.emplace_back(buffers[other].offset, buffers[other].offset + buffers[other].size);
+            }
+        }
+        std::sort(taken.begin(), taken.end());
+
+        // First gap that fits
+        size_t offset = 0;
+        for (const auto& range : taken) {
+            if (range.first >= offset + buffer.size) break;
+            offset = std::max(offset, range.second);
+        }
+        buffer.offset = offset;
+        placed.push_back(index);
+        plan.slab_size = std::max(plan.slab_size, offset + buffer.size);
+    }
+}
+
+std::string MemoryPlanner::megabytes(size_t doubles) {
+    char text[32];
+    std::snprintf(text, sizeof(text), "%.2f MB", doubles * sizeof(double) / (1024.0 * 1024.0));
+    return text;
+}
+
+std::string MemoryPlanner::report(const MemoryPlan& plan) {
+    std::string text = "Memory plan for " + plan.description + ": activations " + megabytes(plan.slab_size) +
+                       " in one slab (" + megabytes(plan.unshared_size()) + " without reuse, lower bound " +
+                       megabytes(plan.live_peak()) + "), parameters, gradients and optimizer state " +
+                       megabytes(plan.persistent_size) + ", total " +
+                       megabytes(plan.slab_size + plan.persistent_size);
+
+    // The largest buffers decide the peak
+    std::vector<const PlannedBuffer*> largest;
+    for (const auto& buffer : plan.buffers) largest.push_back(&buffer);
+    std::stable_sort(largest.begin(), largest.end(),
+                     [](const PlannedBuffer* a, const PlannedBuffer* b) { return a->size > b->size; });
+    const size_t shown = std::min<size_t>(largest.size(), 5);
+    for (size_t i = 0; i < shown; ++i) {
+        const PlannedBuffer& buffer = *largest[i];
+        text += "\n  " + buffer.name + ": " + megabytes(buffer.size) + " at offset " +
+                std::to_string(buffer.offset) + ", alive from " + plan.steps[buffer.first_use] + " to " +
+                plan.steps[buffer.last_use];
+    }
+    return text;
+}
@@ -1,5 +1,6 @@
 #include "Metrics.h"
 #include "Logger.h"
+#include "ThreadPool.h"
 #include <cmath>
 
 double Metrics::accuracy(const Eigen::MatrixXd& predictions, const Eigen::MatrixXd& targets) {
@@ -46,3 +47,45 @@ double Metrics::perplexity(const Eigen::MatrixXd& predictions, const Eigen::Matr
     return std::exp(-avg_log_prob);
 }
 
+double Metrics::accuracy(const Eigen::MatrixXd& predictions, const std::vector<int>& target_ids) {
+    Logger::get_instance().log("Calculating accuracy", LogLevel::INFO);
+
+    // The argmax over the vocabulary dominates; find it for each row in parallel
+    std::vector<char> hit(target_ids.size(), 0);
+    ThreadPool::instance().parallel_for(0, target_ids.size(), 16, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            if (target_ids[i] < 0) continue;
+            int predicted_index;
+            predictions.row(i).maxCoeff(&predicted_index);
+            hit[i] = predicted_index == target_ids[i];
+        }
+    });
+
+    int correct = 0;
+    int total = 0;
+    for (size_t i = 0; i < target_ids.size(); ++i) {
+        if (target_ids[i] < 0) continue;
+        correct += hit[i];
+        ++total;
+    }
+
+    double accuracy = total > 0 ? static_cast<double>(correct) / total : 0.0;
+    Logger::get_instance().log("Accuracy: " + std::to_string(accuracy), LogLevel::INFO);
+
+    return accuracy;
+}
+
+double Metrics::perplexity(const Eigen::MatrixXd& predictions, const std::vector<int>& target_ids) {
+    const double epsilon = 1e-12;
+    double total_log_prob = 0.0;
+    int total = 0;
+
+    for (size_t i = 0; i < target_ids.size(); ++i) {
+        if (target_ids[i] < 0) continue;
+        total_log_prob += std::log(predictions(i, target_ids[i]) + epsilon);
+        ++total;
+    }
+
+    double avg_log_prob = total > 0 ? total_log_prob / total : 0.0;
+    return std::exp(-avg_log_prob);
+}
@@ -0,0 +1,125 @@
+#include "Numa.h"
+#include "Logger.h"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <pthread.h>
+#include <sched.h>
+#include <sstream>
+#include <string>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+// From linux/mempolicy.h
+const int mpol_bind = 2;
+const int mpol_interleave = 3;
+const unsigned mpol_mf_move = 1 << 1;
+
+const char node_root[] = "/sys/devices/system/node";
+
+// Parse a kernel CPU list such as "0-3,8-11"
+std::vector<int> parse_cpu_list(const std::string& text) {
+    std::vector<int> cpus;
+    std::istringstream stream(text);
+    std::string range;
+    while (std::getline(stream, range, ',')) {
+        if (range.empty() || range == "\n") continue;
+        size_t dash = range.find('-');
+        int first = std::atoi(range.c_str());
+        int last = dash == std::string::npos ? first : std::atoi(range.c_str() + dash + 1);
+        for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+std::vector<Numa::Node> probe() {
+    std::vector<Numa::Node> nodes;
+    DIR* dir = ::opendir(node_root);
+    if (dir) {
+        while (dirent* entry = ::readdir(dir)) {
+            if (std::strncmp(entry->d_name, "node", 4) != 0 || !std::isdigit(entry->d_name[4])) continue;
+            std::ifstream file(std::string(node_root) + "/" + entry->d_name + "/cpulist");
+            std::string text;
+            std::getline(file, text);
+            std::vector<int> cpus = parse_cpu_list(text);
+            if (!cpus.empty()) nodes.push_back({std::atoi(entry->d_name + 4), cpus});
+        }
+        ::closedir(dir);
+    }
+    std::sort(nodes.begin(), nodes.end(), [](const Numa::Node& a, const Numa::Node& b) { return a.id < b.id; });
+
+    std::string summary;
+    for (const auto& node : nodes) {
+        summary += " node" + std::to_string(node.id) + ":" + std::to_string(node.cpus.size()) + " cpus";
+    }
+    Logger::get_instance().log("NUMA topology: " + std::to_string(nodes.size()) + " node(s)" + summary, LogLevel::INFO);
+    return nodes;
+}
+
+bool set_policy(void* data, size_t bytes, int mode, const std::vector<int>& node_ids) {
+    if (!data || bytes == 0) return true;
+    // The policy applies to whole pages
+    const uintptr_t page = static_cast<uintptr_t>(::sysconf(_SC_PAGESIZE));
+    uintptr_t begin = reinterpret_cast<uintptr_t>(data) / page * page;
+    uintptr_t end = (reinterpret_cast<uintptr_t>(data) + bytes + page - 1) / page * page;
+
+    const size_t bits = 8 * sizeof(unsigned long);
+    int max_id = *std::max_element(node_ids.begin(), node_ids.end());
+    std::vector<unsigned long> mask(max_id / bits + 1, 0);
+    for (int id : node_ids) mask[id / bits] |= 1UL << (id % bits);
+
+    if (::syscall(SYS_mbind, begin, end - begin, mode, mask.data(), mask.size() * bits + 1, mpol_mf_move) != 0) {
+        Logger::get_instance().log(std::string("mbind failed: ") + std::strerror(errno), LogLevel::WARNING);
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+const std::vector<Numa::Node>& Numa::nodes() {
+    static const std::vector<Node> topology = probe();
+    return topology;
+}
+
+int Numa::current_node() {
+    if (!is_numa()) return 0;
+    int cpu = ::sched_getcpu();
+    const auto& all = nodes();
+    for (size_t n = 0; n < all.size(); ++n) {
+        if (std::find(all[n].cpus.begin(), all[n].cpus.end(), cpu) != all[n].cpus.end()) return static_cast<int>(n);
+    }
+    return 0;
+}
+
+bool Numa::pin_thread(int node) {
+    if (!is_numa()) return true;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : nodes()[node].cpus) CPU_SET(cpu, &set);
+    int error = ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set);
+    if (error != 0) {
+        Logger::get_instance().log("Could not pin thread to NUMA node " + std::to_string(nodes()[node].id) + ": " +
+                                   std::strerror(error), LogLevel::WARNING);
+        return false;
+    }
+    return true;
+}
+
+bool Numa::bind(void* data, size_t bytes, int node) {
+    if (!is_numa()) return true;
+    return set_policy(data, bytes, mpol_bind, {nodes()[node].id});
+}
+
+bool Numa::interleave(void* data, size_t bytes) {
+    if (!is_numa()) return true;
+    std::vector<int> ids;
+    for (const auto& node : nodes()) ids.push_back(node.id);
+    return set_policy(data, bytes, mpol_interleave, ids);
+}
@@ -0,0 +1,182 @@
+#include "Optimizer.h"
+#include "Logger.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace {
+
+const size_t chunk_size = 1 << 14;        // Elements per work item (128 KB per state array)
+const size_t min_parallel_size = 1 << 16; // Below this the sweep is not worth a thread fork
+const size_t sparse_row_grain = 64;       // Rows of a sparse update per work item
+
+// One SGD element update; v is null without momentum
+inline void sgd_update(double& value, double grad, double* v, double lr, double mu, double decay) {
+    if (!v) {
+        value -= lr * (grad + decay * value);
+        return;
+    }
+    double velocity = mu * *v + grad + decay * value;
+    *v = velocity;
+    value -= lr * velocity;
+}
+
+struct AdamConstants {
+    double beta1;
+    double beta2;
+    double epsilon;
+    double decay; // lr * weight_decay
+    double alpha; // Step size with the first moment's bias correction
+    double bias2; // 1 / sqrt(1 - beta2^t)
+};
+
+// One fused AdamW element update
+inline void adam_update(double& value, double grad, double& m1, double& m2, const AdamConstants& c) {
+    double mi = c.beta1 * m1 + (1.0 - c.beta1) * grad;
+    double vi = c.beta2 * m2 + (1.0 - c.beta2) * grad * grad;
+    m1 = mi;
+    m2 = vi;
+    value -= c.decay * value + c.alpha * mi / (std::sqrt(vi) * c.bias2 + c.epsilon);
+}
+
+} // namespace
+
+Optimizer::Optimizer(const std::vector<Parameter>& params, const OptimizerOptions& options)
+    : params(params), state_size(0), options(options), step_count(0) {
+    for (size_t i = 0; i < params.size(); ++i) {
+        offsets.push_back(state_size);
+        state_size += AlignedBuffer::padded(params[i].size);
+    }
+    build_chunks();
+    Logger::get_instance().log("Optimizer tracking " + std::to_string(params.size()) + " parameters (" +
+                               std::to_string(state_size) + " values)", LogLevel::DEBUG);
+}
+
+void Optimizer::build_chunks() {
+    chunks.clear();
+    for (size_t i = 0; i < params.size(); ++i) {
+        bool sparse = std::any_of(sparse_params.begin(), sparse_params.end(),
+                                  [i](const SparseParam& s) { return s.param == i; });
+        if (sparse) continue;
+        for (size_t begin = 0; begin < params[i].size; begin += chunk_size) {
+            chunks.push_back({i, begin, std::min(params[i].size, begin + chunk_size)});
+        }
+    }
+}
+
+void Optimizer::set_sparse(size_t param, const SparseRowGradient* gradient, size_t row_step, size_t element_step) {
+    sparse_params.erase(std::remove_if(sparse_params.begin(), sparse_params.end(),
+                                       [param](const SparseParam& s) { return s.param == param; }),
+                        sparse_params.end());
+    if (gradient) sparse_params.push_back({param, gradient, row_step, element_step});
+    build_chunks();
+    Logger::get_instance().log(std::string(gradient ? "Lazy sparse" : "Dense") + " updates for " + params[param].name,
+                               LogLevel::INFO);
+}
+
+void Optimizer::step() {
+    ++step_count;
+    begin_step();
+    ThreadPool& pool = ThreadPool::instance();
+
+    if (state_size < min_parallel_size) {
+        for (const auto& chunk : chunks) update(chunk.param, chunk.begin, chunk.end);
+    } else {
+        // Chunks split large tensors, so the pool can balance them across threads
+        pool.parallel_for(0, chunks.size(), 1, [this](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) update(chunks[i].param, chunks[i].begin, chunks[i].end);
+        });
+    }
+
+    // Sparse parameters: only the rows this step's gradient touched
+    for (const auto& sparse : sparse_params) {
+        const SparseRowGradient& gradient = *sparse.gradient;
+        pool.parallel_for(0, gradient.size(), sparse_row_grain, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                update_row(sparse.param, gradient.rows[i] * sparse.row_step, gradient.width, sparse.element_step,
+                           gradient.row_values(i));
+            }
+        });
+    }
+}
+
+void Optimizer::zero_grad() {
+    for (auto& param : params) {
+        std::memset(param.grad, 0, param.size * sizeof(double));
+    }
+}
+
+SGD::SGD(const std::vector<Parameter>& params, const OptimizerOptions& options)
+    : Optimizer(params, options), velocity(options.momentum != 0.0 ? state_size : 0) {
+    Logger::get_instance().log("Initialized SGD optimizer (momentum " + std::to_string(options.momentum) + ")",
+                               LogLevel::INFO);
+}
+
+void SGD::update(size_t param, size_t begin, size_t end) {
+    double* __restrict value = params[param].value;
+    const double* __restrict grad = params[param].grad;
+    const double lr = options.learning_rate;
+    const double decay = options.weight_decay;
+
+    if (velocity.size() == 0) {
+        for (size_t i = begin; i < end; ++i) sgd_update(value[i], grad[i], nullptr, lr, 0.0, decay);
+        return;
+    }
+
+    double* __restrict vel = velocity.data() + offsets[param];
+    const double mu = options.momentum;
+    for (size_t i = begin; i < end; ++i) sgd_update(value[i], grad[i], vel + i, lr, mu, decay);
+}
+
+void SGD::update_row(size_t param, size_t first, size_t count, size_t stride, const double* grad) {
+    double* value = params[param].value;
+    double* vel = velocity.size() == 0 ? nullptr : velocity.data() + offsets[param];
+    for (size_t k = 0, i = first; k < count; ++k, i += stride) {
+        sgd_update(value[i], grad[k], vel ? vel + i : nullptr, options.learning_rate, options.momentum,
+                   options.weight_decay);
+    }
+}
+
+std::vector<OptimizerState> SGD::state() {
+    if (velocity.size() == 0) return {};
+    return {{"velocity", velocity.data(), velocity.size()}};
+}
+
+AdamW::AdamW(const std::vector<Parameter>& params, const OptimizerOptions& options)
+    : Optimizer(params, options), m(state_size), v(state_size), step_size(0.0), inv_sqrt_bias2(1.0) {
+    Logger::get_instance().log("Initialized AdamW optimizer (beta1 " + std::to_string(options.beta1) +
+                               ", beta2 " + std::to_string(options.beta2) + ", weight decay " +
+                               std::to_string(options.weight_decay) + ")", LogLevel::INFO);
+}
+
+void AdamW::begin_step() {
+    double t = static_cast<double>(step_count);
+    step_size = options.learning_rate / (1.0 - std::pow(options.beta1, t));
+    inv_sqrt_bias2 = 1.0 / std::sqrt(1.0 - std::pow(options.beta2, t));
+}
+
+void AdamW::update(size_t param, size_t begin, size_t end) {
+    double* __restrict value = params[param].value;
+    const double* __restrict grad = params[param].grad;
+    double* __restrict m1 = m.data() + offsets[param];
+    double* __restrict m2 = v.data() + offsets[param];
+    const AdamConstants constants = {options.beta1, options.beta2, options.epsilon,
+                                     options.learning_rate * options.weight_decay, step_size, inv_sqrt_bias2};
+
+    for (size_t i = begin; i < end; ++i) adam_update(value[i], grad[i], m1[i], m2[i], constants);
+}
+
+void AdamW::update_row(size_t param, size_t first, size_t count, size_t stride, const double* grad) {
+    double* value = params[param].value;
+    double* m1 = m.data() + offsets[param];
+    double* m2 = v.data() + offsets[param];
+    const AdamConstants constants = {options.beta1, options.beta2, options.epsilon,
+                                     options.learning_rate * options.weight_decay, step_size, inv_sqrt_bias2};
+
+    for (size_t k = 0, i = first; k < count; ++k, i += stride) adam_update(value[i], grad[k], m1[i], m2[i], constants);
+}
+
+std::vector<OptimizerState> AdamW::state() {
+    return {{"m", m.data(), m.size()}, {"v", v.data(), v.size()}};
+}
@@ -0,0 +1,88 @@
+#include "ParameterStore.h"
+#include "Logger.h"
+#include "Numa.h"
+#include <cmath>
+#include <cstring>
+
+ParameterStore::ParameterStore() : total_size(0), value_base(nullptr) {}
+
+size_t ParameterStore::add(const std::string& name, int rows, int cols) {
+    if (is_allocated()) {
+        Logger::get_instance().log("Cannot add tensor " + name + " after allocation", LogLevel::ERROR);
+        exit(1);
+    }
+    tensors.push_back({name, rows, cols, total_size});
+    total_size += AlignedBuffer::padded(tensors.back().size());
+    return tensors.size() - 1;
+}
+
+void ParameterStore::allocate() {
+    values = AlignedBuffer(total_size);
+    gradients = AlignedBuffer(total_size);
+    value_base = values.data();
+    Logger::get_instance().log("Allocated flat parameter storage: " + std::to_string(tensors.size()) + " tensors, " +
+                               std::to_string(total_size) + " values", LogLevel::INFO);
+}
+
+void ParameterStore::attach(double* external_values) {
+    values = AlignedBuffer();
+    value_base = external_values;
+    Logger::get_instance().log("Attached external parameter storage: " + std::to_string(tensors.size()) + " tensors, " +
+                               std::to_string(total_size) + " values", LogLevel::INFO);
+}
+
+double* ParameterStore::grad_data() {
+    if (gradients.size() == 0 && total_size > 0) gradients = AlignedBuffer(total_size);
+    return gradients.data();
+}
+
+std::vector<Parameter> ParameterStore::parameters() {
+    double* grad = grad_data();
+    std::vector<Parameter> params;
+    params.reserve(tensors.size());
+    for (const auto& tensor : tensors) {
+        params.push_back({tensor.name, value_base + tensor.offset, grad + tensor.offset, tensor.size()});
+    }
+    return params;
+}
+
+void ParameterStore::place(int node) {
+    if (!Numa::is_numa() || !is_allocated()) return;
+    const size_t bytes = total_size * sizeof(double);
+    double* grad = grad_data();
+    bool ok = node < 0 ? Numa::interleave(value_base, bytes) && Numa::interleave(grad, bytes)
+                       : Numa::bind(value_base, bytes, node) && Numa::bind(grad, bytes, node);
+    Logger::get_instance().log(std::string(ok ? "Placed" : "Could not place") + " parameters and gradients " +
+                               (node < 0 ? "interleaved over all NUMA nodes" : "on NUMA node " + std::to_string(node)),
+                               ok ? LogLevel::INFO : LogLevel::WARNING);
+}
+
+void ParameterStore::replicate(const std::vector<size_t>& ids) {
+    drop_replicas();
+    if (!Numa::is_numa() || !is_allocated() || ids.empty()) return;
+    // The tensors are packed into one buffer per node, each on a cache line
+    replica_offsets.assign(tensors.size(), npos);
+    size_t size = 0;
+    for (size_t id : ids) {
+        replica_offsets[id] = size;
+        size += AlignedBuffer::padded(tensors[id].size());
+    }
+    for (int node = 0; node < Numa::num_nodes(); ++node) {
+        replicas.emplace_back(size);
+        Numa::bind(replicas.back().data(), size * sizeof(double), node);
+        for (size_t id : ids) {
+            std::memcpy(replicas.back().data() + replica_offsets[id], value_base + tensors[id].offset,
+                        tensors[id].size() * sizeof(double));
+        }
+    }
+    Logger::get_instance().log("Replicated " + std::to_string(ids.size()) + " tensors (" +
+                               std::to_string(size * sizeof(double) / 1024) + " KB) on " +
+                               std::to_string(replicas.size()) + " NUMA nodes", LogLevel::INFO);
+}
+
+double ParameterStore::grad_norm() const {
+    const double* grad = gradients.data();
+    double sum = 0.0;
+    for (size_t i = 0; i < gradients.size(); ++i) sum += grad[i] * grad[i];
+    return std::sqrt(sum);
+}
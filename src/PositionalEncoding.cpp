@@ -0,0 +1,100 @@
+#include "PositionalEncoding.h"
+#include "Logger.h"
+#include <cmath>
+
+namespace {
+
+const double frequency_base = 10000.0; // Wavelengths grow geometrically from 2 pi to about base * 2 pi
+
+} // namespace
+
+PositionalEncoding::PositionalEncoding(PositionType type, int max_positions, int embedding_dim, int head_dim)
+    : type(max_positions > 0 ? type : PositionType::NONE), max_positions(max_positions), head_dim(head_dim) {
+    if (this->type == PositionType::SINUSOIDAL) {
+        // PE(p, 2j) = sin(p / base^(2j / d)), PE(p, 2j + 1) = cos(p / base^(2j / d))
+        table.resize(max_positions, embedding_dim);
+        for (int k = 0; k < embedding_dim; ++k) {
+            const double frequency = std::pow(frequency_base, -static_cast<double>(k - k % 2) / embedding_dim);
+            for (int p = 0; p < max_positions; ++p) {
+                table(p, k) = k % 2 == 0 ? std::sin(p * frequency) : std::cos(p * frequency);
+            }
+        }
+    } else if (this->type == PositionType::ROTARY) {
+        // Pair j of every head turns by p * base^(-2j / head_dim)
+        const int pairs = head_dim / 2;
+        cos_table.resize(max_positions, pairs);
+        sin_table.resize(max_positions, pairs);
+        for (int j = 0; j < pairs; ++j) {
+            const double frequency = std::pow(frequency_base, -2.0 * j / head_dim);
+            for (int p = 0; p < max_positions; ++p) {
+                cos_table(p, j) = std::cos(p * frequency);
+                sin_table(p, j) = std::sin(p * frequency);
+            }
+        }
+    }
+    if (this->type != PositionType::NONE) {
+        Logger::get_instance().log(std::string("Positional encoding: ") + name(this->type) + " for " +
+                                   std::to_string(max_positions) + " positions", LogLevel::INFO);
+    }
+}
+
+void PositionalEncoding::add(const Eigen::Ref<const RowMajorMatrixXd>& values, const std::vector<int>& segments,
+                             int seq_len, Eigen::Ref<Eigen::MatrixXd> hidden) const {
+    for_each_position(segments, hidden.rows(), seq_len, [&](Eigen::Index row, int position) {
+        hidden.row(row) += values.row(position);
+    });
+}
+
+void PositionalEncoding::accumulate(const Eigen::Ref<const Eigen::MatrixXd>& grad, const std::vector<int>& segments,
+                                    int seq_len, Eigen::Ref<RowMajorMatrixXd> table_grad) const {
+    for_each_position(segments, grad.rows(), seq_len, [&](Eigen::Index row, int position) {
+        table_grad.row(position) += grad.row(row);
+    });
+}
+
+void PositionalEncoding::rotate(Eigen::Ref<Eigen::MatrixXd> x, int seq_len, bool inverse) const {
+    if (!rotary() || seq_len <= 0) return;
+    const int pairs = head_dim / 2;
+    const Eigen::Index rows = x.rows();
+    // Positions past the tables keep the last angle
+    const int covered = std::min(seq_len, max_positions);
+    const double direction = inverse ? -1.0 : 1.0;
+
+    // Each (sequence, pair) rotates two contiguous column segments against
+    // contiguous table columns, a loop the compiler vectorizes
+    for (Eigen::Index first = 0; first < rows; first += seq_len) {
+        const int length = static_cast<int>(std::min<Eigen::Index>(seq_len, rows - first));
+        for (Eigen::Index head = 0; head + head_dim <= x.cols(); head += head_dim) {
+            for (int j = 0; j < pairs; ++j) {
+                double* even = x.col(head + 2 * j).data() + first;
+                double* odd = x.col(head + 2 * j + 1).data() + first;
+                const double* cosines = cos_table.col(j).data();
+                const double* sines = sin_table.col(j).data();
+                const int direct = std::min(length, covered);
+                for (int i = 0; i < direct; ++i) {
+                    const double a = even[i];
+                    const double b = odd[i];
+                    const double s = direction * sines[i];
+                    even[i] = a * cosines[i] - b * s;
+                    odd[i] = a * s + b * cosines[i];
+                }
+                for (int i = direct; i < length; ++i) {
+                    const double a = even[i];
+                    const double b = odd[i];
+                    const double s = direction * sines[max_positions - 1];
+                    even[i] = a * cosines[max_positions - 1] - b * s;
+                    odd[i] = a * s + b * cosines[max_positions - 1];
+                }
+            }
+        }
+    }
+}
+
+const char* PositionalEncoding::name(PositionType type) {
+    switch (type) {
+        case PositionType::SINUSOIDAL: return "sinusoidal";
+        case PositionType::LEARNED: return "learned";
+        case PositionType::ROTARY: return "rope";
+        default: return "none";
+    }
+}
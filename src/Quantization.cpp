@@ -0,0 +1,128 @@
+#include "Quantization.h"
+#include "Arena.h"
+#include "Gemm.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+const size_t quantize_grain = 1024; // Rows per pool task
+
+int max_code(QuantizationType type) {
+    return type == QuantizationType::INT8 ? 127 : 7;
+}
+
+} // namespace
+
+QuantizedTable::QuantizedTable()
+    : type(QuantizationType::NONE), rows(0), cols(0), groups(0), group_size(0), row_bytes(0),
+      codes(nullptr), scales(nullptr) {}
+
+void QuantizedTable::set_shape(QuantizationType new_type, int new_rows, int new_cols, int new_groups) {
+    type = new_type;
+    rows = new_rows;
+    cols = new_cols;
+    groups = new_groups;
+    group_size = (cols + groups - 1) / groups;
+    row_bytes = type == QuantizationType::INT8 ? static_cast<size_t>(cols) : static_cast<size_t>(cols + 1) / 2;
+}
+
+void QuantizedTable::quantize(const double* data, int new_rows, int new_cols, QuantizationType new_type,
+                              int requested_group_size) {
+    clear();
+    if (new_type == QuantizationType::NONE || new_rows <= 0 || new_cols <= 0) return;
+    int requested = requested_group_size <= 0 ? new_cols : std::min(requested_group_size, new_cols);
+    set_shape(new_type, new_rows, new_cols, (new_cols + requested - 1) / requested);
+    owned_codes.assign(code_bytes(), 0);
+    owned_scales.assign(static_cast<size_t>(rows) * groups, 0.0f);
+
+    const int limit = max_code(type);
+    ThreadPool::instance().parallel_for(0, rows, quantize_grain, [&](size_t begin, size_t end) {
+        for (size_t r = begin; r < end; ++r) {
+            const double* row = data + r * cols;
+            uint8_t* row_out = owned_codes.data() + r * row_bytes;
+            for (int g = 0; g < groups; ++g) {
+                const int first = g * group_size;
+                const int last = std::min(cols, first + group_size);
+                double max_abs = 0.0;
+                for (int k = first; k < last; ++k) max_abs = std::max(max_abs, std::abs(row[k]));
+                const float scale = static_cast<float>(max_abs / limit);
+                owned_scales[r * groups + g] = scale;
+                const double inverse = scale > 0.0f ? 1.0 / scale : 0.0;
+                for (int k = first; k < last; ++k) {
+                    int code = static_cast<int>(std::lround(row[k] * inverse));
+                    code = std::max(-limit, std::min(limit, code));
+                    if (type == QuantizationType::INT8) {
+                        row_out[k] = static_cast<uint8_t>(static_cast<int8_t>(code));
+                    } else {
+                        row_out[k / 2] |= static_cast<uint8_t>((code & 0xF) << ((k & 1) * 4));
+                    }
+                }
+            }
+        }
+    });
+    codes = owned_codes.data();
+    scales = owned_scales.data();
+}
+
+bool QuantizedTable::attach(QuantizationType new_type, int new_rows, int new_cols, int new_groups,
+                            const uint8_t* external_codes, const float* external_scales) {
+    clear();
+    if (new_type == QuantizationType::NONE || new_rows <= 0 || new_cols <= 0 || new_groups <= 0 ||
+        new_groups > new_cols) {
+        return false;
+    }
+    set_shape(new_type, new_rows, new_cols, new_groups);
+    codes = external_codes;
+    scales = external_scales;
+    return true;
+}
+
+void QuantizedTable::clear() {
+    type = QuantizationType::NONE;
+    rows = cols = groups = group_size = 0;
+    row_bytes = 0;
+    std::vector<uint8_t>().swap(owned_codes);
+    std::vector<float>().swap(owned_scales);
+    codes = nullptr;
+    scales = nullptr;
+}
+
+void QuantizedTable::dequantize_row(int row, double* output) const {
+    const uint8_t* row_in = row_codes(row);
+    const float* row_scales = scales + static_cast<size_t>(row) * groups;
+    for (int g = 0; g < groups; ++g) {
+        const int first = g * group_size;
+        const int last = std::min(cols, first + group_size);
+        const double scale = row_scales[g];
+        if (type == QuantizationType::INT8) {
+            for (int k = first; k < last; ++k) output[k] = scale * static_cast<int8_t>(row_in[k]);
+        } else {
+            for (int k = first; k < last; ++k) {
+                // Sign-extend the nibble
+                int code = (row_in[k / 2] >> ((k & 1) * 4)) & 0xF;
+                output[k] = scale * ((code ^ 8) - 8);
+            }
+        }
+    }
+}
+
+void QuantizedTable::multiply(const Eigen::Ref<const Eigen::MatrixXd>& input, int first, int count,
+                              Eigen::Ref<Eigen::MatrixXd> output) const {
+    // Each dequantized row becomes one contiguous column of the transposed tile
+    Arena& arena = Arena::local();
+    Arena::Mark mark = arena.mark();
+    Eigen::Map<Eigen::MatrixXd> tile = arena.matrix(cols, count);
+    for (int r = 0; r < count; ++r) dequantize_row(first + r, tile.col(r).data());
+    gemm(output, input, tile);
+    arena.release(mark);
+}
+
+const char* QuantizedTable::name(QuantizationType type) {
+    switch (type) {
+        case QuantizationType::INT8: return "int8";
+        case QuantizationType::INT4: return "int4";
+        default: return "none";
+    }
+}
@@ -0,0 +1,122 @@
+#include "SequencePacker.h"
+#include "Logger.h"
+#include <algorithm>
+
+SequencePacker::SequencePacker(const PackerOptions& options)
+    : options(options), row(0), col(0), segment(0) {
+    this->options.seq_len = std::max(1, options.seq_len);
+    this->options.batch_size = std::max(1, options.batch_size);
+    this->options.bucket_width = std::max(1, options.bucket_width);
+    if (this->options.mode == PackingMode::BUCKET) {
+        int num_buckets = (this->options.seq_len + this->options.bucket_width - 1) / this->options.bucket_width;
+        buckets.resize(num_buckets);
+    }
+    current.resize(this->options.batch_size, this->options.seq_len);
+}
+
+int SequencePacker::target_for(int token) const {
+    return (token >= 0 && token < options.vocab_size) ? token : -1;
+}
+
+void SequencePacker::append_token(int token) {
+    size_t pos = static_cast<size_t>(row) * options.seq_len + col;
+    current.tokens[pos] = token;
+    current.targets[pos] = target_for(token);
+    current.segments[pos] = segment;
+    current.lengths[row] = ++col;
+
+    if (col == options.seq_len) {
+        // Row is full; a document spilling into the next row starts a fresh segment there
+        col = 0;
+        segment = 0;
+        if (++row == options.batch_size) emit_current();
+    }
+}
+
+void SequencePacker::end_document() {
+    if (options.separator_token >= 0) append_token(options.separator_token);
+    if (options.reset_attention && col > 0) ++segment;
+}
+
+void SequencePacker::emit_current() {
+    ready.push_back(std::move(current));
+    current = TokenBatch();
+    current.resize(options.batch_size, options.seq_len);
+    row = 0;
+    col = 0;
+    segment = 0;
+}
+
+void SequencePacker::add_to_bucket(std::vector<int> tokens) {
+    size_t bucket = (tokens.size() - 1) / options.bucket_width;
+    buckets[bucket].push_back(std::move(tokens));
+    if (static_cast<int>(buckets[bucket].size()) == options.batch_size) emit_bucket(bucket);
+}
+
+void SequencePacker::emit_bucket(size_t bucket) {
+    auto& sentences = buckets[bucket];
+    if (sentences.empty()) return;
+
+    // Pad to the bucket's upper bound so every batch from a bucket has one shape
+    int length = std::min(options.seq_len, static_cast<int>(bucket + 1) * options.bucket_width);
+    TokenBatch batch;
+    batch.resize(options.batch_size, length);
+    for (size_t b = 0; b < sentences.size(); ++b) {
+        size_t base = b * length;
+        for (size_t i = 0; i < sentences[b].size(); ++i) {
+            batch.tokens[base + i] = sentences[b][i];
+            batch.targets[base + i] = target_for(sentences[b][i]);
+            batch.segments[base + i] = 0;
+        }
+        batch.lengths[b] = static_cast<int>(sentences[b].size());
+    }
+    ready.push_back(std::move(batch));
+    sentences.clear();
+}
+
+void SequencePacker::add(const std::vector<int>& tokens) {
+    if (tokens.empty()) return;
+
+    switch (options.mode) {
+        case PackingMode::NONE: {
+            TokenBatch batch;
+            batch.resize(1, static_cast<int>(tokens.size()));
+            for (size_t i = 0; i < tokens.size(); ++i) {
+                batch.tokens[i] = tokens[i];
+                batch.targets[i] = target_for(tokens[i]);
+                batch.segments[i] = 0;
+            }
+            batch.lengths[0] = static_cast<int>(tokens.size());
+            ready.push_back(std::move(batch));
+            break;
+        }
+        case PackingMode::CONCATENATE:
+            for (int token : tokens) append_token(token);
+            end_document();
+            break;
+        case PackingMode::BUCKET:
+            // Sentences longer than seq_len are split into seq_len chunks
+            for (size_t start = 0; start < tokens.size(); start += options.seq_len) {
+                size_t end = std::min(tokens.size(), start + options.seq_len);
+                add_to_bucket(std::vector<int>(tokens.begin() + start, tokens.begin() + end));
+            }
+            break;
+    }
+}
+
+void SequencePacker::flush() {
+    if (options.mode == PackingMode::CONCATENATE && (row > 0 || col > 0)) {
+        emit_current();
+    } else if (options.mode == PackingMode::BUCKET) {
+        for (size_t bucket = 0; bucket < buckets.size(); ++bucket) emit_bucket(bucket);
+    }
+    Logger::get_instance().log("SequencePacker flushed, " + std::to_string(ready.size()) +
+                               " batches ready", LogLevel::DEBUG);
+}
+
+bool SequencePacker::pop(TokenBatch& batch) {
+    if (ready.empty()) return false;
+    batch = std::move(ready.front());
+    ready.pop_front();
+    return true;
+}
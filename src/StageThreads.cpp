@@ -0,0 +1,47 @@
+#include "StageThreads.h"
+
+StageThreads::StageThreads(int count) : job(nullptr), generation(0), running(0), stopping(false) {
+    for (int stage = 1; stage <= count; ++stage) threads.emplace_back(&StageThreads::worker_loop, this, stage);
+}
+
+StageThreads::~StageThreads() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    start_cv.notify_all();
+    for (auto& thread : threads) thread.join();
+}
+
+void StageThreads::worker_loop(int stage) {
+    uint64_t seen = 0;
+    while (true) {
+        const std::function<void(int)>* work;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            start_cv.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+            work = job;
+        }
+        (*work)(stage);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--running == 0) done_cv.notify_one();
+        }
+    }
+}
+
+void StageThreads::run(const std::function<void(int)>& work) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job = &work;
+        running = size();
+        ++generation;
+    }
+    start_cv.notify_all();
+    work(0);
+    std::unique_lock<std::mutex> lock(mutex);
+    done_cv.wait(lock, [&] { return running == 0; });
+    job = nullptr;
+}
@@ -0,0 +1,233 @@
+#include "ThreadPool.h"
+#include "Logger.h"
+#include "Numa.h"
+#include <Eigen/Core>
+#include <algorithm>
+#include <chrono>
+
+namespace {
+
+thread_local int worker_index = -1; // Index of the calling pool worker, or -1
+
+const size_t max_chunks_per_thread = 4; // Enough slack for stealing to balance uneven chunks
+
+} // namespace
+
+ThreadPool::ThreadPool() : numa_enabled(false), numa_node(-1), stopping(false), queued(0), sleeping(0) {
+    unsigned int hardware = std::thread::hardware_concurrency();
+    start(hardware > 0 ? static_cast<int>(hardware) : 1);
+}
+
+ThreadPool::~ThreadPool() {
+    stop();
+}
+
+ThreadPool& ThreadPool::instance() {
+    static ThreadPool pool;
+    return pool;
+}
+
+void ThreadPool::set_num_threads(int num_threads) {
+    ThreadPool& pool = instance();
+    pool.stop();
+    pool.start(std::max(1, num_threads));
+}
+
+void ThreadPool::set_numa(bool enabled, int node) {
+    ThreadPool& pool = instance();
+    int num_threads = pool.get_num_threads();
+    pool.stop();
+    pool.numa_enabled = enabled && Numa::is_numa();
+    pool.numa_node = pool.numa_enabled && node >= 0 ? node % Numa::num_nodes() : -1;
+    pool.start(num_threads);
+}
+
+int ThreadPool::current_node() {
+    ThreadPool& pool = instance();
+    if (!pool.numa_enabled) return 0;
+    if (worker_index >= 0) return pool.worker_nodes[worker_index];
+    return Numa::current_node();
+}
+
+void ThreadPool::start(int num_threads) {
+    // Kernels are parallelized here, so keep Eigen from adding its own threads on top
+    Eigen::setNbThreads(1);
+    stopping = false;
+    queues.clear();
+    worker_nodes.clear();
+    for (int i = 0; i + 1 < num_threads; ++i) queues.push_back(std::make_unique<TaskQueue>());
+    if (numa_enabled) {
+        // The calling thread counts as thread 0 of the first node's block
+        for (int i = 0; i + 1 < num_threads; ++i) {
+            worker_nodes.push_back(numa_node >= 0 ? numa_node : (i + 1) * Numa::num_nodes() / num_threads);
+        }
+        Numa::pin_thread(numa_node >= 0 ? numa_node : 0);
+    } else {
+        worker_nodes.assign(queues.size(), 0);
+    }
+    for (int i = 0; i + 1 < num_threads; ++i) workers.emplace_back(&ThreadPool::worker_loop, this, i);
+    Logger::get_instance().log("Thread pool running with " + std::to_string(num_threads) + " threads", LogLevel::INFO);
+}
+
+void ThreadPool::stop() {
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        stopping = true;
+    }
+    sleep_cv.notify_all();
+    for (auto& worker : workers) worker.join();
+    workers.clear();
+}
+
+void ThreadPool::TaskQueue::push_back(Task&& task) {
+    if (count == slots.size()) {
+        // Unroll into a buffer twice the size
+        std::vector<Task> grown(std::max<size_t>(16, 2 * slots.size()));
+        for (size_t i = 0; i < count; ++i) grown[i] = std::move(slots[(head + i) % slots.size()]);
+        slots.swap(grown);
+        head = 0;
+    }
+    slots[(head + count) % slots.size()] = std::move(task);
+    ++count;
+}
+
+bool ThreadPool::TaskQueue::pop(bool back, Task& task) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (count == 0) return false;
+    if (back) {
+        task = std::move(slots[(head + count - 1) % slots.size()]);
+    } else {
+        task = std::move(slots[head]);
+        head = (head + 1) % slots.size();
+    }
+    --count;
+    return true;
+}
+
+void ThreadPool::push(Task&& task) {
+    TaskQueue& queue = worker_index >= 0 ? *queues[worker_index] : injection;
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.push_back(std::move(task));
+    }
+    queued.fetch_add(1, std::memory_order_release);
+    if (sleeping.load(std::memory_order_acquire) > 0) {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        sleep_cv.notify_one();
+    }
+}
+
+bool ThreadPool::try_run_one() {
+    if (queued.load(std::memory_order_acquire) == 0) return false;
+    Task task;
+    // Own work newest first (still in cache), then injected work, then steal the
+    // oldest, from workers on the same node before crossing the interconnect
+    bool found = worker_index >= 0 && queues[worker_index]->pop(true, task);
+    if (!found) found = injection.pop(false, task);
+    const int node = worker_index >= 0 ? worker_nodes[worker_index] : 0;
+    for (int pass = numa_enabled ? 0 : 1; !found && pass < 2; ++pass) {
+        for (size_t i = 1; !found && i <= queues.size(); ++i) {
+            size_t victim = (static_cast<size_t>(worker_index + 1) + i) % queues.size();
+            if (pass == 0 && worker_nodes[victim] != node) continue;
+            found = queues[victim]->pop(false, task);
+        }
+    }
+    if (!found) return false;
+    queued.fetch_sub(1, std::memory_order_relaxed);
+    if (task.range) {
+        task.range(task.body, task.begin, task.end);
+    } else {
+        task.function();
+    }
+    task.pending->fetch_sub(1, std::memory_order_acq_rel);
+    return true;
+}
+
+void ThreadPool::worker_loop(int index) {
+    worker_index = index;
+    if (numa_enabled) Numa::pin_thread(worker_nodes[index]);
+    int idle = 0;
+    while (!stopping.load(std::memory_order_acquire)) {
+        if (try_run_one()) {
+            idle = 0;
+            continue;
+        }
+        if (++idle < 256) {
+            std::this_thread::yield();
+            continue;
+        }
+        // Nothing to do for a while: sleep until a task is pushed
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        sleeping.fetch_add(1, std::memory_order_acq_rel);
+        sleep_cv.wait_for(lock, std::chrono::milliseconds(10), [this] {
+            return stopping.load(std::memory_order_acquire) || queued.load(std::memory_order_acquire) > 0;
+        });
+        sleeping.fetch_sub(1, std::memory_order_acq_rel);
+        idle = 0;
+    }
+    worker_index = -1;
+}
+
+void ThreadPool::TaskGroup::run(std::function<void()> task) {
+    pending.fetch_add(1, std::memory_order_acq_rel);
+    Task queued_task;
+    queued_task.function = std::move(task);
+    queued_task.pending = &pending;
+    pool.push(std::move(queued_task));
+}
+
+void ThreadPool::TaskGroup::wait() {
+    int attempt = 0;
+    while (pending.load(std::memory_order_acquire) > 0) {
+        if (pool.try_run_one()) {
+            attempt = 0;
+        } else if (++attempt > 64) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+size_t ThreadPool::chunk_grain(size_t count, size_t grain) const {
+    grain = std::max<size_t>(grain, 1);
+    size_t max_chunks = max_chunks_per_thread * static_cast<size_t>(get_num_threads());
+    if ((count + grain - 1) / grain > max_chunks) grain = (count + max_chunks - 1) / max_chunks;
+    return grain;
+}
+
+size_t ThreadPool::max_chunk(size_t count, size_t grain) const {
+    grain = chunk_grain(count, grain);
+    return workers.empty() || count <= grain ? count : grain;
+}
+
+void ThreadPool::run_range(size_t begin, size_t end, size_t grain, RangeFunction range, const void* body) {
+    if (end <= begin) return;
+    const size_t count = end - begin;
+    grain = chunk_grain(count, grain);
+    if (workers.empty() || count <= grain) {
+        range(body, begin, end);
+        return;
+    }
+
+    std::atomic<int> pending(0);
+    for (size_t chunk = begin + grain; chunk < end; chunk += grain) {
+        Task task;
+        task.range = range;
+        task.body = body;
+        task.begin = chunk;
+        task.end = std::min(end, chunk + grain);
+        task.pending = &pending;
+        pending.fetch_add(1, std::memory_order_acq_rel);
+        push(std::move(task));
+    }
+    range(body, begin, begin + grain);
+
+    // Help with queued tasks until every chunk is done
+    int attempt = 0;
+    while (pending.load(std::memory_order_acquire) > 0) {
+        if (try_run_one()) {
+            attempt = 0;
+        } else if (++attempt > 64) {
+            std::this_thread::yield();
+        }
+    }
+}
@@ -1,5 +1,7 @@
 #include "Tokenizer.h"
 #include "Logger.h"
+#include <algorithm>
+#include <numeric>
 
 // Constructor
 Tokenizer::Tokenizer(const std::string& delim) : delimiter(delim) {
@@ -10,21 +12,26 @@ Tokenizer::Tokenizer(const std::string& delim) : delimiter(delim) {
 void Tokenizer::build_vocab(const std::vector<std::string>& corpus) {
     Logger::get_instance().log("Building vocabulary from corpus", LogLevel::INFO);
 
-    int id = 0;
     for (const auto& sentence : corpus) {
-        std::istringstream stream(sentence);
-        std::string word;
-        while (std::getline(stream, word, delimiter[0])) {
-            if (vocab.find(word) == vocab.end()) {
-                vocab[word] = id++;
-                Logger::get_instance().log("Added word to vocab: '" + word + "' with ID: " + std::to_string(id - 1), LogLevel::DEBUG);
-            }
-        }
+        add_to_vocab(sentence);
     }
 
     Logger::get_instance().log("Vocabulary built with " + std::to_string(vocab.size()) + " unique tokens", LogLevel::INFO);
 }
 
+// Add the words of one sentence to the vocabulary
+void Tokenizer::add_to_vocab(const std::string& sentence) {
+    std::istringstream stream(sentence);
+    std::string word;
+    while (std::getline(stream, word, delimiter[0])) {
+        if (vocab.find(word) == vocab.end()) {
+            int id = static_cast<int>(vocab.size());
+            vocab[word] = id;
+            Logger::get_instance().log("Added word to vocab: '" + word + "' with ID: " + std::to_string(id), LogLevel::DEBUG);
+        }
+    }
+}
+
 // Tokenize a given input string into token IDs
 std::vector<int> Tokenizer::tokenize(const std::string& text) const {
     Logger::get_instance().log("Tokenizing input text: '" + text + "'", LogLevel::DEBUG);
@@ -47,3 +54,39 @@ std::vector<int> Tokenizer::tokenize(const std::string& text) const {
     Logger::get_instance().log("Tokenization completed. Total tokens: " + std::to_string(token_ids.size()), LogLevel::INFO);
     return token_ids;
 }
+
+// ID of a single word, or -1 if it is not in the vocabulary
+int Tokenizer::lookup(const std::string& word) const {
+    auto it = vocab.find(word);
+    return (it != vocab.end()) ? it->second : -1;
+}
+
+// Vocabulary words ordered by ID
+std::vector<std::string> Tokenizer::words() const {
+    std::vector<std::string> result(vocab.size());
+    for (const auto& entry : vocab) {
+        result[entry.second] = entry.first;
+    }
+    return result;
+}
+
+// Replace the vocabulary; words[i] gets ID i
+void Tokenizer::set_vocab(const std::vector<std::string>& words) {
+    vocab.clear();
+    for (size_t i = 0; i < words.size(); ++i) {
+        vocab[words[i]] = static_cast<int>(i);
+    }
+    Logger::get_instance().log("Vocabulary restored with " + std::to_string(vocab.size()) + " tokens", LogLevel::INFO);
+}
+
+// Renumber the vocabulary by decreasing frequency
+void Tokenizer::sort_by_frequency(const std::vector<long>& counts) {
+    std::vector<std::string> old_words = words();
+    std::vector<int> order(old_words.size());
+    std::iota(order.begin(), order.end(), 0);
+    auto count = [&](int id) { return static_cast<size_t>(id) < counts.size() ? counts[id] : 0L; };
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return count(a) > count(b); });
+    for (size_t i = 0; i < order.size(); ++i) vocab[old_words[order[i]]] = static_cast<int>(i);
+    Logger::get_instance().log("Vocabulary of " + std::to_string(vocab.size()) + " tokens renumbered by frequency",
+                               LogLevel::INFO);
+}
@@ -1,10 +1,48 @@
 #include "TransformerBlock.h"
+#include "Arena.h"
+#include "Gemm.h"
 #include "Logger.h"
+#include "ThreadPool.h"
+#include <algorithm>
 #include <cmath>
+#include <limits>
 
-TransformerBlock::TransformerBlock(int embedding_dim, int num_heads, int feedforward_dim)
-    : embedding_dim(embedding_dim), num_heads(num_heads), feedforward_dim(feedforward_dim) {
+TransformerBlock::TransformerBlock(int embedding_dim, int num_heads, int feedforward_dim,
+                                   ParameterStore& store, const std::string& prefix)
+    : embedding_dim(embedding_dim), num_heads(num_heads), feedforward_dim(feedforward_dim), store(&store),
+      W_q(nullptr, 0, 0), W_k(nullptr, 0, 0), W_v(nullptr, 0, 0), W_o(nullptr, 0, 0),
+      W1(nullptr, 0, 0), W2(nullptr, 0, 0), b1(nullptr, 0), b2(nullptr, 0), tensor_parallel(1), recompute(false),
+      positional(nullptr) {
     Logger::get_instance().log("Initializing TransformerBlock", LogLevel::INFO);
+    if (num_heads <= 0 || embedding_dim % num_heads != 0) {
+        Logger::get_instance().log("embedding_dim " + std::to_string(embedding_dim) + " is not divisible by num_heads " +
+                                   std::to_string(num_heads) + ". Using a single attention head.", LogLevel::WARNING);
+        this->num_heads = 1;
+    }
+
+    tensor_ids[T_W_Q] = store.add(prefix + "W_q", embedding_dim, embedding_dim);
+    tensor_ids[T_W_K] = store.add(prefix + "W_k", embedding_dim, embedding_dim);
+    tensor_ids[T_W_V] = store.add(prefix + "W_v", embedding_dim, embedding_dim);
+    tensor_ids[T_W_O] = store.add(prefix + "W_o", embedding_dim, embedding_dim);
+    tensor_ids[T_W1] = store.add(prefix + "W1", feedforward_dim, embedding_dim);
+    tensor_ids[T_W2] = store.add(prefix + "W2", embedding_dim, feedforward_dim);
+    tensor_ids[T_B1] = store.add(prefix + "b1", feedforward_dim, 1);
+    tensor_ids[T_B2] = store.add(prefix + "b2", embedding_dim, 1);
+}
+
+void TransformerBlock::bind_views() {
+    store->bind(W_q, tensor_ids[T_W_Q]);
+    store->bind(W_k, tensor_ids[T_W_K]);
+    store->bind(W_v, tensor_ids[T_W_V]);
+    store->bind(W_o, tensor_ids[T_W_O]);
+    store->bind(W1, tensor_ids[T_W1]);
+    store->bind(W2, tensor_ids[T_W2]);
+    store->bind(b1, tensor_ids[T_B1]);
+    store->bind(b2, tensor_ids[T_B2]);
+}
+
+void TransformerBlock::initialize() {
+    bind_views();
 
     // Initialize parameters for multi-head attention
     W_q = Eigen::MatrixXd::Random(embedding_dim, embedding_dim) * 0.01;
@@ -21,42 +59,393 @@ TransformerBlock::TransformerBlock(int embedding_dim, int num_heads, int feedfor
     Logger::get_instance().log("Initialized feed-forward network parameters", LogLevel::DEBUG);
 }
 
-Eigen::MatrixXd TransformerBlock::scaled_dot_product_attention(
-    const Eigen::MatrixXd& Q, const Eigen::MatrixXd& K, const Eigen::MatrixXd& V) {
+void TransformerBlock::scaled_dot_product_attention(
+    const Eigen::Ref<const Eigen::MatrixXd>& Q, const Eigen::Ref<const Eigen::MatrixXd>& K,
+    const Eigen::Ref<const Eigen::MatrixXd>& V, const int* segments, int head_begin, int head_end,
+    Eigen::Ref<Eigen::MatrixXd> output, Eigen::Ref<Eigen::MatrixXd> weights) {
     Logger::get_instance().log("Performing scaled dot-product attention", LogLevel::DEBUG);
 
-    Eigen::MatrixXd scores = Q * K.transpose() / std::sqrt(static_cast<double>(embedding_dim));
-    Eigen::MatrixXd exp_scores = scores.array().exp();
-    Eigen::VectorXd row_sums = exp_scores.rowwise().sum();
-    Eigen::MatrixXd attention_weights = exp_scores.array().colwise() / row_sums.array();
+    const int head_dim = embedding_dim / num_heads;
+    const Eigen::Index seq_len = Q.rows();
+    const double scale = 1.0 / std::sqrt(static_cast<double>(head_dim));
+    const double masked = -std::numeric_limits<double>::infinity();
+    Arena& arena = Arena::local();
+    const Arena::Mark mark = arena.mark();
+    Eigen::Map<Eigen::VectorXd> row_max(arena.allocate(seq_len), seq_len);
+    Eigen::Map<Eigen::VectorXd> row_sums(arena.allocate(seq_len), seq_len);
+
+    for (int h = head_begin; h < head_end; ++h) {
+        // Scores are turned into weights in place
+        auto P = weights.middleRows(h * seq_len, seq_len);
+        gemm(P, Q.middleCols(h * head_dim, head_dim), K.middleCols(h * head_dim, head_dim).transpose());
+        P *= scale;
+        if (segments) {
+            // Padding and attention resets: mask out keys from other segments (each row keeps itself)
+            for (Eigen::Index i = 0; i < seq_len; ++i) {
+                for (Eigen::Index j = 0; j < seq_len; ++j) {
+                    if (i != j && (segments[j] < 0 || segments[i] != segments[j])) P(i, j) = masked;
+                }
+            }
+        }
+        row_max = P.rowwise().maxCoeff();
+        P = (P.colwise() - row_max).array().exp();
+        row_sums = P.rowwise().sum();
+        P = P.array().colwise() / row_sums.array();
+        gemm(output.middleCols(h * head_dim, head_dim), P, V.middleCols(h * head_dim, head_dim));
+    }
+    arena.release(mark);
     Logger::get_instance().log("Computed attention weights", LogLevel::DEBUG);
+}
 
-    return attention_weights * V;
+Eigen::MatrixXd TransformerBlock::forward(const Eigen::MatrixXd& input, const std::vector<int>& segments) {
+    // Scoped to this call, so arena memory the caller holds stays valid
+    Arena& arena = Arena::local();
+    const Arena::Mark mark = arena.mark();
+    Eigen::MatrixXd output = forward(input, 1, static_cast<int>(input.rows()), segments);
+    arena.release(mark);
+    return output;
 }
 
-Eigen::MatrixXd TransformerBlock::forward(const Eigen::MatrixXd& input) {
+void TransformerBlock::bind_cache(Cache& cache, const Eigen::Ref<const Eigen::MatrixXd>& input, int batch_size,
+                                  int seq_len, bool keep_input) {
+    Arena& arena = Arena::local();
+    const Eigen::Index rows = input.rows();
+    cache.batch_size = batch_size;
+    cache.seq_len = seq_len;
+    cache.checkpointed = false;
+    if (keep_input) {
+        arena.bind(cache.input, rows, embedding_dim);
+        cache.input = input;
+    }
+    arena.bind(cache.Q, rows, embedding_dim);
+    arena.bind(cache.K, rows, embedding_dim);
+    arena.bind(cache.V, rows, embedding_dim);
+    arena.bind(cache.attention_weights, static_cast<Eigen::Index>(batch_size) * num_heads * seq_len, seq_len);
+    arena.bind(cache.attention_output, rows, embedding_dim);
+    arena.bind(cache.residual_output, rows, embedding_dim);
+    arena.bind(cache.hidden, rows, feedforward_dim);
+}
+
+Eigen::Map<Eigen::MatrixXd> TransformerBlock::forward(const Eigen::Ref<const Eigen::MatrixXd>& input, int batch_size,
+                                                      int seq_len, const std::vector<int>& segments, Cache* cache) {
     Logger::get_instance().log("Starting forward pass of TransformerBlock", LogLevel::INFO);
+    if (cache && recompute) return forward_checkpointed(input, batch_size, seq_len, segments, *cache);
+    if (cache) {
+        bind_cache(*cache, input, batch_size, seq_len, true);
+        return compute(input, segments, *cache);
+    }
+
+    // Without a cache the activations are scratch, released before returning
+    Arena& arena = Arena::local();
+    Eigen::Map<Eigen::MatrixXd> output = arena.matrix(input.rows(), embedding_dim);
+    const Arena::Mark mark = arena.mark();
+    Cache scratch;
+    bind_cache(scratch, input, batch_size, seq_len, false);
+    output = compute(input, segments, scratch);
+    arena.release(mark);
+    return output;
+}
+
+Eigen::Map<Eigen::MatrixXd> TransformerBlock::forward_checkpointed(const Eigen::Ref<const Eigen::MatrixXd>& input,
+                                                                   int batch_size, int seq_len,
+                                                                   const std::vector<int>& segments, Cache& cache) {
+    // Only the input is saved; everything else is scratch released before returning
+    Arena& arena = Arena::local();
+    cache.batch_size = batch_size;
+    cache.seq_len = seq_len;
+    cache.checkpointed = true;
+    cache.segments = segments.empty() ? nullptr : &segments;
+    arena.bind(cache.input, input.rows(), embedding_dim);
+    cache.input = input;
+
+    Eigen::Map<Eigen::MatrixXd> output = arena.matrix(input.rows(), embedding_dim);
+    const Arena::Mark mark = arena.mark();
+    Cache scratch;
+    bind_cache(scratch, input, batch_size, seq_len, false);
+    output = compute(input, segments, scratch);
+    arena.release(mark);
+    return output;
+}
+
+Eigen::Map<Eigen::MatrixXd> TransformerBlock::compute(const Eigen::Ref<const Eigen::MatrixXd>& input,
+                                                      const std::vector<int>& segments, Cache& c) {
+    if (tensor_parallel > 1) return forward_tensor_parallel(input, segments, c);
+    const int batch_size = c.batch_size;
+    const int seq_len = c.seq_len;
 
-    // Multi-head attention
-    Eigen::MatrixXd Q = input * W_q;
-    Eigen::MatrixXd K = input * W_k;
-    Eigen::MatrixXd V = input * W_v;
+    // Projections run as one (batch_size * seq_len) x embedding_dim GEMM each
+    gemm(c.Q, input, W_q);
+    gemm(c.K, input, W_k);
+    gemm(c.V, input, W_v);
+    if (positional) {
+        positional->rotate(c.Q, seq_len, false);
+        positional->rotate(c.K, seq_len, false);
+    }
     Logger::get_instance().log("Computed Q, K, V matrices", LogLevel::DEBUG);
 
-    Eigen::MatrixXd attention_output = scaled_dot_product_attention(Q, K, V);
-    Eigen::MatrixXd multi_head_output = attention_output * W_o;
+    // Multi-head attention, separately for each sequence; every (sequence, head)
+    // pair writes its own block of attention_output
+    const Eigen::Index sequence_rows = static_cast<Eigen::Index>(num_heads) * seq_len;
+    ThreadPool::instance().parallel_for(0, static_cast<size_t>(batch_size) * num_heads, 1,
+                                        [&](size_t pair_begin, size_t pair_end) {
+        for (size_t pair = pair_begin; pair < pair_end; ++pair) {
+            const int b = static_cast<int>(pair / num_heads);
+            const int h = static_cast<int>(pair % num_heads);
+            const int* sequence_segments = segments.empty() ? nullptr : segments.data() + static_cast<size_t>(b) * seq_len;
+            scaled_dot_product_attention(
+                c.Q.middleRows(b * seq_len, seq_len), c.K.middleRows(b * seq_len, seq_len),
+                c.V.middleRows(b * seq_len, seq_len), sequence_segments, h, h + 1,
+                c.attention_output.middleRows(b * seq_len, seq_len),
+                c.attention_weights.middleRows(b * sequence_rows, sequence_rows));
+        }
+    });
+    gemm(c.residual_output, c.attention_output, W_o);
     Logger::get_instance().log("Computed multi-head attention output", LogLevel::DEBUG);
 
     // Residual connection and feed-forward network
-    Eigen::MatrixXd residual_output = multi_head_output + input;
+    c.residual_output += input;
     Logger::get_instance().log("Added residual connection to multi-head attention output", LogLevel::DEBUG);
 
-    Eigen::MatrixXd hidden = (W1 * residual_output.transpose()).colwise() + b1;
-    hidden = hidden.array().max(0.0);  // ReLU activation
+    gemm(c.hidden, c.residual_output, W1.transpose());
+    c.hidden.rowwise() += b1.transpose();
+    c.hidden = c.hidden.array().max(0.0);  // ReLU activation
     Logger::get_instance().log("Applied ReLU activation in feed-forward network", LogLevel::DEBUG);
 
-    Eigen::MatrixXd output = (W2 * hidden).colwise() + b2;
+    Eigen::Map<Eigen::MatrixXd> output = Arena::local().matrix(input.rows(), embedding_dim);
+    gemm(output, c.hidden, W2.transpose());
+    output.rowwise() += b2.transpose();
     Logger::get_instance().log("Computed output of feed-forward network", LogLevel::DEBUG);
 
-    return output.transpose() + residual_output;  // Residual connection
+    output += c.residual_output;  // Residual connection
+    return output;
+}
+
+Eigen::Map<Eigen::MatrixXd> TransformerBlock::forward_tensor_parallel(const Eigen::Ref<const Eigen::MatrixXd>& input,
+                                                                      const std::vector<int>& segments, Cache& c) {
+    const int parts = tensor_parallel;
+    const int batch_size = c.batch_size;
+    const int seq_len = c.seq_len;
+    const int head_dim = embedding_dim / num_heads;
+    const Eigen::Index rows = input.rows();
+    const Eigen::Index sequence_rows = static_cast<Eigen::Index>(num_heads) * seq_len;
+    const size_t row_grain = 16;
+    ThreadPool& pool = ThreadPool::instance();
+    Arena& arena = Arena::local();
+
+    // Every part writes disjoint columns of the activations; partial sums are per part
+    Eigen::Map<Eigen::MatrixXd> output = arena.matrix(rows, embedding_dim);
+    double* partial_data = arena.allocate(static_cast<size_t>(parts) * rows * embedding_dim);
+    auto partial = [&](size_t part) {
+        return Eigen::Map<Eigen::MatrixXd>(partial_data + part * rows * embedding_dim, rows, embedding_dim);
+    };
+
+    // Attention for each part's heads, and their share of the W_o product
+    pool.parallel_for(0, parts, 1, [&](size_t part_begin, size_t part_end) {
+        for (size_t part = part_begin; part < part_end; ++part) {
+            const int head_begin = num_heads * static_cast<int>(part) / parts;
+            const int head_end = num_heads * static_cast<int>(part + 1) / parts;
+            const int col = head_begin * head_dim;
+            const int width = (head_end - head_begin) * head_dim;
+            gemm(c.Q.middleCols(col, width), input, W_q.middleCols(col, width));
+            gemm(c.K.middleCols(col, width), input, W_k.middleCols(col, width));
+            gemm(c.V.middleCols(col, width), input, W_v.middleCols(col, width));
+            if (positional) {
+                positional->rotate(c.Q.middleCols(col, width), seq_len, false);
+                positional->rotate(c.K.middleCols(col, width), seq_len, false);
+            }
+            for (int b = 0; b < batch_size; ++b) {
+                const int* sequence_segments = segments.empty() ? nullptr : segments.data() + static_cast<size_t>(b) * seq_len;
+                scaled_dot_product_attention(
+                    c.Q.middleRows(b * seq_len, seq_len), c.K.middleRows(b * seq_len, seq_len),
+                    c.V.middleRows(b * seq_len, seq_len), sequence_segments, head_begin, head_end,
+                    c.attention_output.middleRows(b * seq_len, seq_len),
+                    c.attention_weights.middleRows(b * sequence_rows, sequence_rows));
+            }
+            auto sum = partial(part);
+            sum.setZero();
+            if (width > 0) gemm(sum, c.attention_output.middleCols(col, width), W_o.middleRows(col, width));
+        }
+    });
+
+    // Reduction 1, by rows: residual = input + sum of partials
+    pool.parallel_for(0, rows, row_grain, [&](size_t row_begin, size_t row_end) {
+        const Eigen::Index count = static_cast<Eigen::Index>(row_end - row_begin);
+        c.residual_output.middleRows(row_begin, count) = input.middleRows(row_begin, count);
+        for (int part = 0; part < parts; ++part) {
+            c.residual_output.middleRows(row_begin, count) += partial(part).middleRows(row_begin, count);
+        }
+    });
+
+    // FFN for each part's rows of W1 and columns of W2
+    pool.parallel_for(0, parts, 1, [&](size_t part_begin, size_t part_end) {
+        for (size_t part = part_begin; part < part_end; ++part) {
+            const int ff_begin = feedforward_dim * static_cast<int>(part) / parts;
+            const int ff_width = feedforward_dim * static_cast<int>(part + 1) / parts - ff_begin;
+            auto hidden = c.hidden.middleCols(ff_begin, ff_width);
+            gemm(hidden, c.residual_output, W1.middleRows(ff_begin, ff_width).transpose());
+            hidden.rowwise() += b1.segment(ff_begin, ff_width).transpose();
+            hidden = hidden.array().max(0.0);
+            auto sum = partial(part);
+            sum.setZero();
+            if (ff_width > 0) gemm(sum, hidden, W2.middleCols(ff_begin, ff_width).transpose());
+        }
+    });
+
+    // Reduction 2, by rows: output = residual + b2 + sum of partials
+    pool.parallel_for(0, rows, row_grain, [&](size_t row_begin, size_t row_end) {
+        const Eigen::Index count = static_cast<Eigen::Index>(row_end - row_begin);
+        output.middleRows(row_begin, count) = c.residual_output.middleRows(row_begin, count).rowwise() + b2.transpose();
+        for (int part = 0; part < parts; ++part) {
+            output.middleRows(row_begin, count) += partial(part).middleRows(row_begin, count);
+        }
+    });
+    if (Logger::get_instance().enabled(LogLevel::DEBUG)) {
+        Logger::get_instance().log("Computed tensor-parallel forward in " + std::to_string(parts) + " parts",
+                                   LogLevel::DEBUG);
+    }
+    return output;
+}
+
+Eigen::Map<Eigen::MatrixXd> TransformerBlock::backward(const Cache& cache,
+                                                       const Eigen::Ref<const Eigen::MatrixXd>& grad_output,
+                                                       double* grad_base) {
+    Eigen::Map<Eigen::MatrixXd> grad_input = Arena::local().matrix(grad_output.rows(), embedding_dim);
+    backward(cache, grad_output, grad_input, grad_base);
+    return grad_input;
+}
+
+void TransformerBlock::backward(const Cache& saved, const Eigen::Ref<const Eigen::MatrixXd>& grad_output,
+                                Eigen::Ref<Eigen::MatrixXd> grad_input, double* grad_base) {
+    Logger::get_instance().log("Starting backward pass of TransformerBlock", LogLevel::DEBUG);
+    Arena& arena = Arena::local();
+    const Arena::Mark mark = arena.mark();
+
+    // A checkpointed block runs its forward again from the saved input; the
+    // recomputed activations are scratch of this pass
+    Cache recomputed;
+    if (saved.checkpointed) {
+        static const std::vector<int> no_segments;
+        bind_cache(recomputed, saved.input, saved.batch_size, saved.seq_len, false);
+        Arena::rebind(recomputed.input, saved.input);
+        compute(saved.input, saved.segments ? *saved.segments : no_segments, recomputed);
+    }
+    const Cache& cache = saved.checkpointed ? recomputed : saved;
+    const Eigen::Index rows = grad_output.rows();
+    auto grad_W_q = store->grad_view(tensor_ids[T_W_Q], grad_base);
+    auto grad_W_k = store->grad_view(tensor_ids[T_W_K], grad_base);
+    auto grad_W_v = store->grad_view(tensor_ids[T_W_V], grad_base);
+    auto grad_W_o = store->grad_view(tensor_ids[T_W_O], grad_base);
+    auto grad_W1 = store->grad_view(tensor_ids[T_W1], grad_base);
+    auto grad_W2 = store->grad_view(tensor_ids[T_W2], grad_base);
+    auto grad_b1 = store->grad_view(tensor_ids[T_B1], grad_base);
+    auto grad_b2 = store->grad_view(tensor_ids[T_B2], grad_base);
+
+    // Feed-forward network: output = relu(R * W1^T + b1) * W2^T + b2 + R
+    gemm_add(grad_W2, grad_output.transpose(), cache.hidden);
+    grad_b2 += grad_output.colwise().sum().transpose();
+    Eigen::Map<Eigen::MatrixXd> grad_hidden = arena.matrix(rows, feedforward_dim);
+    gemm(grad_hidden, grad_output, W2);
+    grad_hidden.array() *= (cache.hidden.array() > 0.0).cast<double>();
+    gemm_add(grad_W1, grad_hidden.transpose(), cache.residual_output);
+    grad_b1 += grad_hidden.colwise().sum().transpose();
+    Eigen::Map<Eigen::MatrixXd> grad_residual = arena.matrix(rows, embedding_dim);
+    gemm(grad_residual, grad_hidden, W1);
+    grad_residual += grad_output;
+
+    // Attention output projection: R = A * W_o + input
+    gemm_add(grad_W_o, cache.attention_output.transpose(), grad_residual);
+    Eigen::Map<Eigen::MatrixXd> grad_attention = arena.matrix(rows, embedding_dim);
+    gemm(grad_attention, grad_residual, W_o.transpose());
+
+    // Per sequence and head: A = P * V, P = softmax(Q * K^T * scale)
+    const int head_dim = embedding_dim / num_heads;
+    const double scale = 1.0 / std::sqrt(static_cast<double>(head_dim));
+    const int seq_len = cache.seq_len;
+    Eigen::Map<Eigen::MatrixXd> grad_Q = arena.matrix(rows, embedding_dim);
+    Eigen::Map<Eigen::MatrixXd> grad_K = arena.matrix(rows, embedding_dim);
+    Eigen::Map<Eigen::MatrixXd> grad_V = arena.matrix(rows, embedding_dim);
+    ThreadPool::instance().parallel_for(0, static_cast<size_t>(cache.batch_size) * num_heads, 1,
+                                        [&](size_t pair_begin, size_t pair_end) {
+        // Scratch from the arena of the thread running this chunk
+        Arena& local = Arena::local();
+        const Arena::Mark chunk_mark = local.mark();
+        Eigen::Map<Eigen::MatrixXd> grad_scores = local.matrix(seq_len, seq_len);
+        Eigen::Map<Eigen::VectorXd> row_dot(local.allocate(seq_len), seq_len);
+        for (size_t pair = pair_begin; pair < pair_end; ++pair) {
+            const int b = static_cast<int>(pair / num_heads);
+            const int h = static_cast<int>(pair % num_heads);
+            auto P = cache.attention_weights.middleRows(static_cast<Eigen::Index>(pair) * seq_len, seq_len);
+            auto dA = grad_attention.block(b * seq_len, h * head_dim, seq_len, head_dim);
+            auto Qh = cache.Q.block(b * seq_len, h * head_dim, seq_len, head_dim);
+            auto Kh = cache.K.block(b * seq_len, h * head_dim, seq_len, head_dim);
+            auto Vh = cache.V.block(b * seq_len, h * head_dim, seq_len, head_dim);
+
+            gemm(grad_scores, dA, Vh.transpose()); // Gradient w.r.t. P
+            gemm(grad_V.block(b * seq_len, h * head_dim, seq_len, head_dim), P.transpose(), dA);
+            // Softmax backward; masked entries have P = 0 and get no gradient
+            row_dot = (grad_scores.array() * P.array()).rowwise().sum();
+            grad_scores = (P.array() * (grad_scores.colwise() - row_dot).array()) * scale;
+            gemm(grad_Q.block(b * seq_len, h * head_dim, seq_len, head_dim), grad_scores, Kh);
+            gemm(grad_K.block(b * seq_len, h * head_dim, seq_len, head_dim), grad_scores.transpose(), Qh);
+        }
+        local.release(chunk_mark);
+    });
+
+    // Rotary positions: Q and K were rotated after projection, so their
+    // gradients rotate back
+    if (positional) {
+        positional->rotate(grad_Q, seq_len, true);
+        positional->rotate(grad_K, seq_len, true);
+    }
+
+    // Projections: Q = input * W_q, K = input * W_k, V = input * W_v
+    gemm_add(grad_W_q, cache.input.transpose(), grad_Q);
+    gemm_add(grad_W_k, cache.input.transpose(), grad_K);
+    gemm_add(grad_W_v, cache.input.transpose(), grad_V);
+    gemm(grad_input, grad_Q, W_q.transpose());
+    grad_input += grad_residual;
+    gemm_add(grad_input, grad_K, W_k.transpose());
+    gemm_add(grad_input, grad_V, W_v.transpose());
+    arena.release(mark);
+
+    Logger::get_instance().log("Completed backward pass of TransformerBlock", LogLevel::DEBUG);
+}
+
+size_t TransformerBlock::forward_output_size(int batch_size, int seq_len) const {
+    const size_t activation = static_cast<size_t>(batch_size) * seq_len * embedding_dim;
+    const size_t output = AlignedBuffer::padded(activation);
+    return tensor_parallel > 1 ? output + AlignedBuffer::padded(tensor_parallel * activation) : output;
+}
+
+size_t TransformerBlock::forward_scratch_size(int batch_size, int seq_len) const {
+    const Eigen::Index rows = static_cast<Eigen::Index>(batch_size) * seq_len;
+    const int head_dim = embedding_dim / num_heads;
+    // One head's row maxima and sums, and its two products
+    size_t scratch = 2 * AlignedBuffer::padded(seq_len) +
+                     std::max(gemm_scratch_size(seq_len, seq_len, head_dim), gemm_scratch_size(seq_len, head_dim, seq_len));
+    // Each part's columns of the projections and share of the FFN (all of them in one part)
+    const int parts = std::max(tensor_parallel, 1);
+    for (int part = 0; part < parts; ++part) {
+        const int width = (num_heads * (part + 1) / parts - num_heads * part / parts) * head_dim;
+        const int ff_width = feedforward_dim * (part + 1) / parts - feedforward_dim * part / parts;
+        scratch = std::max({scratch, gemm_scratch_size(rows, width, embedding_dim),
+                            gemm_scratch_size(rows, embedding_dim, width), gemm_scratch_size(rows, ff_width, embedding_dim),
+                            gemm_scratch_size(rows, embedding_dim, ff_width)});
+    }
+    return scratch;
+}
+
+size_t TransformerBlock::backward_scratch_size(int batch_size, int seq_len) const {
+    const Eigen::Index rows = static_cast<Eigen::Index>(batch_size) * seq_len;
+    const int head_dim = embedding_dim / num_heads;
+    // A chunk's score gradient and row dots, with its per-head products
+    size_t scratch = AlignedBuffer::padded(static_cast<size_t>(seq_len) * seq_len) + AlignedBuffer::padded(seq_len) +
+                     std::max(gemm_scratch_size(seq_len, seq_len, head_dim), gemm_scratch_size(seq_len, head_dim, seq_len));
+    // Weight gradients over all rows, and input gradients
+    return std::max({scratch, gemm_scratch_size(embedding_dim, feedforward_dim, rows),
+                     gemm_scratch_size(feedforward_dim, embedding_dim, rows),
+                     gemm_scratch_size(embedding_dim, embedding_dim, rows),
+                     gemm_scratch_size(rows, feedforward_dim, embedding_dim),
+                     gemm_scratch_size(rows, embedding_dim, feedforward_dim),
+                     gemm_scratch_size(rows, embedding_dim, embedding_dim)});
 }
@@ -1,75 +1,19 @@
 #include "../include/GPTModel.h"
+#include "../include/Arena.h"
 #include "../include/Logger.h"
 #include "../include/Metrics.h"
+#include "../include/DataPipeline.h"
+#include "../include/Communicator.h"
+#include "../include/ThreadPool.h"
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <vector>
+#include <sstream>
+#include <algorithm>
+#include <thread>
 #include <cstring> // For strcmp
-#include <json.hpp> // Include JSON library (e.g., nlohmann/json.hpp)
-
-
-// Function to clean text
-std::string clean_text(const std::string& text) {
-    std::string cleaned;
-    
-    // Remove unwanted characters and normalize case
-    for (char ch : text) {
-        if (std::isalnum(ch) || std::isspace(ch)) {
-            cleaned += std::tolower(ch);
-        }
-    }
-
-    // Normalize whitespace
-    std::string normalized;
-    bool in_whitespace = false;
-    for (char ch : cleaned) {
-        if (std::isspace(ch)) {
-            if (!in_whitespace) {
-                normalized += ' ';
-                in_whitespace = true;
-            }
-        } else {
-            normalized += ch;
-            in_whitespace = false;
-        }
-    }
-    
-    return normalized;
-}
-
-// JSON Parsing Library Alias
-using json = nlohmann::json;
-
-std::vector<std::string> load_text_from_json(const std::string& file_path, int max_entries) {
-    std::vector<std::string> corpus;
-    std::ifstream file(file_path);
-
-    if (!file.is_open()) {
-        std::cerr << "Error: Could not open file " << file_path << std::endl;
-        exit(1);
-    }
-
-    std::string line;
-    int count = 0;
-
-    while (std::getline(file, line) && count < max_entries) {
-        try {
-            json parsed_line = json::parse(line);
-            if (parsed_line.contains("text")) {
-                std::string cleaned_text = clean_text(parsed_line["text"].get<std::string>());
-                std::cout << "Cleaned text: " << cleaned_text << std::endl;
-                corpus.push_back(cleaned_text);
-                ++count;
-            }
-        } catch (const json::parse_error& e) {
-            std::cerr << "Error parsing JSON line: " << e.what() << std::endl;
-        }
-    }
-    
-    file.close();
-    return corpus;
-}
+#include <unistd.h> // For getppid
 
 int main(int argc, char* argv[]) {
     LogLevel log_level = LogLevel::INFO;
@@ -82,8 +26,34 @@ int main(int argc, char* argv[]) {
     double learning_rate = 0.001;
     int num_epochs = 10;
     int num_layers = 2;
-    int max_entries = 1000; // Number of entries from JSON file
-    std::string json_file = "data.json";
+    PipelineOptions pipeline_options; // Data loading: file, max entries, threads, shuffling
+    std::string optimizer_name = "sgd";
+    OptimizerOptions optimizer_options;
+    int num_threads = 0;         // Thread pool size (0: hardware threads minus the loader's)
+    bool numa = false;           // Pin threads and place parameters per NUMA node
+    int train_threads = 1;       // Data-parallel slices per batch
+    int pipeline_stages = 1;     // Pipeline-parallel stages over the blocks
+    int tensor_parallel = 1;     // Parts each block's heads and FFN are split into
+    int micro_batches = 0;       // Micro-batches per batch when pipelining (0: one per row)
+    int recompute_every = 0;     // Activation checkpointing on every k-th block (0: off)
+    int rank = 0;                // Multi-process training: this process's rank,
+    int world_size = 1;          // the number of processes,
+    std::string comm_name;       // and the shared-memory segment they meet in
+    std::string load_checkpoint; // Start from a saved model instead of random weights
+    std::string save_checkpoint; // Write the trained model here
+    int checkpoint_every = 0;    // Also write it in the background every N steps
+    bool tie_embeddings = false; // Output layer shares the embedding matrix
+    bool sparse_embeddings = false; // Row-sparse embedding gradients with lazy updates
+    int num_hashes = 0;          // Hashed vocabulary tables: rows summed per token (0: one row per token)
+    int hash_buckets = 0;        // and rows per hash
+    PositionType position_type = PositionType::NONE; // Position information given to the blocks
+    int max_positions = 0;       // Rows of the position tables (0: --seq-len)
+    std::vector<int> softmax_cutoffs; // Adaptive softmax cluster boundaries (empty: full softmax)
+    int sampled_negatives = 0;   // Sampled softmax negatives per step (0: full softmax)
+    SamplerType sampler_type = SamplerType::LOG_UNIFORM; // Distribution the negatives are drawn from
+    bool plan_only = false;      // Print the memory plan and exit without training
+    QuantizationType quantization = QuantizationType::NONE; // Quantize the vocabulary tables after training
+    int quantize_group = -1;     // Values per quantization scale (-1: per row for int8, 32 for int4)
 
     // Parse command-line arguments
     for (int i = 1; i < argc; ++i) {
@@ -114,72 +84,432 @@ int main(int argc, char* argv[]) {
             }
             ++i;
         } else if (strcmp(argv[i], "--json_file") == 0 && i + 1 < argc) {
-            json_file = argv[i + 1];
+            pipeline_options.json_file = argv[i + 1];
             ++i;
         } else if (strcmp(argv[i], "--max_entries") == 0 && i + 1 < argc) {
-            max_entries = std::atoi(argv[i + 1]);
-            if (max_entries <= 0) {
+            pipeline_options.max_entries = std::atoi(argv[i + 1]);
+            if (pipeline_options.max_entries <= 0) {
                 std::cerr << "Invalid value for --max_entries. Must be a positive integer.\n";
                 return 1;
             }
             ++i;
+        } else if (strcmp(argv[i], "--loader-threads") == 0 && i + 1 < argc) {
+            pipeline_options.worker_threads = std::atoi(argv[i + 1]);
+            if (pipeline_options.worker_threads <= 0) {
+                std::cerr << "Invalid value for --loader-threads. Must be a positive integer.\n";
+                return 1;
+            }
+            ++i;
+        } else if (strcmp(argv[i], "--queue-depth") == 0 && i + 1 < argc) {
+            int depth = std::atoi(argv[i + 1]);
+            if (depth <= 0) {
+                std::cerr << "Invalid value for --queue-depth. Must be a positive integer.\n";
+                return 1;
+            }
+            pipeline_options.queue_depth = depth;
+            ++i;
+        } else if (strcmp(argv[i], "--shuffle") == 0) {
+            pipeline_options.shuffle = true;
+        } else if (strcmp(argv[i], "--packing") == 0 && i + 1 < argc) {
+            if (strcmp(argv[i + 1], "none") == 0) pipeline_options.packing.mode = PackingMode::NONE;
+            else if (strcmp(argv[i + 1], "concat") == 0) pipeline_options.packing.mode = PackingMode::CONCATENATE;
+            else if (strcmp(argv[i + 1], "bucket") == 0) pipeline_options.packing.mode = PackingMode::BUCKET;
+            else {
+                std::cerr << "Invalid value for --packing. Must be one of none, concat, bucket.\n";
+                return 1;
+            }
+            ++i;
+        } else if (strcmp(argv[i], "--seq-len") == 0 && i + 1 < argc) {
+            pipeline_options.packing.seq_len = std::atoi(argv[i + 1]);
+            if (pipeline_options.packing.seq_len <= 0) {
+                std::cerr << "Invalid value for --seq-len. Must be a positive integer.\n";
+                return 1;
+            }
+            ++i;
+        } else if (strcmp(argv[i], "--batch-size") == 0 && i + 1 < argc) {
+            pipeline_options.packing.batch_size = std::atoi(argv[i + 1]);
+            if (pipeline_options.packing.batch_size <= 0) {
+                std::cerr << "Invalid value for --batch-size. Must be a positive integer.\n";
+                return 1;
+            }
+            ++i;
+        } else if (strcmp(argv[i], "--attention-reset") == 0) {
+            pipeline_options.packing.reset_attention = true;
+        } else if (strcmp(argv[i], "--optimizer") == 0 && i + 1 < argc) {
+            optimizer_name = argv[i + 1];
+            if (optimizer_name != "sgd" && optimizer_name != "adamw") {
+                std::cerr << "Invalid value for --optimizer. Must be one of sgd, adamw.\n";
+                return 1;
+            }
+            ++i;
+        } else if (strcmp(argv[i], "--learning-rate") == 0 && i + 1 < argc) {
+            learning_rate = std::atof(argv[i + 1]);
+            if (learning_rate <= 0.0) {
+                std::cerr << "Invalid value for --learning-rate. Must be positive.\n";
+                return 1;
+            }
+            ++i;
+        } else if (strcmp(argv[i], "--momentum") == 0 && i + 1 < argc) {
+            optimizer_options.momentum = std::atof(argv[i + 1]);
+            ++i;
+        } else if (strcmp(argv[i], "--weight-decay") == 0 && i + 1 < argc) {
+            optimizer_options.weight_decay = std::atof(argv[i + 1]);
+            ++i;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            num_threads = std::atoi(argv[i + 1]);
+            if (num_threads <= 0) {
+                std::cerr << "Invalid value for --threads. Must be a positive integer.\n";
+                return 1;
+            }
+            ++i;
+        } else if (strcmp(argv[i], "--numa") == 0) {
+            numa = true;
+        } else if (strcmp(argv[i], "--train-threads") == 0 && i + 1 < argc) {
+            train_threads = std::atoi(argv[i + 1]);
+            if (train_threads <= 0) {
+                std::cerr << "Invalid value for --train-threads. Must be a positive integer.\n";
+                return 1;
+            }
+            ++i;
+        } else if (strcmp(argv[i], "--pipeline-stages") == 0 && i + 1 < argc) {
+            pipeline_stages = std::atoi(argv[i + 1]);
+            if (pipeline_stages <= 0) {
+                std::cerr << "Invalid value for --pipeline-stages. Must be a positive integer.\n";
+                return 1;
+            }
+            ++i;
+        } else if (strcmp(argv[i], "--micro-batches") == 0 && i + 1 < argc) {
+            micro_batches = std::atoi(argv[i + 1]);
+            if (micro_batches <= 0) {
+                std::cerr << "Invalid value for --micro-batches. Must be a positive integer.\n";
+                return 1;
+            }
+            ++i;
+        } else if (strcmp(argv[i], "--tensor-parallel") == 0 && i + 1 < argc) {
+            tensor_parallel = std::atoi(argv[i + 1]);
+            if (tensor_parallel <= 0) {
+                std::cerr << "Invalid value for --tensor-parallel. Must be a positive integer.\n";
+                return 1;
+            }
+            ++i;
+        } else if (strcmp(argv[i], "--activation-checkpointing") == 0 && i + 1 < argc) {
+            recompute_every = std::atoi(argv[i + 1]);
+            if (recompute_every < 0) {
+                std::cerr << "Invalid value for --activation-checkpointing. Must be a non-negative integer.\n";
+                return 1;
+            }
+            ++i;
+        } else if (strcmp(argv[i], "--rank") == 0 && i + 1 < argc) {
+            rank = std::atoi(argv[i + 1]);
+            ++i;
+        } else if (strcmp(argv[i], "--world-size") == 0 && i + 1 < argc) {
+            world_size = std::atoi(argv[i + 1]);
+            if (world_size <= 0) {
+                std::cerr << "Invalid value for --world-size. Must be a positive integer.\n";
+                return 1;
+            }
+            ++i;
+        } else if (strcmp(argv[i], "--comm-name") == 0 && i + 1 < argc) {
+            comm_name = argv[i + 1];
+            ++i;
+        } else if (strcmp(argv[i], "--tie-embeddings") == 0) {
+            tie_embeddings = true;
+        } else if (strcmp(argv[i], "--sparse-embeddings") == 0) {
+            sparse_embeddings = true;
+        } else if (strcmp(argv[i], "--hash-embeddings") == 0 && i + 1 < argc) {
+            num_hashes = std::atoi(argv[i + 1]);
+            if (num_hashes <= 0) {
+                std::cerr << "Invalid value for --hash-embeddings. Must be a positive integer.\n";
+                return 1;
+            }
+            ++i;
+        } else if (strcmp(argv[i], "--hash-buckets") == 0 && i + 1 < argc) {
+            hash_buckets = std::atoi(argv[i + 1]);
+            if (hash_buckets <= 0) {
+                std::cerr << "Invalid value for --hash-buckets. Must be a positive integer.\n";
+                return 1;
+            }
+            ++i;
+        } else if (strcmp(argv[i], "--positions") == 0 && i + 1 < argc) {
+            if (strcmp(argv[i + 1], "none") == 0) position_type = PositionType::NONE;
+            else if (strcmp(argv[i + 1], "sinusoidal") == 0) position_type = PositionType::SINUSOIDAL;
+            else if (strcmp(argv[i + 1], "learned") == 0) position_type = PositionType::LEARNED;
+            else if (strcmp(argv[i + 1], "rope") == 0) position_type = PositionType::ROTARY;
+            else {
+                std::cerr << "Invalid value for --positions. Must be none, sinusoidal, learned or rope.\n";
+                return 1;
+            }
+            ++i;
+        } else if (strcmp(argv[i], "--max-positions") == 0 && i + 1 < argc) {
+            max_positions = std::atoi(argv[i + 1]);
+            if (max_positions <= 0) {
+                std::cerr << "Invalid value for --max-positions. Must be a positive integer.\n";
+                return 1;
+            }
+            ++i;
+        } else if (strcmp(argv[i], "--adaptive-softmax") == 0 && i + 1 < argc) {
+            std::istringstream list(argv[i + 1]);
+            std::string cutoff;
+            softmax_cutoffs.clear();
+            while (std::getline(list, cutoff, ',')) {
+                int value = std::atoi(cutoff.c_str());
+                if (value <= (softmax_cutoffs.empty() ? 0 : softmax_cutoffs.back())) {
+                    std::cerr << "Invalid value for --adaptive-softmax. Must be increasing positive cutoffs, "
+                                 "e.g. 2000,10000.\n";
+                    return 1;
+                }
+                softmax_cutoffs.push_back(value);
+            }
+            ++i;
+        } else if (strcmp(argv[i], "--sampled-softmax") == 0 && i + 1 < argc) {
+            sampled_negatives = std::atoi(argv[i + 1]);
+            if (sampled_negatives <= 0) {
+                std::cerr << "Invalid value for --sampled-softmax. Must be a positive integer.\n";
+                return 1;
+            }
+            ++i;
+        } else if (strcmp(argv[i], "--sampler") == 0 && i + 1 < argc) {
+            if (strcmp(argv[i + 1], "log-uniform") == 0) sampler_type = SamplerType::LOG_UNIFORM;
+            else if (strcmp(argv[i + 1], "unigram") == 0) sampler_type = SamplerType::UNIGRAM;
+            else {
+                std::cerr << "Invalid value for --sampler. Must be log-uniform or unigram.\n";
+                return 1;
+            }
+            ++i;
+        } else if (strcmp(argv[i], "--plan-memory") == 0) {
+            plan_only = true;
+        } else if (strcmp(argv[i], "--quantize") == 0 && i + 1 < argc) {
+            if (strcmp(argv[i + 1], "int8") == 0) quantization = QuantizationType::INT8;
+            else if (strcmp(argv[i + 1], "int4") == 0) quantization = QuantizationType::INT4;
+            else {
+                std::cerr << "Invalid value for --quantize. Must be int8 or int4.\n";
+                return 1;
+            }
+            ++i;
+        } else if (strcmp(argv[i], "--quantize-group") == 0 && i + 1 < argc) {
+            quantize_group = std::atoi(argv[i + 1]);
+            if (quantize_group < 0) {
+                std::cerr << "Invalid value for --quantize-group. Must be a non-negative integer (0: one per row).\n";
+                return 1;
+            }
+            ++i;
+        } else if (strcmp(argv[i], "--load-checkpoint") == 0 && i + 1 < argc) {
+            load_checkpoint = argv[i + 1];
+            ++i;
+        } else if (strcmp(argv[i], "--save-checkpoint") == 0 && i + 1 < argc) {
+            save_checkpoint = argv[i + 1];
+            ++i;
+        } else if (strcmp(argv[i], "--checkpoint-every") == 0 && i + 1 < argc) {
+            checkpoint_every = std::atoi(argv[i + 1]);
+            if (checkpoint_every <= 0) {
+                std::cerr << "Invalid value for --checkpoint-every. Must be a positive integer.\n";
+                return 1;
+            }
+            ++i;
         }
     }
 
-    Logger& logger = Logger::get_instance("logs/gpt_training_with_metrics.log", log_level);
-    logger.log("Log level set to " + std::to_string(static_cast<int>(log_level)), LogLevel::INFO);
+    if ((num_hashes > 0) != (hash_buckets > 0)) {
+        std::cerr << "--hash-embeddings and --hash-buckets must be given together.\n";
+        return 1;
+    }
+    if (!softmax_cutoffs.empty() && (tie_embeddings || num_hashes > 0)) {
+        std::cerr << "--adaptive-softmax cannot be combined with --tie-embeddings or --hash-embeddings.\n";
+        return 1;
+    }
+    if (!softmax_cutoffs.empty() && softmax_cutoffs.back() >= vocab_size) {
+        std::cerr << "--adaptive-softmax cutoffs must be below --vocab-size.\n";
+        return 1;
+    }
+    if (sampled_negatives > 0 && (!softmax_cutoffs.empty() || num_hashes > 0)) {
+        std::cerr << "--sampled-softmax cannot be combined with --adaptive-softmax or --hash-embeddings.\n";
+        return 1;
+    }
+    if (sampled_negatives >= vocab_size) {
+        std::cerr << "--sampled-softmax must be below --vocab-size.\n";
+        return 1;
+    }
+    // Clusters and the log-uniform sampler follow the frequency order of the token IDs
+    pipeline_options.sort_vocab = !softmax_cutoffs.empty() || sampled_negatives > 0;
+    pipeline_options.count_tokens = sampled_negatives > 0 && sampler_type == SamplerType::UNIGRAM;
+    if (rank < 0 || rank >= world_size) {
+        std::cerr << "Invalid value for --rank. Must be between 0 and --world-size - 1.\n";
+        return 1;
+    }
 
-    // Load text data from JSON file
-    logger.log("Loading data from JSON file: " + json_file, LogLevel::INFO);
-    std::vector<std::string> corpus = load_text_from_json(json_file, max_entries);
-    logger.log("Loaded " + std::to_string(corpus.size()) + " entries from JSON.", LogLevel::INFO);
+    // One log per rank when several processes train together
+    std::string log_file = "logs/gpt_training_with_metrics.log";
+    if (world_size > 1) log_file = "logs/gpt_training_with_metrics.rank" + std::to_string(rank) + ".log";
+    Logger& logger = Logger::get_instance(log_file, log_level);
+    logger.log("Log level set to " + std::to_string(static_cast<int>(log_level)), LogLevel::INFO);
+    // By default the pool takes the hardware threads the loader's stages leave free
+    if (num_threads == 0) {
+        const int hardware = static_cast<int>(std::thread::hardware_concurrency());
+        num_threads = std::max(1, hardware - DataPipeline::compute_threads(pipeline_options));
+    }
+    ThreadPool::set_num_threads(num_threads);
 
-    // Initialize GPTModel
+    // Initialize GPTModel, or map it from a checkpoint (which fixes the model configuration)
     logger.log("Initializing GPTModel", LogLevel::INFO);
-    GPTModel model(vocab_size, embedding_dim, num_layers, num_heads, feedforward_dim, learning_rate);
-
-    // Build vocabulary for the tokenizer
-    model.get_tokenizer().build_vocab(corpus);
-    logger.log("Vocabulary built with " + std::to_string(vocab_size) + " unique tokens.", LogLevel::INFO);
+    std::unique_ptr<GPTModel> model_ptr;
+    if (!load_checkpoint.empty()) {
+        model_ptr = GPTModel::load(load_checkpoint, learning_rate);
+        if (!model_ptr) {
+            std::cerr << "Error: Could not load checkpoint " << load_checkpoint << std::endl;
+            return 1;
+        }
+        vocab_size = model_ptr->get_vocab_size();
+    } else {
+        model_ptr = std::make_unique<GPTModel>(vocab_size, embedding_dim, num_layers, num_heads, feedforward_dim,
+                                               learning_rate, tie_embeddings, VocabularyHash(num_hashes, hash_buckets),
+                                               position_type,
+                                               max_positions > 0 ? max_positions : pipeline_options.packing.seq_len,
+                                               softmax_cutoffs);
+    }
+    GPTModel& model = *model_ptr;
+    model.set_num_threads(train_threads);
+    if (numa) model.set_numa(world_size > 1 ? rank : -1); // One node per rank, or spread over all
+    if (tensor_parallel > 1) model.set_tensor_parallel(tensor_parallel);
+    if (recompute_every > 0) model.set_activation_checkpointing(recompute_every);
+    if (pipeline_stages > 1) {
+        model.set_pipeline(pipeline_stages, micro_batches > 0 ? micro_batches : pipeline_options.packing.batch_size);
+    }
+    optimizer_options.learning_rate = learning_rate;
+    if (optimizer_name == "adamw") {
+        model.set_optimizer(std::make_unique<AdamW>(model.parameters(), optimizer_options));
+    } else {
+        model.set_optimizer(std::make_unique<SGD>(model.parameters(), optimizer_options));
+    }
+    if (sparse_embeddings) model.set_sparse_embeddings(true);
+    // The unigram sampler is rebuilt with the token counts once the data is indexed
+    if (sampled_negatives > 0) model.set_sampled_softmax(sampled_negatives, sampler_type);
 
-    // Prepare training dataset
-    std::vector<std::pair<std::string, Eigen::MatrixXd>> dataset;
-    for (const auto& text : corpus) {
-        auto tokens = model.get_tokenizer().tokenize(text);
-        Eigen::MatrixXd targets = Eigen::MatrixXd::Zero(tokens.size(), vocab_size);
+    // Peak memory of a step for the configured batch shape, before any data is
+    // read: training steps, and the evaluation passes after them
+    MemoryPlan memory_plan = model.plan_memory(pipeline_options.packing.batch_size, pipeline_options.packing.seq_len,
+                                               true);
+    MemoryPlan inference_plan = model.plan_memory(pipeline_options.packing.batch_size,
+                                                  pipeline_options.packing.seq_len, false);
+    logger.log(MemoryPlanner::report(memory_plan), LogLevel::INFO);
+    logger.log(MemoryPlanner::report(inference_plan), LogLevel::INFO);
+    if (plan_only) return 0;
 
-        for (size_t i = 0; i < tokens.size(); ++i) {
-            if (tokens[i] >= 0 && tokens[i] < vocab_size) {
-                targets(i, tokens[i]) = 1; // Create one-hot target
-            }
+    // Processes launched together from one shell share a default segment name
+    std::unique_ptr<ShmCommunicator> communicator;
+    if (world_size > 1) {
+        if (comm_name.empty()) comm_name = "/mairc-" + std::to_string(getppid());
+        communicator = ShmCommunicator::create(comm_name, rank, world_size, model.get_store().size(),
+                                               model.gradient_buckets());
+        if (!communicator) {
+            std::cerr << "Error: Could not join " << comm_name << " as rank " << rank << std::endl;
+            return 1;
         }
-        dataset.emplace_back(text, targets);
+        model.set_communicator(communicator.get());
+        pipeline_options.rank = rank;
+        pipeline_options.world_size = world_size;
     }
+    const bool is_root = rank == 0; // Only rank 0 writes checkpoints
 
-    // Training loop
+    // Index the JSON file and build the vocabulary in one streaming pass
+    logger.log("Loading data from JSON file: " + pipeline_options.json_file, LogLevel::INFO);
+    DataPipeline pipeline(pipeline_options, model.get_tokenizer(), vocab_size);
+    if (pipeline.build_index() == 0) {
+        std::cerr << "Error: No entries loaded from " << pipeline_options.json_file << std::endl;
+        return 1;
+    }
+    logger.log("Indexed " + std::to_string(pipeline.size()) + " entries from JSON.", LogLevel::INFO);
+    if (pipeline_options.count_tokens) {
+        model.set_sampled_softmax(sampled_negatives, sampler_type, pipeline.token_counts());
+    }
+    logger.log("Vocabulary built with " + std::to_string(vocab_size) + " unique tokens.", LogLevel::INFO);
+
+    // Training loop: the pipeline prepares examples in the background, and
+    // periodic checkpoints are written without pausing training
+    CheckpointWriter checkpoint_writer;
+    long step = 0;
     for (int epoch = 0; epoch < num_epochs; ++epoch) {
         logger.log("Starting epoch " + std::to_string(epoch + 1), LogLevel::INFO);
 
         double total_loss = 0.0;
         double total_accuracy = 0.0;
         double total_perplexity = 0.0;
+        size_t num_batches = 0;
 
-        for (const auto& [input_text, targets] : dataset) {
-            double loss = model.train(input_text, targets);
+        pipeline.start_epoch(epoch);
+        TokenBatch batch;
+        Eigen::MatrixXd predictions;
+        while (true) {
+            // Ranks step together until every shard is exhausted
+            bool has_batch = pipeline.next_batch(batch);
+            if (communicator ? communicator->all_reduce_sum(has_batch ? 1 : 0) == 0 : !has_batch) break;
+            if (!has_batch) {
+                model.skip_batch();
+                ++step;
+                continue;
+            }
+
+            double loss = model.train(batch);
             total_loss += loss;
+            ++step;
+            if (is_root && checkpoint_every > 0 && !save_checkpoint.empty() && step % checkpoint_every == 0) {
+                model.save_async(checkpoint_writer, save_checkpoint);
+            }
 
             // Evaluate
-            auto predictions = model.forward(input_text);
-            total_accuracy += Metrics::accuracy(predictions, targets);
-            total_perplexity += Metrics::perplexity(predictions, targets);
+            model.forward(batch, predictions);
+            total_accuracy += Metrics::accuracy(predictions, batch.targets);
+            total_perplexity += Metrics::perplexity(predictions, batch.targets);
+            ++num_batches;
         }
 
         logger.log("Epoch " + std::to_string(epoch + 1) +
-                   " - Loss: " + std::to_string(total_loss / dataset.size()) +
-                   ", Accuracy: " + std::to_string(total_accuracy / dataset.size()) +
-                   ", Perplexity: " + std::to_string(total_perplexity / dataset.size()), LogLevel::INFO);
+                   " - Loss: " + std::to_string(total_loss / num_batches) +
+                   ", Accuracy: " + std::to_string(total_accuracy / num_batches) +
+                   ", Perplexity: " + std::to_string(total_perplexity / num_batches), LogLevel::INFO);
     }
 
     logger.log("Training completed successfully.", LogLevel::INFO);
+
+    // The plans model every arena allocation, so no thread's arena may have outgrown their slab
+    const size_t planned = std::max(memory_plan.slab_size, inference_plan.slab_size);
+    const size_t arena_peak = Arena::get_largest_peak();
+    logger.log("Largest arena peak " + MemoryPlanner::megabytes(arena_peak) + " (" + std::to_string(arena_peak) +
+                   " doubles) against the planned slab of " + MemoryPlanner::megabytes(planned) + " (" +
+                   std::to_string(planned) + " doubles)",
+               arena_peak <= planned ? LogLevel::INFO : LogLevel::WARNING);
+
+    // Evaluate the model as it would be served over the data once more: with
+    // quantized tables (which the checkpoint keeps) and/or per-node replicas
+    if (quantization != QuantizationType::NONE || numa) {
+        if (quantization != QuantizationType::NONE) {
+            if (quantize_group < 0) quantize_group = quantization == QuantizationType::INT4 ? 32 : 0;
+            model.quantize(quantization, quantize_group);
+        }
+        if (numa) model.replicate_weights();
+        double total_accuracy = 0.0;
+        double total_perplexity = 0.0;
+        size_t num_batches = 0;
+        pipeline.start_epoch(num_epochs);
+        TokenBatch batch;
+        Eigen::MatrixXd predictions;
+        while (pipeline.next_batch(batch)) {
+            model.forward(batch, predictions);
+            total_accuracy += Metrics::accuracy(predictions, batch.targets);
+            total_perplexity += Metrics::perplexity(predictions, batch.targets);
+            ++num_batches;
+        }
+        if (num_batches > 0) {
+            const std::string label = quantization != QuantizationType::NONE
+                                          ? std::string("Quantized (") + QuantizedTable::name(quantization) + ")"
+                                          : "Inference";
+            logger.log(label + " - Accuracy: " + std::to_string(total_accuracy / num_batches) +
+                       ", Perplexity: " + std::to_string(total_perplexity / num_batches), LogLevel::INFO);
+        }
+    }
+    checkpoint_writer.wait();
+    if (is_root && !save_checkpoint.empty() && !model.save(save_checkpoint)) {
+        std::cerr << "Error: Could not save checkpoint " << save_checkpoint << std::endl;
+        return 1;
+    }
     return 0;
 }